@@ -0,0 +1,185 @@
+#pragma once
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+
+// CSG brushes for editing the voxel grid.
+// Brush positions use the same (negated) space as the camera and RayCast: the voxel at
+// global grid coordinate g sits at position -g, see voxelNS::pos_to_chunkIndex.
+namespace voxelNS
+{
+    enum BrushShape { BRUSH_SPHERE, BRUSH_BOX, BRUSH_CAPSULE, BRUSH_CYLINDER };
+    enum BrushOp { BRUSH_SUBTRACT, BRUSH_ADD };
+
+    struct Brush {
+        BrushShape shape;
+        BrushOp op;
+        glm::vec3 a;    // center (sphere, box) or first end point (capsule, cylinder)
+        glm::vec3 b;    // half extents (box) or second end point (capsule, cylinder)
+        float radius;   // unused by box
+    };
+
+    // Exact bounds of the voxels an edit changed within one chunk, in chunk-local voxel coordinates (inclusive)
+    struct DirtyRegion {
+        int chunkIndex;
+        glm::ivec3 min;
+        glm::ivec3 max;
+    };
+
+    inline Brush SphereBrush(glm::vec3 center, float radius, BrushOp op) { return { BRUSH_SPHERE, op, center, glm::vec3(0.0f), radius }; }
+    inline Brush BoxBrush(glm::vec3 center, glm::vec3 halfExtents, BrushOp op) { return { BRUSH_BOX, op, center, halfExtents, 0.0f }; }
+    inline Brush CapsuleBrush(glm::vec3 a, glm::vec3 b, float radius, BrushOp op) { return { BRUSH_CAPSULE, op, a, b, radius }; }
+    inline Brush CylinderBrush(glm::vec3 a, glm::vec3 b, float radius, BrushOp op) { return { BRUSH_CYLINDER, op, a, b, radius }; }
+
+    // Bounding box of the brush in brush space
+    void Brush_Bounds(const Brush& brush, glm::vec3& lo, glm::vec3& hi) {
+        switch (brush.shape) {
+        case BRUSH_SPHERE:
+            lo = brush.a - glm::vec3(brush.radius);
+            hi = brush.a + glm::vec3(brush.radius);
+            break;
+        case BRUSH_BOX:
+            lo = brush.a - brush.b;
+            hi = brush.a + brush.b;
+            break;
+        case BRUSH_CAPSULE:
+        case BRUSH_CYLINDER:
+            lo = glm::min(brush.a, brush.b) - glm::vec3(brush.radius);
+            hi = glm::max(brush.a, brush.b) + glm::vec3(brush.radius);
+            break;
+        }
+    }
+
+    // Grid coordinates (inclusive) of the voxels the brush's bounds cover, false when they lie outside the grid
+    bool Brush_Grid_Bounds(const Brush& brush, glm::ivec3& gridMin, glm::ivec3& gridMax) {
+        const int worldDimension = PLANET_DIMENSION * CHUNK_DIMENSION;
+        glm::vec3 lo, hi;
+        Brush_Bounds(brush, lo, hi);
+        // position -g lies in [lo, hi]  <=>  g lies in [-hi, -lo]
+        gridMin = glm::max(glm::ivec3(glm::ceil(-hi)), glm::ivec3(0));
+        gridMax = glm::min(glm::ivec3(glm::floor(-lo)), glm::ivec3(worldDimension - 1));
+        return gridMin.x <= gridMax.x && gridMin.y <= gridMax.y && gridMin.z <= gridMax.z;
+    }
+
+    bool Brush_Contains(const Brush& brush, glm::vec3 p) {
+        switch (brush.shape) {
+        case BRUSH_SPHERE: {
+            glm::vec3 d = p - brush.a;
+            return glm::dot(d, d) < brush.radius * brush.radius;
+        }
+        case BRUSH_BOX: {
+            glm::vec3 d = glm::abs(p - brush.a);
+            return d.x <= brush.b.x && d.y <= brush.b.y && d.z <= brush.b.z;
+        }
+        case BRUSH_CAPSULE:
+        case BRUSH_CYLINDER: {
+            glm::vec3 axis = brush.b - brush.a;
+            glm::vec3 d = p - brush.a;
+            float axisLength2 = glm::dot(axis, axis);
+            float t = axisLength2 > 0.0f ? glm::dot(d, axis) / axisLength2 : 0.0f;
+            if (brush.shape == BRUSH_CYLINDER) {
+                if (t < 0.0f || t > 1.0f) {
+                    return false;
+                }
+            }
+            else {
+                t = glm::clamp(t, 0.0f, 1.0f);
+            }
+            glm::vec3 perpendicular = d - axis * t;
+            return glm::dot(perpendicular, perpendicular) < brush.radius * brush.radius;
+        }
+        }
+        return false;
+    }
+
+    // Applies the brushes in order and appends one DirtyRegion per chunk whose voxels actually changed.
+    // Overlapping brushes are resolved per voxel (the last brush touching a voxel wins), and each voxel
+    // is visited once per call no matter how many brushes cover it.
+    void Apply_Brushes(const Brush* brushes, size_t brushCount, Chunk** chunk, std::vector<DirtyRegion>& dirtyRegions) {
+        struct BrushCover {
+            int chunkIndex;
+            uint32_t brushIndex;
+            glm::ivec3 min, max; // global grid coordinates (inclusive)
+        };
+        std::vector<BrushCover> covers;
+        for (uint32_t i = 0; i < brushCount; i++) {
+            glm::ivec3 gridMin, gridMax;
+            if (!Brush_Grid_Bounds(brushes[i], gridMin, gridMax)) {
+                continue; // out of bound
+            }
+            glm::ivec3 chunkMin = gridMin / CHUNK_DIMENSION;
+            glm::ivec3 chunkMax = gridMax / CHUNK_DIMENSION;
+            for (int z = chunkMin.z; z <= chunkMax.z; z++) {
+                for (int y = chunkMin.y; y <= chunkMax.y; y++) {
+                    for (int x = chunkMin.x; x <= chunkMax.x; x++) {
+                        glm::ivec3 chunkOrigin = glm::ivec3(x, y, z) * CHUNK_DIMENSION;
+                        BrushCover cover;
+                        cover.chunkIndex = (z * PLANET_DIMENSION * PLANET_DIMENSION) + (y * PLANET_DIMENSION) + x;
+                        cover.brushIndex = i;
+                        cover.min = glm::max(gridMin, chunkOrigin) - chunkOrigin;
+                        cover.max = glm::min(gridMax, chunkOrigin + glm::ivec3(CHUNK_DIMENSION - 1)) - chunkOrigin;
+                        covers.push_back(cover);
+                    }
+                }
+            }
+        }
+        // Group by chunk, keeping the submission order of the brushes within a chunk
+        std::stable_sort(covers.begin(), covers.end(), [](const BrushCover& l, const BrushCover& r) { return l.chunkIndex < r.chunkIndex; });
+
+        size_t first = 0;
+        while (first < covers.size()) {
+            size_t last = first;
+            glm::ivec3 regionMin = covers[first].min;
+            glm::ivec3 regionMax = covers[first].max;
+            while (last < covers.size() && covers[last].chunkIndex == covers[first].chunkIndex) {
+                regionMin = glm::min(regionMin, covers[last].min);
+                regionMax = glm::max(regionMax, covers[last].max);
+                last++;
+            }
+            int chunkIndex = covers[first].chunkIndex;
+            Chunk* target_chunk = chunk[chunkIndex];
+            glm::ivec3 chunkOrigin = glm::ivec3(chunkIndex_to_pos(chunkIndex)) * CHUNK_DIMENSION;
+
+            DirtyRegion dirty = { chunkIndex, glm::ivec3(CHUNK_DIMENSION), glm::ivec3(-1) };
+            for (int z = regionMin.z; z <= regionMax.z; z++) {
+                for (int y = regionMin.y; y <= regionMax.y; y++) {
+                    for (int x = regionMin.x; x <= regionMax.x; x++) {
+                        glm::ivec3 local = glm::ivec3(x, y, z);
+                        // Added voxels keep out of the one voxel padding around the chunk (see Fill_Chunk),
+                        // otherwise the chunk's mesh would be left open at the chunk border.
+                        bool padding = x == 0 || y == 0 || z == 0 || x == CHUNK_DIMENSION - 1 || y == CHUNK_DIMENSION - 1 || z == CHUNK_DIMENSION - 1;
+                        int voxelIndex = (z * CHUNK_DIMENSION * CHUNK_DIMENSION) + (y * CHUNK_DIMENSION) + x;
+                        uint8_t value = target_chunk->voxel[voxelIndex];
+                        glm::vec3 pos = -glm::vec3(chunkOrigin + local);
+                        for (size_t c = first; c < last; c++) {
+                            const BrushCover& cover = covers[c];
+                            if (x < cover.min.x || y < cover.min.y || z < cover.min.z || x > cover.max.x || y > cover.max.y || z > cover.max.z) {
+                                continue;
+                            }
+                            const Brush& brush = brushes[cover.brushIndex];
+                            if (brush.op == BRUSH_ADD && padding) {
+                                continue;
+                            }
+                            if (Brush_Contains(brush, pos)) {
+                                value = brush.op == BRUSH_ADD ? 1 : 0;
+                            }
+                        }
+                        if (value != target_chunk->voxel[voxelIndex]) {
+                            target_chunk->voxel[voxelIndex] = value;
+                            dirty.min = glm::min(dirty.min, local);
+                            dirty.max = glm::max(dirty.max, local);
+                        }
+                    }
+                }
+            }
+            if (dirty.max.x >= 0) {
+                dirtyRegions.push_back(dirty);
+            }
+            first = last;
+        }
+    }
+
+    void Remove_Voxel(glm::vec3 target, Chunk** chunk, std::vector<DirtyRegion>& dirtyRegions) {
+        Brush brush = SphereBrush(target, 5.0f, BRUSH_SUBTRACT);
+        Apply_Brushes(&brush, 1, chunk, dirtyRegions);
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#include "Occupancy.h"
+
+// Swept AABB collision against the voxel grid.
+// The motion is resolved one axis at a time (largest first), so a body blocked on one axis keeps sliding
+// along the others. Along each axis only the voxel layers the leading face sweeps through are read, in
+// order of travel, and the sweep stops at the first solid layer: the cost follows the distance moved and
+// the cross section of the box, not the size of the world.
+// Positions and motions are in the same (negated) space as the camera and the ray casts of Raycast.h.
+namespace voxelNS
+{
+    struct CollisionBody {
+        glm::vec3 center;
+        glm::vec3 halfExtents;
+        glm::vec3 motion;       // requested displacement
+        glm::vec3 resolved;     // displacement after collision
+        uint8_t blocked;        // bit per axis (1 x, 2 y, 4 z) the motion was cut on
+    };
+
+    // Distance kept between a body and the voxels it rests against
+    const float COLLISION_SKIN = 1e-3f;
+
+    inline bool Is_Solid(Chunk** chunk, const OccupancyPyramid& occupancy, glm::ivec3 g) {
+        const int worldDimension = PLANET_DIMENSION * CHUNK_DIMENSION;
+        if (g.x < 0 || g.y < 0 || g.z < 0 || g.x >= worldDimension || g.y >= worldDimension || g.z >= worldDimension) {
+            return false;
+        }
+        if (occupancy.Empty_Size(g)) {
+            return false;
+        }
+        glm::ivec3 c = g >> CHUNK_SHIFT;
+        glm::ivec3 local = g & (CHUNK_DIMENSION - 1);
+        int chunkIndex = (c.z * PLANET_DIMENSION * PLANET_DIMENSION) + (c.y * PLANET_DIMENSION) + c.x;
+        return chunk[chunkIndex]->voxel[(local.z * CHUNK_DIMENSION * CHUNK_DIMENSION) + (local.y * CHUNK_DIMENSION) + local.x] & 1;
+    }
+
+    // Any solid voxel in the layer `layer` along `axis`, over the cells [lo, hi] of the two other axes
+    inline bool Layer_Solid(Chunk** chunk, const OccupancyPyramid& occupancy, int axis, int layer, glm::ivec3 lo, glm::ivec3 hi) {
+        int u = (axis + 1) % 3;
+        int v = (axis + 2) % 3;
+        glm::ivec3 g;
+        g[axis] = layer;
+        for (g[u] = lo[u]; g[u] <= hi[u]; g[u]++) {
+            for (g[v] = lo[v]; g[v] <= hi[v]; g[v]++) {
+                if (Is_Solid(chunk, occupancy, g)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // One sub-step, lo/hi/motion on the positive grid where voxel g covers [g, g + 1)
+    inline void Sweep_Step(Chunk** chunk, const OccupancyPyramid& occupancy, glm::vec3& lo, glm::vec3& hi, glm::vec3& motion, uint8_t& blocked) {
+        int order[3] = { 0, 1, 2 };
+        std::sort(order, order + 3, [&](int l, int r) { return std::abs(motion[l]) > std::abs(motion[r]); });
+        for (int i = 0; i < 3; i++) {
+            int axis = order[i];
+            float m = motion[axis];
+            if (m == 0.0f) {
+                continue;
+            }
+            // Cells the box covers on the other axes
+            glm::ivec3 crossLo = glm::ivec3(glm::floor(lo + glm::vec3(COLLISION_SKIN)));
+            glm::ivec3 crossHi = glm::ivec3(glm::floor(hi - glm::vec3(COLLISION_SKIN)));
+            if (m > 0.0f) {
+                int first = (int)std::floor(hi[axis] - COLLISION_SKIN) + 1;
+                int last = (int)std::floor(hi[axis] + m);
+                for (int layer = first; layer <= last; layer++) {
+                    if (Layer_Solid(chunk, occupancy, axis, layer, crossLo, crossHi)) {
+                        m = std::max(0.0f, (float)layer - hi[axis] - COLLISION_SKIN);
+                        blocked |= 1 << axis;
+                        break;
+                    }
+                }
+            }
+            else {
+                int first = (int)std::floor(lo[axis] + COLLISION_SKIN) - 1;
+                int last = (int)std::floor(lo[axis] + m);
+                for (int layer = first; layer >= last; layer--) {
+                    if (Layer_Solid(chunk, occupancy, axis, layer, crossLo, crossHi)) {
+                        m = std::min(0.0f, (float)(layer + 1) - lo[axis] + COLLISION_SKIN);
+                        blocked |= 1 << axis;
+                        break;
+                    }
+                }
+            }
+            lo[axis] += m;
+            hi[axis] += m;
+            motion[axis] = m;
+        }
+    }
+
+    void Sweep_AABB(Chunk** chunk, const OccupancyPyramid& occupancy, CollisionBody& body) {
+        glm::vec3 lo = -body.center - body.halfExtents;
+        glm::vec3 hi = -body.center + body.halfExtents;
+        glm::vec3 motion = -body.motion;
+        body.blocked = 0;
+        // Per axis resolution is only exact while a sub-step is no longer than the box is thin,
+        // otherwise a fast diagonal move could hop over a corner
+        float minExtent = std::max(std::min(std::min(body.halfExtents.x, body.halfExtents.y), body.halfExtents.z), 0.5f);
+        float longest = std::max(std::max(std::abs(motion.x), std::abs(motion.y)), std::abs(motion.z));
+        int steps = std::max(1, (int)std::ceil(longest / minExtent));
+        glm::vec3 resolved = glm::vec3(0.0f);
+        for (int i = 0; i < steps; i++) {
+            glm::vec3 stepMotion = motion / (float)steps;
+            uint8_t blocked = 0;
+            Sweep_Step(chunk, occupancy, lo, hi, stepMotion, blocked);
+            resolved += stepMotion;
+            body.blocked |= blocked;
+        }
+        body.resolved = -resolved;
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// Instruction sets of the running CPU beyond the x64 baseline the project is built for.
+// Wider SIMD paths are compiled per function with CPU_TARGET and only called when the CPU has the set;
+// MSVC accepts the intrinsics anywhere, GCC and Clang need the target attribute on every function using them.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define CPU_TARGET(isa)
+#else
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace cpuFeatures
+{
+    struct Support {
+        bool avx = false;
+    };
+
+    inline Support Detect() {
+        Support support;
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        // AVX also needs the OS to save the YMM registers (OSXSAVE set, XCR0 has the XMM and YMM bits)
+        bool ymmSaved = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+        support.avx = ymmSaved && (info[2] & (1 << 28));
+#else
+        __builtin_cpu_init();
+        support.avx = __builtin_cpu_supports("avx");
+#endif
+        return support;
+    }
+    // Detected once, on first use
+    inline const Support& Get() {
+        static const Support support = Detect();
+        return support;
+    }
+    inline bool Avx() { return Get().avx; }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <cstdint>
+
+// Releases deferred until the GPU has retired every frame that could still reference a resource.
+// The owner numbers its frames, calls begin_frame once it knows which of them have completed (e.g. after
+// waiting on the fence of the frame that used the same slot), and pushes the release of anything that
+// was replaced during the current frame. Releases run on the thread calling begin_frame, in push order.
+class DeletionQueue
+{
+public:
+    // completedFrame while no frame has completed yet
+    static const uint64_t NO_FRAME = ~0ull;
+
+    void begin_frame(uint64_t frame, uint64_t completedFrame)
+    {
+        currentFrame = frame;
+        collect(completedFrame);
+    }
+    // release runs once the current frame and every frame before it have completed
+    void push(std::function<void()> release)
+    {
+        pending.push_back({ currentFrame, std::move(release) });
+    }
+    void collect(uint64_t completedFrame)
+    {
+        if (completedFrame == NO_FRAME) {
+            return;
+        }
+        while (!pending.empty() && pending.front().frame <= completedFrame) {
+            std::function<void()> release = std::move(pending.front().release);
+            pending.pop_front();
+            release();
+        }
+    }
+    // Runs every pending release, only once the device is idle
+    void flush()
+    {
+        while (!pending.empty()) {
+            std::function<void()> release = std::move(pending.front().release);
+            pending.pop_front();
+            release();
+        }
+    }
+    size_t size() const { return pending.size(); }
+
+private:
+    struct Entry {
+        uint64_t frame;
+        std::function<void()> release;
+    };
+    std::deque<Entry> pending;
+    uint64_t currentFrame = 0;
+};
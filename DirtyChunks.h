@@ -0,0 +1,85 @@
+#pragma once
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#include "Brush.h"
+
+// World level bookkeeping of the chunks waiting for a remesh.
+// One bit per chunk, so repeated edits of the same chunk between two remeshes cost a bit test and a
+// bounds union, and iterating the set walks the words in chunkIndex order (z, then y, then x) which is
+// deterministic and keeps neighbouring chunks together.
+// Every chunk only samples its own voxels: Fill_Chunk and the brushes keep a one voxel padding shell
+// around each chunk, so an edit never leaves a neighbour's mesh stale and no halo is tracked.
+namespace voxelNS
+{
+    struct ChunkBitset {
+        static const int WORD_COUNT = (CHUNK_COUNT + 63) / 64;
+        uint64_t words[WORD_COUNT] = {};
+
+        bool test(int chunkIndex) const { return (words[chunkIndex >> 6] >> (chunkIndex & 63)) & 1; }
+        void set(int chunkIndex) { words[chunkIndex >> 6] |= uint64_t(1) << (chunkIndex & 63); }
+        void reset(int chunkIndex) { words[chunkIndex >> 6] &= ~(uint64_t(1) << (chunkIndex & 63)); }
+        void clear() { memset(words, 0, sizeof(words)); }
+        // Calls f(chunkIndex) for every set bit in ascending chunkIndex order
+        template <typename F>
+        void for_each(F f) const {
+            for (int i = 0; i < WORD_COUNT; i++) {
+                uint64_t word = words[i];
+                while (word) {
+                    int bit = lowest_bit(word);
+                    f((i << 6) + bit);
+                    word &= word - 1;
+                }
+            }
+        }
+        static int lowest_bit(uint64_t word) {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, word);
+            return (int)index;
+#else
+            return __builtin_ctzll(word);
+#endif
+        }
+    };
+
+    class DirtyChunkSet {
+    public:
+        DirtyChunkSet() {
+            for (int i = 0; i < CHUNK_COUNT; i++) {
+                regions[i] = { i, glm::ivec3(CHUNK_DIMENSION), glm::ivec3(-1) };
+            }
+        }
+
+        // Unions an edit into the set and bumps the chunk's generation
+        void mark(const DirtyRegion& region) {
+            int chunkIndex = region.chunkIndex;
+            DirtyRegion& dirty = regions[chunkIndex];
+            dirty.min = glm::min(dirty.min, region.min);
+            dirty.max = glm::max(dirty.max, region.max);
+            generation[chunkIndex]++;
+            bits.set(chunkIndex);
+        }
+        void mark(const std::vector<DirtyRegion>& dirtyRegions) {
+            for (const DirtyRegion& region : dirtyRegions) {
+                mark(region);
+            }
+        }
+        // Removes a chunk from the set and returns the union of its edits since the last take
+        DirtyRegion take(int chunkIndex) {
+            DirtyRegion region = regions[chunkIndex];
+            regions[chunkIndex] = { chunkIndex, glm::ivec3(CHUNK_DIMENSION), glm::ivec3(-1) };
+            bits.reset(chunkIndex);
+            return region;
+        }
+
+        // Bumped by every edit of the chunk, a mesh job built from an older generation is stale
+        uint32_t generation_of(int chunkIndex) const { return generation[chunkIndex]; }
+        template <typename F>
+        void for_each(F f) const { bits.for_each(f); }
+
+    private:
+        ChunkBitset bits;
+        DirtyRegion regions[CHUNK_COUNT];
+        uint32_t generation[CHUNK_COUNT] = {};
+    };
+}
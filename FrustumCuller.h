@@ -0,0 +1,257 @@
+#pragma once
+#include <vector>
+#include <cfloat>
+#include <chrono>
+#include <algorithm>
+#include <glm/glm.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#include "CpuFeatures.h"
+#define FRUSTUM_CULLER_SSE2
+#endif
+
+// Frustum culling of many axis aligned boxes through an implicit 8-ary hierarchy.
+// Boxes are kept as structure of arrays, and every node of the hierarchy bounds 8 consecutive entries of
+// the level below, so eight boxes are classified against the six planes in one SIMD pass (one AVX
+// iteration when the CPU has AVX, two with SSE2). A node fully outside drops its whole subtree, a node fully inside marks its
+// whole subtree visible without testing it further; only intersecting nodes are descended.
+// The hierarchy is only as tight as the order of the leaves: neighbours in space should be neighbours in
+// index, e.g. by sorting the leaves by morton_code.
+class FrustumCuller
+{
+public:
+    struct Stats {
+        uint32_t visible = 0;       // leaves visible after the last cull
+        uint32_t nodesTested = 0;   // boxes tested by the last cull, nodes and leaves
+        float milliseconds = 0.0f;  // time the last cull took
+    };
+
+    // count leaves, all empty; an empty leaf is never visible
+    void resize(uint32_t count)
+    {
+        leafCount = count;
+        levels.clear();
+        uint32_t levelCount = count;
+        do {
+            Level level;
+            uint32_t padded = (levelCount + GROUP - 1) / GROUP * GROUP;
+            level.minX.assign(padded, FLT_MAX); level.minY.assign(padded, FLT_MAX); level.minZ.assign(padded, FLT_MAX);
+            level.maxX.assign(padded, -FLT_MAX); level.maxY.assign(padded, -FLT_MAX); level.maxZ.assign(padded, -FLT_MAX);
+            level.dirty.assign(padded / GROUP, 0);
+            levels.push_back(std::move(level));
+            levelCount = (levelCount + GROUP - 1) / GROUP;
+        } while (levels.size() < 2 || levels.back().minX.size() > GROUP);
+        nonEmpty.assign(count, 0);
+    }
+    void set_bounds(uint32_t leaf, const glm::vec3& min, const glm::vec3& max)
+    {
+        Level& level = levels[0];
+        if (nonEmpty[leaf] && level.minX[leaf] == min.x && level.minY[leaf] == min.y && level.minZ[leaf] == min.z &&
+            level.maxX[leaf] == max.x && level.maxY[leaf] == max.y && level.maxZ[leaf] == max.z) {
+            return;
+        }
+        level.minX[leaf] = min.x; level.minY[leaf] = min.y; level.minZ[leaf] = min.z;
+        level.maxX[leaf] = max.x; level.maxY[leaf] = max.y; level.maxZ[leaf] = max.z;
+        nonEmpty[leaf] = 1;
+        level.dirty[leaf / GROUP] = 1;
+    }
+    void clear_bounds(uint32_t leaf)
+    {
+        if (!nonEmpty[leaf]) {
+            return;
+        }
+        Level& level = levels[0];
+        level.minX[leaf] = level.minY[leaf] = level.minZ[leaf] = FLT_MAX;
+        level.maxX[leaf] = level.maxY[leaf] = level.maxZ[leaf] = -FLT_MAX;
+        nonEmpty[leaf] = 0;
+        level.dirty[leaf / GROUP] = 1;
+    }
+    // Refits the nodes above leaves changed since the last call, bottom up
+    void update_hierarchy()
+    {
+        for (size_t l = 1; l < levels.size(); l++) {
+            Level& children = levels[l - 1];
+            Level& parents = levels[l];
+            for (uint32_t node = 0; node < children.dirty.size(); node++) {
+                if (!children.dirty[node]) {
+                    continue;
+                }
+                children.dirty[node] = 0;
+                uint32_t first = node * GROUP;
+                float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, maxZ = -FLT_MAX;
+                for (uint32_t i = first; i < first + GROUP; i++) {
+                    minX = std::min(minX, children.minX[i]); minY = std::min(minY, children.minY[i]); minZ = std::min(minZ, children.minZ[i]);
+                    maxX = std::max(maxX, children.maxX[i]); maxY = std::max(maxY, children.maxY[i]); maxZ = std::max(maxZ, children.maxZ[i]);
+                }
+                parents.minX[node] = minX; parents.minY[node] = minY; parents.minZ[node] = minZ;
+                parents.maxX[node] = maxX; parents.maxY[node] = maxY; parents.maxZ[node] = maxZ;
+                parents.dirty[node / GROUP] = 1;
+            }
+        }
+        levels.back().dirty.assign(levels.back().dirty.size(), 0);
+    }
+
+    // visible[leaf] is 1 for every non-empty leaf intersecting the frustum, else 0.
+    // A point p is inside when dot(plane.xyz, p) + plane.w >= 0 for all six planes, as with vks::Frustum.
+    void cull(const glm::vec4 planes[6], std::vector<uint8_t>& visible)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        visible.assign(leafCount, 0);
+        stats.visible = 0;
+        stats.nodesTested = 0;
+        // The top level is a single group of at most GROUP nodes
+        cull_group(planes, static_cast<uint32_t>(levels.size()) - 1, 0, visible);
+        stats.milliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    uint32_t count() const { return leafCount; }
+    const Stats& statistics() const { return stats; }
+
+    // Interleaves the low 10 bits of x, y and z, sorting by it keeps neighbouring cells together
+    static uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z)
+    {
+        return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+    }
+
+private:
+    static const uint32_t GROUP = 8;
+
+    struct Level {
+        std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;  // padded to a multiple of GROUP with empty boxes
+        std::vector<uint8_t> dirty;                             // per group, bounds changed since the last refit
+    };
+    std::vector<Level> levels;      // levels[0] are the leaves, levels.back() fits in one group
+    std::vector<uint8_t> nonEmpty;
+    uint32_t leafCount = 0;
+    Stats stats;
+#if defined(FRUSTUM_CULLER_SSE2)
+    bool avx = cpuFeatures::Avx();
+#endif
+
+    static uint32_t spread_bits(uint32_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    // Tests the GROUP boxes of level from first on and descends into the ones crossing a plane
+    void cull_group(const glm::vec4 planes[6], uint32_t level, uint32_t first, std::vector<uint8_t>& visible)
+    {
+        uint32_t outside, crossing;
+        classify(planes, levels[level], first, outside, crossing);
+        stats.nodesTested += GROUP;
+        for (uint32_t i = 0; i < GROUP; i++) {
+            uint32_t bit = 1u << i;
+            if (outside & bit) {
+                continue;
+            }
+            uint32_t node = first + i;
+            if (level == 0) {
+                if (node < leafCount && nonEmpty[node]) {
+                    visible[node] = 1;
+                    stats.visible++;
+                }
+            }
+            else if (crossing & bit) {
+                cull_group(planes, level - 1, node * GROUP, visible);
+            }
+            else {
+                mark_visible(level, node, visible);
+            }
+        }
+    }
+    // Every non-empty leaf below node
+    void mark_visible(uint32_t level, uint32_t node, std::vector<uint8_t>& visible)
+    {
+        uint32_t span = 1;
+        for (uint32_t l = 0; l < level; l++) {
+            span *= GROUP;
+        }
+        uint32_t first = node * span;
+        uint32_t last = std::min(first + span, leafCount);
+        for (uint32_t leaf = first; leaf < last; leaf++) {
+            visible[leaf] = nonEmpty[leaf];
+            stats.visible += nonEmpty[leaf];
+        }
+    }
+    // Bit i of outside: box first + i is behind a plane. Bit i of crossing: it is not outside but some of
+    // it is behind a plane. Empty boxes (min FLT_MAX, max -FLT_MAX) always come out as outside.
+    void classify(const glm::vec4 planes[6], const Level& level, uint32_t first, uint32_t& outside, uint32_t& crossing) const
+    {
+#if defined(FRUSTUM_CULLER_SSE2)
+        if (avx) {
+            classify_avx(planes, level, first, outside, crossing);
+            return;
+        }
+        outside = 0;
+        crossing = 0;
+        for (uint32_t half = 0; half < GROUP; half += 4) {
+            __m128 outsideMask = _mm_setzero_ps();
+            __m128 crossingMask = _mm_setzero_ps();
+            const __m128 zero = _mm_setzero_ps();
+            uint32_t at = first + half;
+            for (int p = 0; p < 6; p++) {
+                const glm::vec4& plane = planes[p];
+                const float* farX = plane.x >= 0.0f ? &level.maxX[at] : &level.minX[at];
+                const float* farY = plane.y >= 0.0f ? &level.maxY[at] : &level.minY[at];
+                const float* farZ = plane.z >= 0.0f ? &level.maxZ[at] : &level.minZ[at];
+                const float* nearX = plane.x >= 0.0f ? &level.minX[at] : &level.maxX[at];
+                const float* nearY = plane.y >= 0.0f ? &level.minY[at] : &level.maxY[at];
+                const float* nearZ = plane.z >= 0.0f ? &level.minZ[at] : &level.maxZ[at];
+                __m128 nx = _mm_set1_ps(plane.x), ny = _mm_set1_ps(plane.y), nz = _mm_set1_ps(plane.z), w = _mm_set1_ps(plane.w);
+                __m128 farDistance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(farX)), _mm_mul_ps(ny, _mm_loadu_ps(farY))), _mm_mul_ps(nz, _mm_loadu_ps(farZ))), w);
+                __m128 nearDistance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(nearX)), _mm_mul_ps(ny, _mm_loadu_ps(nearY))), _mm_mul_ps(nz, _mm_loadu_ps(nearZ))), w);
+                outsideMask = _mm_or_ps(outsideMask, _mm_cmplt_ps(farDistance, zero));
+                crossingMask = _mm_or_ps(crossingMask, _mm_cmplt_ps(nearDistance, zero));
+            }
+            outside |= static_cast<uint32_t>(_mm_movemask_ps(outsideMask)) << half;
+            crossing |= static_cast<uint32_t>(_mm_movemask_ps(crossingMask)) << half;
+        }
+        crossing &= ~outside;
+#else
+        outside = 0;
+        crossing = 0;
+        for (uint32_t i = 0; i < GROUP; i++) {
+            uint32_t at = first + i;
+            for (int p = 0; p < 6; p++) {
+                const glm::vec4& plane = planes[p];
+                float farDistance = plane.x * (plane.x >= 0.0f ? level.maxX[at] : level.minX[at]) + plane.y * (plane.y >= 0.0f ? level.maxY[at] : level.minY[at]) + plane.z * (plane.z >= 0.0f ? level.maxZ[at] : level.minZ[at]) + plane.w;
+                float nearDistance = plane.x * (plane.x >= 0.0f ? level.minX[at] : level.maxX[at]) + plane.y * (plane.y >= 0.0f ? level.minY[at] : level.maxY[at]) + plane.z * (plane.z >= 0.0f ? level.minZ[at] : level.maxZ[at]) + plane.w;
+                outside |= farDistance < 0.0f ? 1u << i : 0;
+                crossing |= nearDistance < 0.0f ? 1u << i : 0;
+            }
+        }
+        crossing &= ~outside;
+#endif
+    }
+#if defined(FRUSTUM_CULLER_SSE2)
+    // The whole group in one pass, only called when the CPU has AVX
+    CPU_TARGET("avx") static void classify_avx(const glm::vec4 planes[6], const Level& level, uint32_t first, uint32_t& outside, uint32_t& crossing)
+    {
+        __m256 outsideMask = _mm256_setzero_ps();
+        __m256 crossingMask = _mm256_setzero_ps();
+        const __m256 zero = _mm256_setzero_ps();
+        for (int p = 0; p < 6; p++) {
+            const glm::vec4& plane = planes[p];
+            // Corner farthest along the plane's normal (decides outside) and the one nearest to it
+            const float* farX = plane.x >= 0.0f ? &level.maxX[first] : &level.minX[first];
+            const float* farY = plane.y >= 0.0f ? &level.maxY[first] : &level.minY[first];
+            const float* farZ = plane.z >= 0.0f ? &level.maxZ[first] : &level.minZ[first];
+            const float* nearX = plane.x >= 0.0f ? &level.minX[first] : &level.maxX[first];
+            const float* nearY = plane.y >= 0.0f ? &level.minY[first] : &level.maxY[first];
+            const float* nearZ = plane.z >= 0.0f ? &level.minZ[first] : &level.maxZ[first];
+            __m256 nx = _mm256_set1_ps(plane.x), ny = _mm256_set1_ps(plane.y), nz = _mm256_set1_ps(plane.z), w = _mm256_set1_ps(plane.w);
+            __m256 farDistance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(farX)), _mm256_mul_ps(ny, _mm256_loadu_ps(farY))), _mm256_mul_ps(nz, _mm256_loadu_ps(farZ))), w);
+            __m256 nearDistance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(nearX)), _mm256_mul_ps(ny, _mm256_loadu_ps(nearY))), _mm256_mul_ps(nz, _mm256_loadu_ps(nearZ))), w);
+            outsideMask = _mm256_or_ps(outsideMask, _mm256_cmp_ps(farDistance, zero, _CMP_LT_OQ));
+            crossingMask = _mm256_or_ps(crossingMask, _mm256_cmp_ps(nearDistance, zero, _CMP_LT_OQ));
+        }
+        outside = static_cast<uint32_t>(_mm256_movemask_ps(outsideMask));
+        crossing = static_cast<uint32_t>(_mm256_movemask_ps(crossingMask)) & ~outside;
+    }
+#endif
+};
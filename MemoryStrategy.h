@@ -0,0 +1,341 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <ostream>
+#include "vulkanexamplebase.h"
+
+// Where buffers live, decided once from the device's memory heaps and types instead of at every call site.
+//   UMA           one pool of memory (integrated GPUs, lavapipe): every buffer is written in place
+//   ReBAR         the whole of VRAM is host visible: device local buffers are written in place
+//   Discrete      VRAM is reached through staging copies, host visible VRAM (the 256 MB BAR) is kept
+//                 for small buffers rewritten every frame
+// Every heap has a budget; a placement that would exceed it falls back to the next candidate, so a missing
+// or full heap degrades to a slower path instead of failing. Type selection works on the property tables
+// alone (init_properties) and can be driven by a mocked VkPhysicalDeviceMemoryProperties.
+// With VK_EXT_memory_budget the budgets follow the driver's (update_budget), which accounts for other
+// processes; usage is also kept per category for the overlay and the stats file.
+enum class MemoryUsage {
+    GpuOnly,    // read by the GPU, written rarely (meshes, indirect commands)
+    Upload,     // staging, written by the host and read by copies
+    Dynamic,    // rewritten by the host every frame (uniforms, particles)
+};
+enum class MemoryCategory {
+    Terrain,
+    Particles,
+    GBuffer,
+    Uniforms,
+    Staging,
+    Other,      // indirect commands, anything not listed above
+    Count,
+};
+enum class MemoryArchitecture {
+    Discrete,
+    ReBar,
+    Uma,
+};
+
+class MemoryStrategy
+{
+public:
+    struct Choice {
+        uint32_t typeIndex;
+        uint32_t heapIndex;
+        VkMemoryPropertyFlags flags;
+        bool hostVisible() const { return (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0; }
+    };
+    // Host visible device local heaps up to this size are a plain BAR window, not ReBAR
+    static const VkDeviceSize BAR_WINDOW_SIZE = 256ull * 1024 * 1024;
+
+    void init(vks::VulkanDevice* device, VkQueue queue, VkPhysicalDeviceType deviceType)
+    {
+        this->device = device;
+        this->queue = queue;
+        init_properties(device->memoryProperties, deviceType);
+    }
+    void init_properties(const VkPhysicalDeviceMemoryProperties& properties, VkPhysicalDeviceType deviceType)
+    {
+        memoryProperties = properties;
+        heapUsed.assign(properties.memoryHeapCount, 0);
+        heapBudget.resize(properties.memoryHeapCount);
+        for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+            // Leave room for what is allocated outside the strategy (images, the swapchain, other processes)
+            heapBudget[i] = properties.memoryHeaps[i].size / 10 * 8;
+        }
+        bool allDeviceLocal = true;
+        VkDeviceSize largestMappableVram = 0;
+        for (uint32_t i = 0; i < properties.memoryTypeCount; i++) {
+            const VkMemoryType& type = properties.memoryTypes[i];
+            const VkMemoryHeap& heap = properties.memoryHeaps[type.heapIndex];
+            if (!(heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)) {
+                allDeviceLocal = false;
+            }
+            const VkMemoryPropertyFlags mappableVram = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            if ((type.propertyFlags & mappableVram) == mappableVram) {
+                largestMappableVram = std::max(largestMappableVram, heap.size);
+            }
+        }
+        if (deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU || deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU || (allDeviceLocal && largestMappableVram)) {
+            memoryArchitecture = MemoryArchitecture::Uma;
+        }
+        else if (largestMappableVram > BAR_WINDOW_SIZE) {
+            memoryArchitecture = MemoryArchitecture::ReBar;
+        }
+        else {
+            memoryArchitecture = MemoryArchitecture::Discrete;
+        }
+    }
+
+    // First memory type allowed by memoryTypeBits that suits usage and keeps its heap within budget
+    bool choose(uint32_t memoryTypeBits, MemoryUsage usage, VkDeviceSize size, Choice& choice) const
+    {
+        const VkMemoryPropertyFlags DEVICE = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        const VkMemoryPropertyFlags HOST = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        // Candidates in order of preference: required flags, flags to avoid
+        struct Candidate { VkMemoryPropertyFlags required, avoided; };
+        std::vector<Candidate> candidates;
+        switch (usage) {
+        case MemoryUsage::GpuOnly:
+            if (memoryArchitecture != MemoryArchitecture::Discrete) {
+                candidates.push_back({ DEVICE | HOST, 0 });
+            }
+            // On a discrete GPU keep the BAR window free for dynamic buffers
+            candidates.push_back({ DEVICE, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT });
+            candidates.push_back({ DEVICE, 0 });
+            candidates.push_back({ HOST, 0 });
+            break;
+        case MemoryUsage::Upload:
+            candidates.push_back({ HOST, memoryArchitecture == MemoryArchitecture::Uma ? 0 : DEVICE });
+            candidates.push_back({ HOST, 0 });
+            break;
+        case MemoryUsage::Dynamic:
+            candidates.push_back({ DEVICE | HOST, 0 });
+            candidates.push_back({ HOST, 0 });
+            break;
+        }
+        for (const Candidate& candidate : candidates) {
+            for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+                const VkMemoryType& type = memoryProperties.memoryTypes[i];
+                if (!(memoryTypeBits & (1u << i))) continue;
+                if ((type.propertyFlags & candidate.required) != candidate.required) continue;
+                if (type.propertyFlags & candidate.avoided) continue;
+                if (heapUsed[type.heapIndex] + size > heapBudget[type.heapIndex]) continue;
+                choice = { i, type.heapIndex, type.propertyFlags };
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Creates and binds a buffer placed for usage. Initial data is written in place when the memory is
+    // host visible, otherwise through a temporary staging buffer.
+    VkResult createBuffer(VkBufferUsageFlags usageFlags, MemoryUsage usage, MemoryCategory category, vks::Buffer* buffer, VkDeviceSize size, const void* data = nullptr, const uint32_t* queueFamilies = nullptr, uint32_t queueFamilyCount = 0)
+    {
+        if (usage == MemoryUsage::GpuOnly) {
+            usageFlags |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        }
+        buffer->device = device->logicalDevice;
+        VkResult result = createBuffer(usageFlags, usage, category, size, &buffer->buffer, &buffer->memory, buffer->memoryPropertyFlags, queueFamilies, queueFamilyCount);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        buffer->size = size;
+        buffer->usageFlags = usageFlags;
+        buffer->alignment = allocations[buffer->memory].alignment;
+        buffer->setupDescriptor();
+        if (data) {
+            write(*buffer, data, size);
+        }
+        return VK_SUCCESS;
+    }
+    // Same for code that keeps raw handles
+    VkResult createBuffer(VkBufferUsageFlags usageFlags, MemoryUsage usage, MemoryCategory category, VkDeviceSize size, VkBuffer* buffer, VkDeviceMemory* memory, VkMemoryPropertyFlags& flags, const uint32_t* queueFamilies = nullptr, uint32_t queueFamilyCount = 0)
+    {
+        VkBufferCreateInfo bufferInfo = vks::initializers::bufferCreateInfo(usageFlags, size);
+        if (queueFamilyCount > 1) {
+            bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            bufferInfo.queueFamilyIndexCount = queueFamilyCount;
+            bufferInfo.pQueueFamilyIndices = queueFamilies;
+        }
+        VK_CHECK_RESULT(vkCreateBuffer(device->logicalDevice, &bufferInfo, nullptr, buffer));
+        VkMemoryRequirements memReqs;
+        vkGetBufferMemoryRequirements(device->logicalDevice, *buffer, &memReqs);
+        Choice choice;
+        if (!choose(memReqs.memoryTypeBits, usage, memReqs.size, choice)) {
+            vkDestroyBuffer(device->logicalDevice, *buffer, nullptr);
+            *buffer = VK_NULL_HANDLE;
+            return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+        }
+        VkMemoryAllocateInfo memAlloc = vks::initializers::memoryAllocateInfo();
+        memAlloc.allocationSize = memReqs.size;
+        memAlloc.memoryTypeIndex = choice.typeIndex;
+        VkResult result = vkAllocateMemory(device->logicalDevice, &memAlloc, nullptr, memory);
+        if (result != VK_SUCCESS) {
+            vkDestroyBuffer(device->logicalDevice, *buffer, nullptr);
+            *buffer = VK_NULL_HANDLE;
+            return result;
+        }
+        VK_CHECK_RESULT(vkBindBufferMemory(device->logicalDevice, *buffer, *memory, 0));
+        add(*memory, { choice.heapIndex, category, memReqs.size, memReqs.alignment });
+        flags = choice.flags;
+        return VK_SUCCESS;
+    }
+    // Accounts for memory allocated outside the strategy (images), released with untrack
+    void track(MemoryCategory category, uint32_t memoryTypeIndex, VkDeviceMemory memory, VkDeviceSize size)
+    {
+        add(memory, { memoryProperties.memoryTypes[memoryTypeIndex].heapIndex, category, size, 0 });
+    }
+    void untrack(VkDeviceMemory memory)
+    {
+        release(memory);
+    }
+    // Writes size bytes at offset, in place when the buffer is host visible, else with a staged copy that has completed on return
+    void write(vks::Buffer& buffer, const void* data, VkDeviceSize size, VkDeviceSize offset = 0)
+    {
+        if (buffer.memoryPropertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            void* mapped;
+            VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, buffer.memory, offset, size, 0, &mapped));
+            memcpy(mapped, data, size);
+            vkUnmapMemory(device->logicalDevice, buffer.memory);
+            return;
+        }
+        vks::Buffer staging;
+        VK_CHECK_RESULT(createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, MemoryUsage::Upload, MemoryCategory::Staging, &staging, size, data));
+        VkBufferCopy region = {};
+        region.dstOffset = offset;
+        region.size = size;
+        device->copyBuffer(&staging, &buffer, queue, &region);
+        destroyBuffer(staging);
+    }
+    void destroyBuffer(vks::Buffer& buffer)
+    {
+        release(buffer.memory);
+        buffer.destroy();
+        buffer.buffer = VK_NULL_HANDLE;
+        buffer.memory = VK_NULL_HANDLE;
+    }
+    void destroyBuffer(VkBuffer& buffer, VkDeviceMemory& memory)
+    {
+        release(memory);
+        vkDestroyBuffer(device->logicalDevice, buffer, nullptr);
+        vkFreeMemory(device->logicalDevice, memory, nullptr);
+        buffer = VK_NULL_HANDLE;
+        memory = VK_NULL_HANDLE;
+    }
+
+    MemoryArchitecture architecture() const { return memoryArchitecture; }
+    // Device local buffers can be written by the host directly, no staging needed
+    bool direct_upload() const { return memoryArchitecture != MemoryArchitecture::Discrete; }
+    const char* architecture_name() const
+    {
+        switch (memoryArchitecture) {
+        case MemoryArchitecture::Uma: return "UMA";
+        case MemoryArchitecture::ReBar: return "ReBAR";
+        default: return "discrete";
+        }
+    }
+    uint32_t heap_count() const { return memoryProperties.memoryHeapCount; }
+    VkDeviceSize heap_used(uint32_t heap) const { return heapUsed[heap]; }
+    VkDeviceSize heap_budget(uint32_t heap) const { return heapBudget[heap]; }
+    void set_heap_budget(uint32_t heap, VkDeviceSize budget) { heapBudget[heap] = budget; }
+    VkDeviceSize category_used(MemoryCategory category) const { return categoryUsed[static_cast<size_t>(category)]; }
+    static const char* category_name(MemoryCategory category)
+    {
+        switch (category) {
+        case MemoryCategory::Terrain: return "terrain";
+        case MemoryCategory::Particles: return "particles";
+        case MemoryCategory::GBuffer: return "gbuffer";
+        case MemoryCategory::Uniforms: return "uniforms";
+        case MemoryCategory::Staging: return "staging";
+        default: return "other";
+        }
+    }
+
+    // Reads the budgets from VK_EXT_memory_budget from now on; the device extension must be enabled
+    void enable_budget_query(VkInstance instance, VkPhysicalDevice physicalDevice)
+    {
+        this->physicalDevice = physicalDevice;
+        getMemoryProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2KHR"));
+        if (!getMemoryProperties2) {
+            getMemoryProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2"));
+        }
+        update_budget();
+    }
+    // The driver's budget moves with what other processes use, so it is polled once per frame
+    void update_budget()
+    {
+        if (!getMemoryProperties2) {
+            return;
+        }
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+        budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+        VkPhysicalDeviceMemoryProperties2KHR properties = {};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+        properties.pNext = &budget;
+        getMemoryProperties2(physicalDevice, &properties);
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+            // heapUsage covers the whole process, whatever of it is not tracked here (the swapchain,
+            // driver internals) comes off the strategy's share
+            VkDeviceSize untracked = budget.heapUsage[i] > heapUsed[i] ? budget.heapUsage[i] - heapUsed[i] : 0;
+            heapBudget[i] = budget.heapBudget[i] > untracked ? budget.heapBudget[i] - untracked : 0;
+        }
+        driverBudget = true;
+    }
+    // Budgets come from the driver rather than a fixed share of each heap
+    bool driver_budget() const { return driverBudget; }
+
+    // One CSV row per call, after write_stats_header: bytes per category, then used and budget per heap
+    void write_stats_header(std::ostream& out) const
+    {
+        for (size_t i = 0; i < categoryUsed.size(); i++) {
+            out << "," << category_name(static_cast<MemoryCategory>(i));
+        }
+        for (uint32_t i = 0; i < heap_count(); i++) {
+            out << ",heap" << i << "_used,heap" << i << "_budget";
+        }
+    }
+    void write_stats(std::ostream& out) const
+    {
+        for (VkDeviceSize used : categoryUsed) {
+            out << "," << used;
+        }
+        for (uint32_t i = 0; i < heap_count(); i++) {
+            out << "," << heapUsed[i] << "," << heapBudget[i];
+        }
+    }
+
+private:
+    struct Allocation {
+        uint32_t heapIndex;
+        MemoryCategory category;
+        VkDeviceSize size;
+        VkDeviceSize alignment;
+    };
+    vks::VulkanDevice* device = nullptr;
+    VkQueue queue = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties = {};
+    MemoryArchitecture memoryArchitecture = MemoryArchitecture::Discrete;
+    std::vector<VkDeviceSize> heapUsed;
+    std::vector<VkDeviceSize> heapBudget;
+    std::array<VkDeviceSize, static_cast<size_t>(MemoryCategory::Count)> categoryUsed = {};
+    std::unordered_map<VkDeviceMemory, Allocation> allocations;
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 = nullptr;
+    bool driverBudget = false;
+
+    void add(VkDeviceMemory memory, const Allocation& allocation)
+    {
+        heapUsed[allocation.heapIndex] += allocation.size;
+        categoryUsed[static_cast<size_t>(allocation.category)] += allocation.size;
+        allocations[memory] = allocation;
+    }
+    void release(VkDeviceMemory memory)
+    {
+        auto it = allocations.find(memory);
+        if (it != allocations.end()) {
+            heapUsed[it->second.heapIndex] -= it->second.size;
+            categoryUsed[static_cast<size_t>(it->second.category)] -= it->second.size;
+            allocations.erase(it);
+        }
+    }
+};
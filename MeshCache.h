@@ -0,0 +1,232 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Chunk meshes from an earlier run, read from one memory mapped file.
+// Every chunk has a slot keyed by the hash of its voxels (and its index, the vertices are in world
+// space); a slot whose hash does not match the chunk's voxels is a miss and the chunk is meshed as usual.
+// The whole file is stale when the mesher version or the vertex layout changed.
+// Layout: Header, one Entry per chunk, then per chunk its vertices and its triangle count per cell,
+// each 16 byte aligned so the vertices can be read in place.
+class MeshCache
+{
+public:
+    struct Mesh {
+        const Vertex* vertices;
+        uint32_t vertexCount;
+        const uint8_t* triangleCounts;  // cellCount entries, as in Chunk::tri_count_per_cell
+    };
+    // What write() stores for one chunk
+    struct ChunkMesh {
+        uint64_t hash;
+        const Vertex* vertices;
+        uint32_t vertexCount;
+        const uint8_t* triangleCounts;
+    };
+
+    static uint64_t hash(const uint8_t* voxel, size_t size, uint32_t chunkIndex)
+    {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++) {
+            h = (h ^ voxel[i]) * 1099511628211ull;
+        }
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ ((chunkIndex >> (i * 8)) & 0xff)) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    // Maps the file; false when it is missing, truncated or was written for another mesher
+    bool open(const std::string& path, uint32_t mesherVersion, uint32_t chunkCount, uint32_t cellCount)
+    {
+        close();
+        if (!map_file(path)) {
+            return false;
+        }
+        const Header* header = reinterpret_cast<const Header*>(data);
+        if (size < sizeof(Header) + chunkCount * sizeof(Entry) ||
+            header->magic != MAGIC || header->mesherVersion != mesherVersion || header->vertexSize != sizeof(Vertex) ||
+            header->chunkCount != chunkCount || header->cellCount != cellCount) {
+            close();
+            return false;
+        }
+        entries = reinterpret_cast<const Entry*>(data + sizeof(Header));
+        this->chunkCount = chunkCount;
+        this->cellCount = cellCount;
+        return true;
+    }
+    void close()
+    {
+        unmap_file();
+        entries = nullptr;
+        chunkCount = 0;
+    }
+    bool is_open() const { return entries != nullptr; }
+
+    // Thread safe, the mapping is read only
+    bool find(uint32_t chunkIndex, uint64_t hash, Mesh& mesh) const
+    {
+        if (!entries || chunkIndex >= chunkCount) {
+            return false;
+        }
+        const Entry& entry = entries[chunkIndex];
+        uint64_t bytes = (uint64_t)entry.vertexCount * sizeof(Vertex);
+        if (entry.hash != hash || entry.offset + align(bytes) + cellCount > size) {
+            return false;
+        }
+        mesh.vertices = reinterpret_cast<const Vertex*>(data + entry.offset);
+        mesh.vertexCount = entry.vertexCount;
+        mesh.triangleCounts = reinterpret_cast<const uint8_t*>(data + entry.offset + align(bytes));
+        return true;
+    }
+
+    // Writes every chunk's mesh, through a temporary file so a crash never leaves a torn cache.
+    // The cache must not be mapped from the same path.
+    static bool write(const std::string& path, uint32_t mesherVersion, uint32_t cellCount, const std::vector<ChunkMesh>& chunks)
+    {
+        std::string temporary = path + ".tmp";
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        Header header = { MAGIC, mesherVersion, static_cast<uint32_t>(sizeof(Vertex)), static_cast<uint32_t>(chunks.size()), cellCount, 0 };
+        std::vector<Entry> table(chunks.size());
+        uint64_t offset = align(sizeof(Header) + table.size() * sizeof(Entry));
+        for (size_t i = 0; i < chunks.size(); i++) {
+            table[i] = { chunks[i].hash, offset, chunks[i].vertexCount, 0 };
+            offset += align((uint64_t)chunks[i].vertexCount * sizeof(Vertex)) + align(cellCount);
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Entry));
+        pad(out);
+        for (const ChunkMesh& chunk : chunks) {
+            out.write(reinterpret_cast<const char*>(chunk.vertices), (std::streamsize)chunk.vertexCount * sizeof(Vertex));
+            pad(out);
+            out.write(reinterpret_cast<const char*>(chunk.triangleCounts), cellCount);
+            pad(out);
+        }
+        out.close();
+        if (!out) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        std::remove(path.c_str());
+        return std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    static const uint32_t MAGIC = 0x4843454d; // "MECH"
+    static const uint64_t ALIGNMENT = 16;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t mesherVersion;
+        uint32_t vertexSize;
+        uint32_t chunkCount;
+        uint32_t cellCount;
+        uint32_t reserved;      // keeps the entries 8 byte aligned
+    };
+    struct Entry {
+        uint64_t hash;
+        uint64_t offset;        // of the chunk's vertices from the start of the file
+        uint32_t vertexCount;
+        uint32_t reserved;
+    };
+    const char* data = nullptr;
+    uint64_t size = 0;
+    const Entry* entries = nullptr;
+    uint32_t chunkCount = 0;
+    uint32_t cellCount = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+
+    static uint64_t align(uint64_t offset) { return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+    static void pad(std::ofstream& out)
+    {
+        static const char zeros[ALIGNMENT] = {};
+        uint64_t position = static_cast<uint64_t>(out.tellp());
+        out.write(zeros, align(position) - position);
+    }
+
+#if defined(_WIN32)
+    bool map_file(const std::string& path)
+    {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            unmap_file();
+            return false;
+        }
+        size = fileSize.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        data = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if (!data) {
+            unmap_file();
+            return false;
+        }
+        return true;
+    }
+    void unmap_file()
+    {
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        data = nullptr;
+        size = 0;
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+    }
+#else
+    bool map_file(const std::string& path)
+    {
+        int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return false;
+        }
+        struct stat status;
+        if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+            ::close(descriptor);
+            return false;
+        }
+        void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        // The mapping keeps the file alive on its own
+        ::close(descriptor);
+        if (address == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char*>(address);
+        size = status.st_size;
+        return true;
+    }
+    void unmap_file()
+    {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
+        data = nullptr;
+        size = 0;
+    }
+#endif
+};
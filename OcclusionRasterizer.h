@@ -0,0 +1,335 @@
+#pragma once
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <glm/glm.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_RASTERIZER_SSE2
+#endif
+#include "WorkerPool.h"
+
+// Software occlusion culling on the CPU, no GPU feedback and no latency.
+// Occluders are axis aligned boxes that are solid all through (e.g. chunks without a single empty voxel).
+// Their front faces are projected into a small depth buffer and rasterized in horizontal bands, a
+// parallel_for task each on the worker pool, so no two threads ever write the same row. Every band keeps
+// the farthest depth of each of its TILE_WIDTH x TILE_HEIGHT tiles once it is done. Boxes are then tested
+// by their nearest depth over the pixels their screen rectangle touches: a tile whose farthest depth is
+// nearer settles its pixels at once, only the other tiles are read pixel by pixel.
+// Depth is NDC z in [0, 1] cleared to 1.0 and tested with less or equal, as the renderer's depth buffer.
+// Along the outline of the occluders only pixels lying wholly inside are covered, and a covered pixel
+// keeps the farthest depth its face reaches over the pixel, so occluders never grow by the sampling.
+// Occluder faces crossing the near plane are dropped instead of clipped, which only loses occlusion, and
+// boxes with a corner behind the near plane are always visible.
+class OcclusionRasterizer
+{
+public:
+    static const uint32_t TILE_WIDTH = 8;
+    static const uint32_t TILE_HEIGHT = 4;
+
+    struct Stats {
+        uint32_t occluderTriangles = 0; // triangles rasterized by the last call to rasterize
+        uint32_t tested = 0;            // boxes tested since the last call to begin
+        uint32_t culled = 0;            // of which found occluded
+        float rasterMilliseconds = 0.0f;// time the last call to rasterize took
+        float testMilliseconds = 0.0f;  // time spent in test_box since the last call to begin
+    };
+
+    // width must be a multiple of TILE_WIDTH and height of TILE_HEIGHT
+    void create(uint32_t width, uint32_t height, WorkerPool* pool, uint32_t bandCount)
+    {
+        this->pool = pool;
+        this->width = width;
+        this->height = height;
+        tilesX = width / TILE_WIDTH;
+        tilesY = height / TILE_HEIGHT;
+        depthBuffer.assign(width * height, 1.0f);
+        tileMax.assign(tilesX * tilesY, 1.0f);
+        bandCount = std::max(1u, std::min(bandCount, tilesY));
+        // Whole tile rows per band, the last band takes the remainder
+        uint32_t bandTiles = tilesY / bandCount;
+        bands.resize(bandCount);
+        for (uint32_t band = 0; band < bandCount; band++) {
+            bands[band].firstTileRow = band * bandTiles;
+            bands[band].endTileRow = band + 1 == bandCount ? tilesY : (band + 1) * bandTiles;
+        }
+    }
+
+    // Starts a frame: drops the last frame's occluders and test counts
+    void begin(const glm::mat4& viewProjection, const glm::vec3& eye)
+    {
+        this->viewProjection = viewProjection;
+        this->eye = eye;
+        triangles.clear();
+        stats.tested = 0;
+        stats.culled = 0;
+        stats.testMilliseconds = 0.0f;
+    }
+    // Queues the faces of a solid box that face the eye. faceMask has a bit per face, -x +x -y +y -z +z,
+    // a face whose bit is clear is skipped (e.g. shared with a neighbouring box).
+    void add_occluder(const glm::vec3& min, const glm::vec3& max, uint32_t faceMask = 0x3f)
+    {
+        // Corner i has max.x when bit 0 is set, max.y for bit 1, max.z for bit 2
+        static const uint8_t faces[6][4] = {
+            { 0, 4, 6, 2 }, { 1, 3, 7, 5 }, { 0, 1, 5, 4 }, { 2, 6, 7, 3 }, { 0, 2, 3, 1 }, { 4, 5, 7, 6 }
+        };
+        bool facing[6] = { eye.x < min.x, eye.x > max.x, eye.y < min.y, eye.y > max.y, eye.z < min.z, eye.z > max.z };
+        glm::vec4 clip[8];
+        bool projected = false;
+        for (uint32_t face = 0; face < 6; face++) {
+            if (!(faceMask >> face & 1) || !facing[face]) {
+                continue;
+            }
+            if (!projected) {
+                for (uint32_t i = 0; i < 8; i++) {
+                    clip[i] = viewProjection * glm::vec4((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z, 1.0f);
+                }
+                projected = true;
+            }
+            ScreenVertex quad[4];
+            bool clipped = false;
+            for (uint32_t i = 0; i < 4; i++) {
+                const glm::vec4& c = clip[faces[face][i]];
+                if (c.w < NEAR_W || c.z < 0.0f) {
+                    clipped = true;
+                    break;
+                }
+                quad[i] = to_screen(c);
+            }
+            if (clipped) {
+                continue;
+            }
+            // An edge is on the outline when the face across it is neither drawn nor continued by a
+            // neighbouring box; outline edges only cover pixels lying wholly inside them
+            uint32_t outline = 0;
+            for (uint32_t i = 0; i < 4; i++) {
+                uint32_t from = faces[face][i], to = faces[face][(i + 1) & 3];
+                uint32_t axis = (~(from ^ to) & 7) & ~(1u << (face >> 1));
+                axis = axis == 1 ? 0 : axis == 2 ? 1 : 2;
+                uint32_t across = axis * 2 + (from >> axis & 1);
+                if ((faceMask >> across & 1) && !facing[across]) {
+                    outline |= 1 << i;
+                }
+            }
+            // The diagonal is shared by both triangles and always sampled at pixel centers
+            add_triangle(quad[0], quad[1], quad[2], outline & 3);
+            add_triangle(quad[0], quad[2], quad[3], (outline >> 1) & 6);
+        }
+    }
+    // Rasterizes the queued occluders on the worker pool and returns once the buffer is complete
+    void rasterize()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        // The triangles are not written again before every band is done
+        pool->parallel_for(static_cast<uint32_t>(bands.size()), [this](uint32_t band) {
+            rasterize_band(bands[band].firstTileRow, bands[band].endTileRow);
+        });
+        stats.occluderTriangles = static_cast<uint32_t>(triangles.size());
+        stats.rasterMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    // False when the box is certainly hidden behind the rasterized occluders
+    bool test_box(const glm::vec3& min, const glm::vec3& max)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool visible = box_visible(min, max);
+        stats.tested++;
+        stats.culled += visible ? 0 : 1;
+        stats.testMilliseconds += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return visible;
+    }
+
+    float depth(uint32_t x, uint32_t y) const { return depthBuffer[y * width + x]; }
+    uint32_t buffer_width() const { return width; }
+    uint32_t buffer_height() const { return height; }
+    const Stats& statistics() const { return stats; }
+
+private:
+    static constexpr float NEAR_W = 1e-3f;
+
+    struct ScreenVertex {
+        float x, y, z;  // pixels, NDC depth
+    };
+    // Edge functions and depth plane evaluated at pixel centers: a pixel is covered when all three edges
+    // are >= 0, its depth is zX * x + zY * y + zC
+    struct Triangle {
+        float edgeX[3], edgeY[3], edgeC[3];
+        float zX, zY, zC;
+        int minX, maxX, minY, maxY;  // pixel bounds, inclusive and inside the buffer
+    };
+    struct Band {
+        uint32_t firstTileRow = 0;
+        uint32_t endTileRow = 0;
+    };
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t tilesX = 0;
+    uint32_t tilesY = 0;
+    std::vector<float> depthBuffer;
+    std::vector<float> tileMax;     // farthest depth per tile
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    glm::vec3 eye = glm::vec3(0.0f);
+    std::vector<Triangle> triangles;
+    Stats stats;
+
+    WorkerPool* pool = nullptr;
+    std::vector<Band> bands;
+
+    ScreenVertex to_screen(const glm::vec4& clip) const
+    {
+        float invW = 1.0f / clip.w;
+        return { (clip.x * invW * 0.5f + 0.5f) * width, (clip.y * invW * 0.5f + 0.5f) * height, clip.z * invW };
+    }
+    // Bit i of outline makes edge i (a-b, b-c, c-a) inner conservative
+    void add_triangle(ScreenVertex a, ScreenVertex b, ScreenVertex c, uint32_t outline)
+    {
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (std::fabs(area) < 1e-6f) {
+            return;
+        }
+        if (area < 0.0f) {
+            std::swap(b, c);
+            area = -area;
+            outline = (outline & 2) | (outline >> 2 & 1) | (outline << 2 & 4);
+        }
+        Triangle triangle;
+        const ScreenVertex* v[3] = { &a, &b, &c };
+        for (uint32_t i = 0; i < 3; i++) {
+            const ScreenVertex& from = *v[i];
+            const ScreenVertex& to = *v[(i + 1) % 3];
+            // Positive on the inside for counter clockwise a, b, c, evaluated at pixel centers
+            triangle.edgeX[i] = from.y - to.y;
+            triangle.edgeY[i] = to.x - from.x;
+            triangle.edgeC[i] = from.x * to.y - from.y * to.x + (triangle.edgeX[i] + triangle.edgeY[i]) * 0.5f;
+            if (outline >> i & 1) {
+                // Holds for the pixel's farthest corner from the edge
+                triangle.edgeC[i] -= (std::fabs(triangle.edgeX[i]) + std::fabs(triangle.edgeY[i])) * 0.5f;
+            }
+        }
+        float invArea = 1.0f / area;
+        triangle.zX = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) * invArea;
+        triangle.zY = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) * invArea;
+        // Farthest depth of the plane over the pixel rather than at its center
+        triangle.zC = a.z - triangle.zX * (a.x - 0.5f) - triangle.zY * (a.y - 0.5f) + (std::fabs(triangle.zX) + std::fabs(triangle.zY)) * 0.5f;
+        triangle.minX = std::max(0, static_cast<int>(std::floor(std::min({ a.x, b.x, c.x }))));
+        triangle.maxX = std::min(static_cast<int>(width) - 1, static_cast<int>(std::ceil(std::max({ a.x, b.x, c.x }))));
+        triangle.minY = std::max(0, static_cast<int>(std::floor(std::min({ a.y, b.y, c.y }))));
+        triangle.maxY = std::min(static_cast<int>(height) - 1, static_cast<int>(std::ceil(std::max({ a.y, b.y, c.y }))));
+        if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY) {
+            return;
+        }
+        triangles.push_back(triangle);
+    }
+
+    // Clears the rows of the band, rasterizes every triangle overlapping it and fills in its tile depths
+    void rasterize_band(uint32_t firstTileRow, uint32_t endTileRow)
+    {
+        int bandMinY = static_cast<int>(firstTileRow * TILE_HEIGHT);
+        int bandMaxY = static_cast<int>(endTileRow * TILE_HEIGHT) - 1;
+        std::fill(depthBuffer.begin() + bandMinY * width, depthBuffer.begin() + (bandMaxY + 1) * width, 1.0f);
+        for (const Triangle& triangle : triangles) {
+            int minY = std::max(triangle.minY, bandMinY);
+            int maxY = std::min(triangle.maxY, bandMaxY);
+            for (int y = minY; y <= maxY; y++) {
+                rasterize_row(triangle, y);
+            }
+        }
+        for (uint32_t tileY = firstTileRow; tileY < endTileRow; tileY++) {
+            for (uint32_t tileX = 0; tileX < tilesX; tileX++) {
+                float farthest = 0.0f;
+                for (uint32_t y = tileY * TILE_HEIGHT; y < (tileY + 1) * TILE_HEIGHT; y++) {
+                    const float* row = &depthBuffer[y * width + tileX * TILE_WIDTH];
+                    for (uint32_t x = 0; x < TILE_WIDTH; x++) {
+                        farthest = std::max(farthest, row[x]);
+                    }
+                }
+                tileMax[tileY * tilesX + tileX] = farthest;
+            }
+        }
+    }
+    void rasterize_row(const Triangle& t, int y)
+    {
+        float* row = &depthBuffer[y * width];
+        float fy = static_cast<float>(y);
+        float rowC0 = t.edgeY[0] * fy + t.edgeC[0];
+        float rowC1 = t.edgeY[1] * fy + t.edgeC[1];
+        float rowC2 = t.edgeY[2] * fy + t.edgeC[2];
+        float rowZ = t.zY * fy + t.zC;
+        int x = t.minX;
+#if defined(OCCLUSION_RASTERIZER_SSE2)
+        // Four pixels at a time, the buffer width is a multiple of four so a group never leaves the row
+        x &= ~3;
+        const __m128 offsets = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 stepX0 = _mm_set1_ps(t.edgeX[0]), stepX1 = _mm_set1_ps(t.edgeX[1]), stepX2 = _mm_set1_ps(t.edgeX[2]), stepZ = _mm_set1_ps(t.zX);
+        const __m128 c0 = _mm_set1_ps(rowC0), c1 = _mm_set1_ps(rowC1), c2 = _mm_set1_ps(rowC2), cZ = _mm_set1_ps(rowZ);
+        for (; x <= t.maxX; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(stepX0, px), c0);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(stepX1, px), c1);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(stepX2, px), c2);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+            if (!_mm_movemask_ps(inside)) {
+                continue;
+            }
+            __m128 z = _mm_add_ps(_mm_mul_ps(stepZ, px), cZ);
+            __m128 stored = _mm_loadu_ps(row + x);
+            __m128 nearer = _mm_min_ps(stored, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, stored)));
+        }
+#else
+        for (; x <= t.maxX; x++) {
+            float fx = static_cast<float>(x);
+            if (t.edgeX[0] * fx + rowC0 >= 0.0f && t.edgeX[1] * fx + rowC1 >= 0.0f && t.edgeX[2] * fx + rowC2 >= 0.0f) {
+                row[x] = std::min(row[x], t.zX * fx + rowZ);
+            }
+        }
+#endif
+    }
+
+    bool box_visible(const glm::vec3& min, const glm::vec3& max) const
+    {
+        float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+        float nearest = 1.0f;
+        for (uint32_t i = 0; i < 8; i++) {
+            glm::vec4 clip = viewProjection * glm::vec4((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z, 1.0f);
+            if (clip.w < NEAR_W) {
+                return true;
+            }
+            ScreenVertex v = to_screen(clip);
+            minX = std::min(minX, v.x); maxX = std::max(maxX, v.x);
+            minY = std::min(minY, v.y); maxY = std::max(maxY, v.y);
+            nearest = std::min(nearest, v.z);
+        }
+        // Every pixel the rectangle touches, not only those whose center it covers
+        int x0 = std::max(0, static_cast<int>(std::floor(minX)));
+        int x1 = std::min(static_cast<int>(width) - 1, static_cast<int>(std::ceil(maxX)) - 1);
+        int y0 = std::max(0, static_cast<int>(std::floor(minY)));
+        int y1 = std::min(static_cast<int>(height) - 1, static_cast<int>(std::ceil(maxY)) - 1);
+        if (x0 > x1 || y0 > y1) {
+            // Off screen, left to the frustum test
+            return true;
+        }
+        for (int tileY = y0 / static_cast<int>(TILE_HEIGHT); tileY <= y1 / static_cast<int>(TILE_HEIGHT); tileY++) {
+            for (int tileX = x0 / static_cast<int>(TILE_WIDTH); tileX <= x1 / static_cast<int>(TILE_WIDTH); tileX++) {
+                if (nearest > tileMax[tileY * tilesX + tileX]) {
+                    continue;
+                }
+                int pixelY0 = std::max(y0, tileY * static_cast<int>(TILE_HEIGHT));
+                int pixelY1 = std::min(y1, (tileY + 1) * static_cast<int>(TILE_HEIGHT) - 1);
+                int pixelX0 = std::max(x0, tileX * static_cast<int>(TILE_WIDTH));
+                int pixelX1 = std::min(x1, (tileX + 1) * static_cast<int>(TILE_WIDTH) - 1);
+                for (int y = pixelY0; y <= pixelY1; y++) {
+                    for (int x = pixelX0; x <= pixelX1; x++) {
+                        if (nearest <= depthBuffer[y * width + x]) {
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+        return false;
+    }
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#include "Brush.h"
+#include "DirtyChunks.h"
+
+// Coarse summaries of the voxel grid, one level per power of two:
+//   4^3 bricks   64 per chunk, a bit each in brick4Any / brick4Full
+//   8^3 bricks   8 per chunk, a bit each in brick8Any / brick8Full
+//   chunk        chunkAny / chunkFull
+//   chunk group  2^3 chunks (32^3 voxels), a bit each in groupAny
+// "Any" means at least one solid voxel, "full" means every voxel is solid. The masks are kept in flat
+// arrays so they can be copied into a buffer as they are; chunkAny and groupAny go to cull.comp every frame.
+// Next to the masks every chunk keeps a box of solid voxels, grown from its first full 4^3 brick, which
+// the CPU occlusion culler draws as the chunk's occluder.
+#define BRICK_DIMENSION 4
+#define BRICKS_PER_CHUNK (CHUNK_DIMENSION / BRICK_DIMENSION)
+#define GROUP_DIMENSION (PLANET_DIMENSION / 2)
+static_assert(PLANET_DIMENSION % 2 == 0, "chunk groups are 2^3 chunks");
+static_assert(GROUP_DIMENSION * GROUP_DIMENSION * GROUP_DIMENSION <= 64, "groupAny holds a bit per chunk group in one uint64_t");
+namespace voxelNS
+{
+    inline int brick4Index(glm::ivec3 local) { return ((local.z >> 2) * BRICKS_PER_CHUNK * BRICKS_PER_CHUNK) + ((local.y >> 2) * BRICKS_PER_CHUNK) + (local.x >> 2); }
+    inline int brick8Index(glm::ivec3 local) { return ((local.z >> 3) * 4) + ((local.y >> 3) * 2) + (local.x >> 3); }
+    inline int groupIndex(glm::ivec3 chunkCoord) { return ((chunkCoord.z >> 1) * GROUP_DIMENSION * GROUP_DIMENSION) + ((chunkCoord.y >> 1) * GROUP_DIMENSION) + (chunkCoord.x >> 1); }
+
+    // The 4^3 bricks making up each 8^3 brick, as a mask over brick4 bits
+    inline uint64_t brick8Mask(int brick8) {
+        static const struct Table {
+            uint64_t mask[8];
+            Table() {
+                for (int i = 0; i < 8; i++) mask[i] = 0;
+                for (int z = 0; z < BRICKS_PER_CHUNK; z++)
+                    for (int y = 0; y < BRICKS_PER_CHUNK; y++)
+                        for (int x = 0; x < BRICKS_PER_CHUNK; x++)
+                            mask[((z >> 1) * 4) + ((y >> 1) * 2) + (x >> 1)] |= uint64_t(1) << ((z * BRICKS_PER_CHUNK * BRICKS_PER_CHUNK) + (y * BRICKS_PER_CHUNK) + x);
+            }
+        } table;
+        return table.mask[brick8];
+    }
+
+    // True when the 8 corner voxels of marching cube cell (x, y, z) all sit in empty or all in full bricks,
+    // value is then the cell's corner mask (0 or 255) without reading any voxel
+    inline bool Cell_Uniform(uint64_t brick4Any, uint64_t brick4Full, int x, int y, int z, uint8_t& value) {
+        uint64_t bricks = 0;
+        for (int bz = z >> 2; bz <= (z + 1) >> 2; bz++)
+            for (int by = y >> 2; by <= (y + 1) >> 2; by++)
+                for (int bx = x >> 2; bx <= (x + 1) >> 2; bx++)
+                    bricks |= uint64_t(1) << ((bz * BRICKS_PER_CHUNK * BRICKS_PER_CHUNK) + (by * BRICKS_PER_CHUNK) + bx);
+        if (!(brick4Any & bricks)) {
+            value = 0;
+            return true;
+        }
+        if ((brick4Full & bricks) == bricks) {
+            value = 255;
+            return true;
+        }
+        return false;
+    }
+
+    // Inclusive local voxel coordinates, min > max when the chunk has no full brick
+    struct SolidBox {
+        glm::ivec3 min = glm::ivec3(1);
+        glm::ivec3 max = glm::ivec3(0);
+        bool empty() const { return min.x > max.x; }
+    };
+
+    struct OccupancyPyramid {
+        uint64_t brick4Any[CHUNK_COUNT] = {};
+        uint64_t brick4Full[CHUNK_COUNT] = {};
+        uint8_t brick8Any[CHUNK_COUNT] = {};
+        uint8_t brick8Full[CHUNK_COUNT] = {};
+        ChunkBitset chunkAny;
+        ChunkBitset chunkFull;
+        uint64_t groupAny = 0;
+        SolidBox solidBox[CHUNK_COUNT];
+
+        // Per chunk levels only, safe to call for different chunks from several threads.
+        // Follow with Update_Coarse once the chunks are done.
+        void Build_Chunk(const Chunk* chunk, int chunkIndex) {
+            glm::ivec3 region = glm::ivec3(CHUNK_DIMENSION - 1);
+            brick4Any[chunkIndex] = 0;
+            brick4Full[chunkIndex] = 0;
+            Update_Bricks(chunk, chunkIndex, glm::ivec3(0), region);
+            Update_Solid_Box(chunk, chunkIndex);
+        }
+        // Incremental update after an edit, only the bricks touched by the region are rescanned
+        void Update(Chunk** chunk, const DirtyRegion& region) {
+            Update_Bricks(chunk[region.chunkIndex], region.chunkIndex, region.min, region.max);
+            Update_Solid_Box(chunk[region.chunkIndex], region.chunkIndex);
+            Update_Coarse(region.chunkIndex);
+        }
+        void Update(Chunk** chunk, const std::vector<DirtyRegion>& dirtyRegions) {
+            for (const DirtyRegion& region : dirtyRegions) {
+                Update(chunk, region);
+            }
+        }
+        // Chunk and group bits of one chunk, from its brick masks
+        void Update_Coarse(int chunkIndex) {
+            if (brick4Any[chunkIndex]) chunkAny.set(chunkIndex); else chunkAny.reset(chunkIndex);
+            if (brick4Full[chunkIndex] == ~uint64_t(0)) chunkFull.set(chunkIndex); else chunkFull.reset(chunkIndex);
+            glm::ivec3 c = glm::ivec3(chunkIndex_to_pos(chunkIndex));
+            glm::ivec3 first = (c >> 1) << 1;
+            bool any = false;
+            for (int z = first.z; z < first.z + 2; z++)
+                for (int y = first.y; y < first.y + 2; y++)
+                    for (int x = first.x; x < first.x + 2; x++)
+                        any |= chunkAny.test((z * PLANET_DIMENSION * PLANET_DIMENSION) + (y * PLANET_DIMENSION) + x);
+            uint64_t bit = uint64_t(1) << groupIndex(c);
+            groupAny = any ? (groupAny | bit) : (groupAny & ~bit);
+        }
+
+        // Edge of the largest empty cell (32, 16, 8 or 4) around global grid coordinate g, 0 if its 4^3 brick holds solid voxels
+        int Empty_Size(glm::ivec3 g) const {
+            glm::ivec3 c = g >> CHUNK_SHIFT;
+            if (!(groupAny >> groupIndex(c) & 1)) {
+                return 2 * CHUNK_DIMENSION;
+            }
+            int chunkIndex = (c.z * PLANET_DIMENSION * PLANET_DIMENSION) + (c.y * PLANET_DIMENSION) + c.x;
+            if (!chunkAny.test(chunkIndex)) {
+                return CHUNK_DIMENSION;
+            }
+            glm::ivec3 local = g & (CHUNK_DIMENSION - 1);
+            if (!(brick8Any[chunkIndex] >> brick8Index(local) & 1)) {
+                return 8;
+            }
+            if (!(brick4Any[chunkIndex] >> brick4Index(local) & 1)) {
+                return BRICK_DIMENSION;
+            }
+            return 0;
+        }
+
+    private:
+        void Update_Bricks(const Chunk* chunk, int chunkIndex, glm::ivec3 min, glm::ivec3 max) {
+            glm::ivec3 brickMin = min >> 2;
+            glm::ivec3 brickMax = max >> 2;
+            for (int bz = brickMin.z; bz <= brickMax.z; bz++) {
+                for (int by = brickMin.y; by <= brickMax.y; by++) {
+                    for (int bx = brickMin.x; bx <= brickMax.x; bx++) {
+                        int solid = 0;
+                        for (int z = bz * BRICK_DIMENSION; z < (bz + 1) * BRICK_DIMENSION; z++)
+                            for (int y = by * BRICK_DIMENSION; y < (by + 1) * BRICK_DIMENSION; y++)
+                                for (int x = bx * BRICK_DIMENSION; x < (bx + 1) * BRICK_DIMENSION; x++)
+                                    solid += chunk->voxel[(z * CHUNK_DIMENSION * CHUNK_DIMENSION) + (y * CHUNK_DIMENSION) + x] & 1;
+                        uint64_t bit = uint64_t(1) << ((bz * BRICKS_PER_CHUNK * BRICKS_PER_CHUNK) + (by * BRICKS_PER_CHUNK) + bx);
+                        brick4Any[chunkIndex] = solid ? (brick4Any[chunkIndex] | bit) : (brick4Any[chunkIndex] & ~bit);
+                        brick4Full[chunkIndex] = solid == BRICK_DIMENSION * BRICK_DIMENSION * BRICK_DIMENSION ? (brick4Full[chunkIndex] | bit) : (brick4Full[chunkIndex] & ~bit);
+                    }
+                }
+            }
+            uint8_t any = 0;
+            uint8_t full = 0;
+            for (int i = 0; i < 8; i++) {
+                uint64_t mask = brick8Mask(i);
+                if (brick4Any[chunkIndex] & mask) any |= 1 << i;
+                if ((brick4Full[chunkIndex] & mask) == mask) full |= 1 << i;
+            }
+            brick8Any[chunkIndex] = any;
+            brick8Full[chunkIndex] = full;
+        }
+        // Pushes the sides of the first full brick out one voxel layer at a time while the layer is solid
+        void Update_Solid_Box(const Chunk* chunk, int chunkIndex) {
+            SolidBox& box = solidBox[chunkIndex];
+            box = SolidBox();
+            if (!brick4Full[chunkIndex]) {
+                return;
+            }
+            int brick = ChunkBitset::lowest_bit(brick4Full[chunkIndex]);
+            box.min = glm::ivec3(brick % BRICKS_PER_CHUNK, (brick / BRICKS_PER_CHUNK) % BRICKS_PER_CHUNK, brick / (BRICKS_PER_CHUNK * BRICKS_PER_CHUNK)) * BRICK_DIMENSION;
+            box.max = box.min + glm::ivec3(BRICK_DIMENSION - 1);
+            for (bool grown = true; grown;) {
+                grown = false;
+                for (int side = 0; side < 6; side++) {
+                    int axis = side >> 1;
+                    glm::ivec3 layerMin = box.min;
+                    glm::ivec3 layerMax = box.max;
+                    if (side & 1) {
+                        if (box.max[axis] == CHUNK_DIMENSION - 1) continue;
+                        layerMin[axis] = layerMax[axis] = box.max[axis] + 1;
+                    }
+                    else {
+                        if (box.min[axis] == 0) continue;
+                        layerMin[axis] = layerMax[axis] = box.min[axis] - 1;
+                    }
+                    bool solid = true;
+                    for (int z = layerMin.z; z <= layerMax.z && solid; z++)
+                        for (int y = layerMin.y; y <= layerMax.y && solid; y++)
+                            for (int x = layerMin.x; x <= layerMax.x && solid; x++)
+                                solid = chunk->voxel[(z * CHUNK_DIMENSION * CHUNK_DIMENSION) + (y * CHUNK_DIMENSION) + x] & 1;
+                    if (solid) {
+                        (side & 1 ? box.max : box.min)[axis] = layerMin[axis];
+                        grown = true;
+                    }
+                }
+            }
+        }
+    };
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <vector>
+#include "vulkanexamplebase.h"
+#include "MemoryStrategy.h"
+#include "UploadManager.h"
+
+// One-shot bulk upload into a single destination buffer, written by several threads at once.
+// Every worker owns a command pool, a command buffer and a disjoint region of one staging buffer, so
+// workers copy and record without any lock; the owner submits all of their command buffers together
+// and waits once. When the destination is host visible the workers write it directly instead.
+// Meant for load phases: nothing else may write dst until submit() has returned.
+class ParallelUpload
+{
+public:
+    // workerBytes[i] is the most worker i will write. Returns false when the staging buffer does not fit
+    // the memory budget, in which case nothing was created and the caller uploads some other way.
+    bool begin(vks::VulkanDevice* device, MemoryStrategy* memory, const UploadManager& uploads, VkBuffer dst, void* dstMapped, const std::vector<VkDeviceSize>& workerBytes)
+    {
+        this->device = device;
+        this->memory = memory;
+        this->dst = dst;
+        this->dstMapped = static_cast<char*>(dstMapped);
+        transferQueue = uploads.transfer_queue();
+        workers.assign(workerBytes.size(), Worker());
+        if (dstMapped) {
+            return true;
+        }
+        VkDeviceSize stagingSize = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].stagingHead = stagingSize;
+            stagingSize += (workerBytes[i] + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+        }
+        if (memory->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, MemoryUsage::Upload, MemoryCategory::Staging, &staging, stagingSize ? stagingSize : STAGING_ALIGNMENT) != VK_SUCCESS) {
+            workers.clear();
+            return false;
+        }
+        VK_CHECK_RESULT(staging.map());
+        VkCommandPoolCreateInfo poolInfo = vks::initializers::commandPoolCreateInfo();
+        poolInfo.queueFamilyIndex = uploads.transfer_family();
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        for (Worker& worker : workers) {
+            VK_CHECK_RESULT(vkCreateCommandPool(device->logicalDevice, &poolInfo, nullptr, &worker.commandPool));
+            VkCommandBufferAllocateInfo allocateInfo = vks::initializers::commandBufferAllocateInfo(worker.commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+            VK_CHECK_RESULT(vkAllocateCommandBuffers(device->logicalDevice, &allocateInfo, &worker.commandBuffer));
+        }
+        return true;
+    }
+
+    // Called from worker's own thread only
+    void write(uint32_t worker, VkDeviceSize dstOffset, const void* data, VkDeviceSize size)
+    {
+        Worker& w = workers[worker];
+        if (dstMapped) {
+            memcpy(dstMapped + dstOffset, data, size);
+            return;
+        }
+        memcpy(static_cast<char*>(staging.mapped) + w.stagingHead, data, size);
+        w.regions.push_back({ w.stagingHead, dstOffset, size });
+        w.stagingHead += size;
+    }
+    // Records the worker's copies, from its own thread once it is done writing
+    void finish(uint32_t worker)
+    {
+        Worker& w = workers[worker];
+        if (dstMapped || w.regions.empty()) {
+            return;
+        }
+        VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK_RESULT(vkBeginCommandBuffer(w.commandBuffer, &beginInfo));
+        vkCmdCopyBuffer(w.commandBuffer, staging.buffer, dst, static_cast<uint32_t>(w.regions.size()), w.regions.data());
+        VK_CHECK_RESULT(vkEndCommandBuffer(w.commandBuffer));
+        w.recorded = true;
+    }
+    // Submits every recorded command buffer at once, waits for them and releases the per worker resources
+    void submit()
+    {
+        std::vector<VkCommandBuffer> commandBuffers;
+        for (const Worker& worker : workers) {
+            if (worker.recorded) {
+                commandBuffers.push_back(worker.commandBuffer);
+            }
+        }
+        if (!commandBuffers.empty()) {
+            VkFenceCreateInfo fenceInfo = vks::initializers::fenceCreateInfo(0);
+            VkFence fence;
+            VK_CHECK_RESULT(vkCreateFence(device->logicalDevice, &fenceInfo, nullptr, &fence));
+            VkSubmitInfo submitInfo = vks::initializers::submitInfo();
+            submitInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+            submitInfo.pCommandBuffers = commandBuffers.data();
+            VK_CHECK_RESULT(vkQueueSubmit(transferQueue, 1, &submitInfo, fence));
+            VK_CHECK_RESULT(vkWaitForFences(device->logicalDevice, 1, &fence, VK_TRUE, UINT64_MAX));
+            vkDestroyFence(device->logicalDevice, fence, nullptr);
+        }
+        for (Worker& worker : workers) {
+            if (worker.commandPool) {
+                vkDestroyCommandPool(device->logicalDevice, worker.commandPool, nullptr);
+                worker.commandPool = VK_NULL_HANDLE;
+            }
+        }
+        if (staging.buffer) {
+            staging.unmap();
+            memory->destroyBuffer(staging);
+        }
+    }
+
+private:
+    static const VkDeviceSize STAGING_ALIGNMENT = 16;
+
+    struct Worker {
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkDeviceSize stagingHead = 0;       // next free byte of the worker's staging region
+        std::vector<VkBufferCopy> regions;
+        bool recorded = false;
+    };
+    vks::VulkanDevice* device = nullptr;
+    MemoryStrategy* memory = nullptr;
+    VkQueue transferQueue = VK_NULL_HANDLE;
+    VkBuffer dst = VK_NULL_HANDLE;
+    char* dstMapped = nullptr;
+    vks::Buffer staging;
+    std::vector<Worker> workers;
+};
@@ -0,0 +1,323 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <emmintrin.h>
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#include "Occupancy.h"
+#include "WorkerPool.h"
+
+// Batched ray queries (shotgun spreads, line of sight, occlusion probes) against the voxel grid.
+// Rays are traversed four at a time as an SSE2 packet: every lane runs the same DDA as voxelNS::RayCast,
+// the stepping, empty space skipping and termination are done for all lanes at once under per-lane masks and
+// only the pyramid and voxel fetches are scalar. Finished lanes are refilled with the next rays of the batch.
+// Results come back as a structure of arrays, one entry per ray.
+namespace voxelNS
+{
+    struct RayBatchResult {
+        std::vector<uint8_t> hit;
+        std::vector<float> distance;            // along the normalized ray direction
+        std::vector<int32_t> voxelX, voxelY, voxelZ; // global grid coordinate of the hit voxel
+        std::vector<int32_t> chunkIndex;
+        std::vector<int32_t> voxelIndex;
+        std::vector<int8_t> normalX, normalY, normalZ; // entry face in the caller's space, see RayHit
+
+        void resize(size_t count) {
+            hit.resize(count);
+            distance.resize(count);
+            voxelX.resize(count);
+            voxelY.resize(count);
+            voxelZ.resize(count);
+            chunkIndex.resize(count);
+            voxelIndex.resize(count);
+            normalX.resize(count);
+            normalY.resize(count);
+            normalZ.resize(count);
+        }
+    };
+
+    namespace rayPacket
+    {
+        inline __m128 select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+        inline __m128 floor_positive(__m128 v) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(v)); } // v >= 0
+        inline __m128 lane_mask(int bits) { return _mm_castsi128_ps(_mm_setr_epi32(bits & 1 ? -1 : 0, bits & 2 ? -1 : 0, bits & 4 ? -1 : 0, bits & 8 ? -1 : 0)); }
+
+        // DDA state of four rays, one per lane
+        struct Packet {
+            __m128 o[3], d[3], inv[3], step[3], stepPositive[3], tDelta[3];
+            __m128 tExit;
+            __m128 t, v[3], tMax[3], normal[3];
+            size_t ray[4];
+
+            // Lanes take over the given lanes of another packet
+            void take(const Packet& other, int bits) {
+                __m128 mask = lane_mask(bits);
+                for (int axis = 0; axis < 3; axis++) {
+                    o[axis] = select(mask, other.o[axis], o[axis]);
+                    d[axis] = select(mask, other.d[axis], d[axis]);
+                    inv[axis] = select(mask, other.inv[axis], inv[axis]);
+                    step[axis] = select(mask, other.step[axis], step[axis]);
+                    stepPositive[axis] = select(mask, other.stepPositive[axis], stepPositive[axis]);
+                    tDelta[axis] = select(mask, other.tDelta[axis], tDelta[axis]);
+                    v[axis] = select(mask, other.v[axis], v[axis]);
+                    tMax[axis] = select(mask, other.tMax[axis], tMax[axis]);
+                    normal[axis] = select(mask, other.normal[axis], normal[axis]);
+                }
+                tExit = select(mask, other.tExit, tExit);
+                t = select(mask, other.t, t);
+                for (int l = 0; l < 4; l++) {
+                    if (bits & (1 << l)) ray[l] = other.ray[l];
+                }
+            }
+        };
+
+        // Sets up rays [first, first + count), count <= 4, and returns the lanes whose ray enters the world
+        inline int Init(Packet& packet, const glm::vec3* origins, const glm::vec3* directions, size_t first, size_t count, float maxDistance) {
+            const float worldDimension = (float)(PLANET_DIMENSION * CHUNK_DIMENSION);
+            alignas(16) float lane[3][2][4]; // [axis][origin, direction][lane]
+            for (int l = 0; l < 4; l++) {
+                packet.ray[l] = first + (l < (int)count ? l : 0);
+                for (int axis = 0; axis < 3; axis++) {
+                    lane[axis][0][l] = -origins[packet.ray[l]][axis];
+                    lane[axis][1][l] = -directions[packet.ray[l]][axis];
+                }
+            }
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+            __m128 length2 = zero;
+            for (int axis = 0; axis < 3; axis++) {
+                packet.o[axis] = _mm_load_ps(lane[axis][0]);
+                packet.d[axis] = _mm_load_ps(lane[axis][1]);
+                length2 = _mm_add_ps(length2, _mm_mul_ps(packet.d[axis], packet.d[axis]));
+            }
+            __m128 active = _mm_and_ps(lane_mask((1 << count) - 1), _mm_cmpgt_ps(length2, zero));
+            __m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(select(active, length2, one)));
+            for (int axis = 0; axis < 3; axis++) {
+                __m128 d = _mm_mul_ps(packet.d[axis], invLength);
+                // Axis parallel lanes get a tiny slope instead of infinities, they never step on that axis within the world
+                d = select(_mm_cmplt_ps(_mm_and_ps(d, absMask), _mm_set1_ps(1e-20f)), _mm_set1_ps(1e-20f), d);
+                packet.d[axis] = d;
+                packet.inv[axis] = _mm_div_ps(one, d);
+                packet.stepPositive[axis] = _mm_cmpgt_ps(d, zero);
+                packet.step[axis] = select(packet.stepPositive[axis], one, _mm_set1_ps(-1.0f));
+                packet.tDelta[axis] = _mm_and_ps(packet.inv[axis], absMask);
+            }
+
+            // Clip against the world box
+            __m128 tNear[3];
+            __m128 tEnter = zero;
+            packet.tExit = _mm_set1_ps(maxDistance);
+            for (int axis = 0; axis < 3; axis++) {
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(zero, packet.o[axis]), packet.inv[axis]);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(worldDimension), packet.o[axis]), packet.inv[axis]);
+                tNear[axis] = _mm_min_ps(t0, t1);
+                tEnter = _mm_max_ps(tEnter, tNear[axis]);
+                packet.tExit = _mm_min_ps(packet.tExit, _mm_max_ps(t0, t1));
+            }
+            active = _mm_and_ps(active, _mm_cmple_ps(tEnter, packet.tExit));
+
+            // Entry voxel, tMax and the face the ray came in through
+            packet.t = tEnter;
+            __m128 entered = _mm_cmpgt_ps(tEnter, zero);
+            __m128 enterX = _mm_and_ps(entered, _mm_cmpeq_ps(tNear[0], tEnter));
+            __m128 enterY = _mm_andnot_ps(enterX, _mm_and_ps(entered, _mm_cmpeq_ps(tNear[1], tEnter)));
+            __m128 enterZ = _mm_andnot_ps(_mm_or_ps(enterX, enterY), _mm_and_ps(entered, _mm_cmpeq_ps(tNear[2], tEnter)));
+            __m128 enterMask[3] = { enterX, enterY, enterZ };
+            for (int axis = 0; axis < 3; axis++) {
+                __m128 p = _mm_add_ps(packet.o[axis], _mm_mul_ps(packet.d[axis], tEnter));
+                __m128 v = floor_positive(_mm_min_ps(_mm_max_ps(p, zero), _mm_set1_ps(worldDimension - 1.0f)));
+                // The entry face fixes the voxel on that axis, whatever float rounding says
+                v = select(enterMask[axis], select(packet.stepPositive[axis], zero, _mm_set1_ps(worldDimension - 1.0f)), v);
+                packet.v[axis] = v;
+                packet.tMax[axis] = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(v, _mm_and_ps(packet.stepPositive[axis], one)), packet.o[axis]), packet.inv[axis]);
+                packet.normal[axis] = _mm_and_ps(enterMask[axis], packet.step[axis]);
+            }
+            return _mm_movemask_ps(active);
+        }
+
+        // Traces rays [first, last). Lanes whose ray finished are refilled from the next packet straight
+        // away, so a long ray does not keep three idle lanes waiting.
+        inline void Trace(const glm::vec3* origins, const glm::vec3* directions, size_t first, size_t last,
+            Chunk** chunk, const OccupancyPyramid& occupancy, float maxDistance, RayBatchResult& result) {
+            const float worldDimension = (float)(PLANET_DIMENSION * CHUNK_DIMENSION);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 allSet = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+            Packet p, pending;
+            size_t next = first;
+            int activeBits = 0;
+            int pendingBits = 0;
+            for (;;) {
+                // Refill the idle lanes
+                while (!pendingBits && next < last) {
+                    size_t count = std::min<size_t>(4, last - next);
+                    pendingBits = Init(pending, origins, directions, next, count, maxDistance);
+                    next += count;
+                }
+                int refill = pendingBits & ~activeBits;
+                if (refill) {
+                    p.take(pending, refill);
+                    activeBits |= refill;
+                    pendingBits &= ~refill;
+                }
+                if (!activeBits) {
+                    break;
+                }
+
+                // Per live lane: the empty cell around the voxel from the occupancy pyramid, or the voxel itself
+                alignas(16) int32_t vi[3][4];
+                for (int axis = 0; axis < 3; axis++) {
+                    _mm_store_si128(reinterpret_cast<__m128i*>(vi[axis]), _mm_cvttps_epi32(p.v[axis]));
+                }
+                alignas(16) float emptySize[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                int32_t chunkIndex[4], voxelIndex[4];
+                int skipBits = 0;
+                int hitBits = 0;
+                for (int l = 0; l < 4; l++) {
+                    if (!(activeBits & (1 << l))) continue;
+                    glm::ivec3 g = glm::ivec3(vi[0][l], vi[1][l], vi[2][l]);
+                    int size = occupancy.Empty_Size(g);
+                    if (size) {
+                        emptySize[l] = (float)size;
+                        skipBits |= 1 << l;
+                        continue;
+                    }
+                    glm::ivec3 c = g >> CHUNK_SHIFT;
+                    glm::ivec3 local = g & (CHUNK_DIMENSION - 1);
+                    chunkIndex[l] = (c.z * PLANET_DIMENSION * PLANET_DIMENSION) + (c.y * PLANET_DIMENSION) + c.x;
+                    voxelIndex[l] = (local.z * CHUNK_DIMENSION * CHUNK_DIMENSION) + (local.y * CHUNK_DIMENSION) + local.x;
+                    if (chunk[chunkIndex[l]]->voxel[voxelIndex[l]] & 1) {
+                        hitBits |= 1 << l;
+                    }
+                }
+                if (hitBits) {
+                    alignas(16) float tl[4], nx[4], ny[4], nz[4];
+                    _mm_store_ps(tl, p.t);
+                    _mm_store_ps(nx, p.normal[0]);
+                    _mm_store_ps(ny, p.normal[1]);
+                    _mm_store_ps(nz, p.normal[2]);
+                    for (int l = 0; l < 4; l++) {
+                        if (!(hitBits & (1 << l))) continue;
+                        size_t ray = p.ray[l];
+                        result.hit[ray] = 1;
+                        result.distance[ray] = tl[l];
+                        result.voxelX[ray] = vi[0][l];
+                        result.voxelY[ray] = vi[1][l];
+                        result.voxelZ[ray] = vi[2][l];
+                        result.chunkIndex[ray] = chunkIndex[l];
+                        result.voxelIndex[ray] = voxelIndex[l];
+                        result.normalX[ray] = (int8_t)nx[l];
+                        result.normalY[ray] = (int8_t)ny[l];
+                        result.normalZ[ray] = (int8_t)nz[l];
+                    }
+                    activeBits &= ~hitBits;
+                    if (!activeBits) {
+                        continue;
+                    }
+                }
+                __m128 active = lane_mask(activeBits);
+
+                // Voxel step: advance along the axis with the smallest tMax
+                __m128 stepX = _mm_and_ps(_mm_cmplt_ps(p.tMax[0], p.tMax[1]), _mm_cmplt_ps(p.tMax[0], p.tMax[2]));
+                __m128 stepY = _mm_andnot_ps(stepX, _mm_cmplt_ps(p.tMax[1], p.tMax[2]));
+                __m128 stepZ = _mm_andnot_ps(_mm_or_ps(stepX, stepY), allSet);
+                __m128 stepMask[3] = { _mm_and_ps(active, stepX), _mm_and_ps(active, stepY), _mm_and_ps(active, stepZ) };
+                __m128 tNext = select(active, select(stepX, p.tMax[0], select(stepY, p.tMax[1], p.tMax[2])), p.t);
+                __m128 vNext[3], tMaxNext[3], normalNext[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    vNext[axis] = _mm_add_ps(p.v[axis], _mm_and_ps(stepMask[axis], p.step[axis]));
+                    tMaxNext[axis] = _mm_add_ps(p.tMax[axis], _mm_and_ps(stepMask[axis], p.tDelta[axis]));
+                    normalNext[axis] = select(active, _mm_and_ps(stepMask[axis], p.step[axis]), p.normal[axis]);
+                }
+
+                // Empty cell skip, only when a lane sits in one: jump to where the ray leaves the cell
+                if (skipBits) {
+                    __m128 skipMask = lane_mask(skipBits);
+                    __m128 size = _mm_load_ps(emptySize);
+                    __m128 invSize = _mm_div_ps(one, select(skipMask, size, one));
+                    __m128 base[3], tCell[3];
+                    for (int axis = 0; axis < 3; axis++) {
+                        base[axis] = _mm_mul_ps(floor_positive(_mm_mul_ps(p.v[axis], invSize)), size);
+                        __m128 boundary = _mm_add_ps(base[axis], _mm_and_ps(p.stepPositive[axis], size));
+                        tCell[axis] = _mm_mul_ps(_mm_sub_ps(boundary, p.o[axis]), p.inv[axis]);
+                    }
+                    __m128 skipX = _mm_and_ps(_mm_cmplt_ps(tCell[0], tCell[1]), _mm_cmplt_ps(tCell[0], tCell[2]));
+                    __m128 skipY = _mm_andnot_ps(skipX, _mm_cmplt_ps(tCell[1], tCell[2]));
+                    __m128 skipZ = _mm_andnot_ps(_mm_or_ps(skipX, skipY), allSet);
+                    __m128 skipAxis[3] = { skipX, skipY, skipZ };
+                    __m128 tSkip = select(skipX, tCell[0], select(skipY, tCell[1], tCell[2]));
+                    for (int axis = 0; axis < 3; axis++) {
+                        // The crossed axis lands just outside the cell, the others follow the ray
+                        __m128 pos = _mm_add_ps(p.o[axis], _mm_mul_ps(p.d[axis], tSkip));
+                        __m128 cellLast = _mm_add_ps(base[axis], _mm_sub_ps(size, one));
+                        __m128 vInside = floor_positive(_mm_min_ps(_mm_max_ps(pos, base[axis]), cellLast));
+                        __m128 vCrossed = select(p.stepPositive[axis], _mm_add_ps(base[axis], size), _mm_sub_ps(base[axis], one));
+                        __m128 vSkip = select(skipAxis[axis], vCrossed, vInside);
+                        __m128 tMaxSkip = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(vSkip, _mm_and_ps(p.stepPositive[axis], one)), p.o[axis]), p.inv[axis]);
+                        vNext[axis] = select(skipMask, vSkip, vNext[axis]);
+                        tMaxNext[axis] = select(skipMask, tMaxSkip, tMaxNext[axis]);
+                        normalNext[axis] = select(skipMask, _mm_and_ps(skipAxis[axis], p.step[axis]), normalNext[axis]);
+                    }
+                    tNext = select(skipMask, tSkip, tNext);
+                }
+                __m128 outside = _mm_cmpgt_ps(tNext, p.tExit);
+                for (int axis = 0; axis < 3; axis++) {
+                    p.v[axis] = vNext[axis];
+                    p.tMax[axis] = tMaxNext[axis];
+                    p.normal[axis] = normalNext[axis];
+                    // Lanes that left the world or went past their range are misses
+                    outside = _mm_or_ps(outside, _mm_cmplt_ps(p.v[axis], zero));
+                    outside = _mm_or_ps(outside, _mm_cmpgt_ps(p.v[axis], _mm_set1_ps(worldDimension - 1.0f)));
+                }
+                p.t = tNext;
+                activeBits &= ~_mm_movemask_ps(outside);
+            }
+        }
+    }
+
+    // Casts count rays (in the same space as RayCast) and fills result. With a pool the packets are shared
+    // between its workers and the calling thread; the call returns once every ray is answered.
+    void RayCastBatch(const glm::vec3* origins, const glm::vec3* directions, size_t count, Chunk** chunk,
+        const OccupancyPyramid& occupancy, RayBatchResult& result, float maxDistance = std::numeric_limits<float>::infinity(), WorkerPool* pool = nullptr) {
+        result.resize(count);
+        std::fill(result.hit.begin(), result.hit.end(), 0);
+        // Small batches are not worth waking the workers for
+        const size_t raysPerJob = 256;
+        if (!pool || count <= raysPerJob) {
+            rayPacket::Trace(origins, directions, 0, count, chunk, occupancy, maxDistance, result);
+            return;
+        }
+        // Jobs can start after this call returned (the pool may be busy meshing), so everything they
+        // touch once the batch is done lives in shared state
+        struct Batch {
+            std::atomic<size_t> next{ 0 };
+            std::atomic<size_t> done{ 0 };
+            std::mutex lock;
+            std::condition_variable finished;
+        };
+        std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+        const size_t jobCount = (count + raysPerJob - 1) / raysPerJob;
+        auto work = [=, &result, &occupancy]() {
+            for (;;) {
+                size_t job = batch->next.fetch_add(1);
+                if (job >= jobCount) {
+                    return;
+                }
+                rayPacket::Trace(origins, directions, job * raysPerJob, std::min(count, (job + 1) * raysPerJob), chunk, occupancy, maxDistance, result);
+                if (batch->done.fetch_add(1) + 1 == jobCount) {
+                    std::lock_guard<std::mutex> guard(batch->lock);
+                    batch->finished.notify_all();
+                }
+            }
+        };
+        uint32_t helpers = std::min<uint32_t>(pool->threadCount(), (uint32_t)jobCount - 1);
+        for (uint32_t i = 0; i < helpers; i++) {
+            pool->push(work);
+        }
+        work();
+        std::unique_lock<std::mutex> guard(batch->lock);
+        batch->finished.wait(guard, [&] { return batch->done.load() == jobCount; });
+    }
+}
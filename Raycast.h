@@ -0,0 +1,122 @@
+#pragma once
+#include <limits>
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#include "Occupancy.h"
+
+// Voxel picking with an integer DDA (Amanatides & Woo, "A Fast Voxel Traversal Algorithm for Ray Tracing").
+// Empty space is crossed a cell of the occupancy pyramid at a time (chunk group, chunk, 8^3 or 4^3 brick),
+// the voxels of occupied bricks are visited exactly once each, so the cost is O(cells crossed).
+// Rays are given in the (negated) camera space like the rest of voxelNS; internally the walk runs on the
+// positive grid, where the voxel at grid coordinate g covers [g, g + 1).
+namespace voxelNS
+{
+    struct RayHit {
+        glm::ivec3 voxel;       // global grid coordinate of the hit voxel
+        int chunkIndex;
+        int voxelIndex;
+        glm::ivec3 normal;      // face the ray entered through, in the caller's space (zero if the ray starts inside a voxel)
+        float distance;         // along the normalized ray direction
+        glm::vec3 position;     // entry point, in the caller's space
+    };
+
+    bool RayCast(glm::vec3 origin, glm::vec3 rd, Chunk** chunk, const OccupancyPyramid& occupancy, RayHit& hit, float maxDistance = std::numeric_limits<float>::infinity()) {
+        const float worldDimension = (float)(PLANET_DIMENSION * CHUNK_DIMENSION);
+        const int worldLast = PLANET_DIMENSION * CHUNK_DIMENSION - 1;
+        const float infinity = std::numeric_limits<float>::infinity();
+        float length = glm::length(rd);
+        if (!(length > 0.0f)) { // also rejects NaN directions
+            return false;
+        }
+        glm::vec3 o = -origin;
+        glm::vec3 d = -rd / length;
+
+        // Clip against the world box, remembering the axis the ray enters through
+        float tEnter = 0.0f;
+        float tExit = maxDistance;
+        int lastAxis = -1;
+        for (int axis = 0; axis < 3; axis++) {
+            if (d[axis] == 0.0f) {
+                if (o[axis] < 0.0f || o[axis] >= worldDimension) {
+                    return false;
+                }
+                continue;
+            }
+            float t0 = (0.0f - o[axis]) / d[axis];
+            float t1 = (worldDimension - o[axis]) / d[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > tEnter) {
+                tEnter = t0;
+                lastAxis = axis;
+            }
+            tExit = std::min(tExit, t1);
+        }
+        if (tEnter > tExit) {
+            return false;
+        }
+
+        glm::ivec3 step;
+        glm::vec3 tDelta;
+        for (int axis = 0; axis < 3; axis++) {
+            step[axis] = d[axis] > 0.0f ? 1 : (d[axis] < 0.0f ? -1 : 0);
+            tDelta[axis] = step[axis] != 0 ? 1.0f / std::abs(d[axis]) : infinity;
+        }
+        float t = tEnter;
+        glm::ivec3 v = glm::clamp(glm::ivec3(glm::floor(o + d * t)), glm::ivec3(0), glm::ivec3(worldLast));
+        // The entry face fixes the voxel on that axis, whatever float rounding says
+        if (lastAxis >= 0) {
+            v[lastAxis] = step[lastAxis] > 0 ? 0 : worldLast;
+        }
+        glm::vec3 tMax;
+        for (int axis = 0; axis < 3; axis++) {
+            tMax[axis] = step[axis] != 0 ? ((float)(v[axis] + (step[axis] > 0 ? 1 : 0)) - o[axis]) / d[axis] : infinity;
+        }
+        while (true) {
+            int emptySize = occupancy.Empty_Size(v);
+            int axis;
+            if (emptySize) {
+                // Skip the whole empty cell: leave it through the nearest face, the other axes follow the ray
+                glm::ivec3 base = v & ~(emptySize - 1);
+                glm::vec3 tCell;
+                for (int i = 0; i < 3; i++) {
+                    tCell[i] = step[i] != 0 ? ((float)(base[i] + (step[i] > 0 ? emptySize : 0)) - o[i]) / d[i] : infinity;
+                }
+                axis = tCell.x < tCell.y ? (tCell.x < tCell.z ? 0 : 2) : (tCell.y < tCell.z ? 1 : 2);
+                t = tCell[axis];
+                glm::ivec3 inside = glm::clamp(glm::ivec3(glm::floor(o + d * t)), base, base + glm::ivec3(emptySize - 1));
+                inside[axis] = step[axis] > 0 ? base[axis] + emptySize : base[axis] - 1;
+                v = inside;
+                for (int i = 0; i < 3; i++) {
+                    tMax[i] = step[i] != 0 ? ((float)(v[i] + (step[i] > 0 ? 1 : 0)) - o[i]) / d[i] : infinity;
+                }
+            }
+            else {
+                glm::ivec3 c = v >> CHUNK_SHIFT;
+                glm::ivec3 local = v & (CHUNK_DIMENSION - 1);
+                int chunkIndex = (c.z * PLANET_DIMENSION * PLANET_DIMENSION) + (c.y * PLANET_DIMENSION) + c.x;
+                int voxelIndex = (local.z * CHUNK_DIMENSION * CHUNK_DIMENSION) + (local.y * CHUNK_DIMENSION) + local.x;
+                if (chunk[chunkIndex]->voxel[voxelIndex] & 1) {
+                    hit.voxel = v;
+                    hit.chunkIndex = chunkIndex;
+                    hit.voxelIndex = voxelIndex;
+                    hit.normal = glm::ivec3(0);
+                    if (lastAxis >= 0) {
+                        // The face points back against the step, negated into the caller's space
+                        hit.normal[lastAxis] = step[lastAxis];
+                    }
+                    hit.distance = t;
+                    hit.position = -(o + d * t);
+                    return true;
+                }
+                axis = tMax.x < tMax.y ? (tMax.x < tMax.z ? 0 : 2) : (tMax.y < tMax.z ? 1 : 2);
+                t = tMax[axis];
+                v[axis] += step[axis];
+                tMax[axis] += tDelta[axis];
+            }
+            lastAxis = axis;
+            if (t > tExit || v[axis] < 0 || v[axis] > worldLast) {
+                return false;
+            }
+        }
+    }
+}
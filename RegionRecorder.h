@@ -0,0 +1,112 @@
+#pragma once
+#include <vector>
+#include <functional>
+#include <chrono>
+#include "vulkanexamplebase.h"
+#include "WorkerPool.h"
+
+// Records secondary command buffers, one per region and frame in flight, as parallel_for tasks on the
+// worker pool. The regions are split into lanes (region % laneCount), every lane owns one command pool per
+// frame in flight and is a single task, so no pool is ever used by two threads at once and nothing is
+// locked while recording. Region buffers are reset one by one and kept across frames: the owner only hands
+// over the regions whose content changed since the frame's buffers were last recorded, and record()
+// returns once all of them are done.
+class RegionRecorder
+{
+public:
+    // Records the commands of one region between begin and end, called on a worker or the calling thread
+    typedef std::function<void(VkCommandBuffer commandBuffer, uint32_t region)> RecordFunction;
+
+    struct Stats {
+        uint32_t recorded = 0;      // region buffers recorded by the last call to record
+        float milliseconds = 0.0f;  // time the last call to record took
+        uint64_t totalRecorded = 0; // region buffers recorded since creation
+    };
+
+    void create(VkDevice device, uint32_t queueFamily, WorkerPool* pool, uint32_t laneCount, uint32_t frameCount, uint32_t regionCount)
+    {
+        this->device = device;
+        this->pool = pool;
+        this->frameCount = frameCount;
+        this->regionCount = regionCount;
+        lanes.resize(laneCount);
+        VkCommandPoolCreateInfo poolInfo = vks::initializers::commandPoolCreateInfo();
+        poolInfo.queueFamilyIndex = queueFamily;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        commandBuffers.resize(frameCount * regionCount);
+        for (uint32_t lane = 0; lane < laneCount; lane++) {
+            Lane& laneState = lanes[lane];
+            laneState.commandPools.resize(frameCount);
+            for (uint32_t frame = 0; frame < frameCount; frame++) {
+                VK_CHECK_RESULT(vkCreateCommandPool(device, &poolInfo, nullptr, &laneState.commandPools[frame]));
+                for (uint32_t region = lane; region < regionCount; region += laneCount) {
+                    VkCommandBufferAllocateInfo allocateInfo = vks::initializers::commandBufferAllocateInfo(laneState.commandPools[frame], VK_COMMAND_BUFFER_LEVEL_SECONDARY, 1);
+                    VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocateInfo, &commandBuffers[frame * regionCount + region]));
+                }
+            }
+        }
+    }
+    void destroy()
+    {
+        for (Lane& lane : lanes) {
+            for (VkCommandPool commandPool : lane.commandPools) {
+                vkDestroyCommandPool(device, commandPool, nullptr);
+            }
+        }
+        lanes.clear();
+        commandBuffers.clear();
+    }
+
+    // Records the listed regions of the frame's buffers and waits for them. None of the frame's buffers
+    // may be in use by the GPU.
+    void record(uint32_t frame, const std::vector<uint32_t>& regions, const VkCommandBufferInheritanceInfo& inheritance, const RecordFunction& recordRegion)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        stats.recorded = static_cast<uint32_t>(regions.size());
+        stats.totalRecorded += regions.size();
+        if (!regions.empty()) {
+            // Only the lanes with work become tasks
+            std::vector<uint32_t> busyLanes;
+            for (Lane& lane : lanes) {
+                lane.regions.clear();
+            }
+            for (uint32_t region : regions) {
+                std::vector<uint32_t>& laneRegions = lanes[region % lanes.size()].regions;
+                if (laneRegions.empty()) {
+                    busyLanes.push_back(region % lanes.size());
+                }
+                laneRegions.push_back(region);
+            }
+            VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+            beginInfo.pInheritanceInfo = &inheritance;
+            pool->parallel_for(static_cast<uint32_t>(busyLanes.size()), [&](uint32_t task) {
+                for (uint32_t region : lanes[busyLanes[task]].regions) {
+                    VkCommandBuffer commandBuffer = commandBuffers[frame * regionCount + region];
+                    VK_CHECK_RESULT(vkResetCommandBuffer(commandBuffer, 0));
+                    VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+                    recordRegion(commandBuffer, region);
+                    VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+                }
+            });
+        }
+        stats.milliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    VkCommandBuffer command_buffer(uint32_t frame, uint32_t region) const { return commandBuffers[frame * regionCount + region]; }
+    uint32_t lane_count() const { return static_cast<uint32_t>(lanes.size()); }
+    const Stats& statistics() const { return stats; }
+
+private:
+    struct Lane {
+        std::vector<VkCommandPool> commandPools;    // one per frame in flight
+        std::vector<uint32_t> regions;              // to record in the current call to record
+    };
+    VkDevice device = VK_NULL_HANDLE;
+    WorkerPool* pool = nullptr;
+    uint32_t frameCount = 0;
+    uint32_t regionCount = 0;
+    std::vector<Lane> lanes;
+    std::vector<VkCommandBuffer> commandBuffers;    // frame major
+    Stats stats;
+};
@@ -0,0 +1,414 @@
+#pragma once
+#include <vector>
+#include "vulkanexamplebase.h"
+#include "Voxel.h"
+#include "UploadManager.h"
+#include "DeletionQueue.h"
+#include "MemoryStrategy.h"
+
+// Two level segregated fit allocator (Masmano et al., "TLSF: a New Dynamic Memory Allocator for Real-Time Systems").
+// Free ranges are binned by the position of their highest bit (first level) and the next SL_BITS bits
+// (second level); a bitmap per level finds a large enough bin with two bit scans, so allocate and free
+// are O(1) whatever the number of chunks. Neighbouring free ranges are merged on free.
+// Sizes and offsets are in elements (vertices for the terrain heap), the allocator never touches memory.
+class TlsfAllocator
+{
+public:
+    static const uint32_t INVALID = ~0u;
+
+    explicit TlsfAllocator(uint32_t capacity = 0)
+    {
+        for (uint32_t fl = 0; fl < FL_COUNT; fl++)
+            for (uint32_t sl = 0; sl < SL_COUNT; sl++)
+                freeHeads[fl][sl] = INVALID;
+        grow(capacity);
+    }
+
+    // Returns a block id and its first element, INVALID when no free range is large enough
+    uint32_t allocate(uint32_t size, uint32_t& offset)
+    {
+        if (size == 0) {
+            return INVALID;
+        }
+        uint32_t fl, sl;
+        uint32_t id = INVALID;
+        if (find_free(size, fl, sl)) {
+            id = freeHeads[fl][sl];
+        }
+        else {
+            // The rounded up search skips the size's own bin, which may still hold a block that fits
+            mapping(size, fl, sl);
+            for (uint32_t candidate = freeHeads[fl][sl]; candidate != INVALID; candidate = blocks[candidate].nextFree) {
+                if (blocks[candidate].size >= size) {
+                    id = candidate;
+                    break;
+                }
+            }
+            if (id == INVALID) {
+                return INVALID;
+            }
+        }
+        remove_free(id);
+        if (blocks[id].size > size) {
+            // Hand the tail back as a new free block
+            uint32_t rest = new_block();
+            blocks[rest].offset = blocks[id].offset + size;
+            blocks[rest].size = blocks[id].size - size;
+            blocks[rest].prevPhys = id;
+            blocks[rest].nextPhys = blocks[id].nextPhys;
+            if (blocks[id].nextPhys != INVALID) {
+                blocks[blocks[id].nextPhys].prevPhys = rest;
+            }
+            else {
+                lastBlock = rest;
+            }
+            blocks[id].nextPhys = rest;
+            blocks[id].size = size;
+            insert_free(rest);
+        }
+        blocks[id].free = false;
+        usedSize += blocks[id].size;
+        offset = blocks[id].offset;
+        return id;
+    }
+    void free(uint32_t id)
+    {
+        if (id == INVALID) {
+            return;
+        }
+        usedSize -= blocks[id].size;
+        uint32_t prev = blocks[id].prevPhys;
+        if (prev != INVALID && blocks[prev].free) {
+            remove_free(prev);
+            blocks[prev].size += blocks[id].size;
+            unlink(id);
+            id = prev;
+        }
+        uint32_t next = blocks[id].nextPhys;
+        if (next != INVALID && blocks[next].free) {
+            remove_free(next);
+            blocks[id].size += blocks[next].size;
+            unlink(next);
+        }
+        insert_free(id);
+    }
+    // Adds [capacity, newCapacity) to the free space, merged with a free block at the end
+    void grow(uint32_t newCapacity)
+    {
+        if (newCapacity <= capacitySize) {
+            return;
+        }
+        uint32_t extra = newCapacity - capacitySize;
+        if (lastBlock != INVALID && blocks[lastBlock].free) {
+            remove_free(lastBlock);
+            blocks[lastBlock].size += extra;
+            insert_free(lastBlock);
+        }
+        else {
+            uint32_t id = new_block();
+            blocks[id].offset = capacitySize;
+            blocks[id].size = extra;
+            blocks[id].prevPhys = lastBlock;
+            blocks[id].nextPhys = INVALID;
+            if (lastBlock != INVALID) {
+                blocks[lastBlock].nextPhys = id;
+            }
+            lastBlock = id;
+            insert_free(id);
+        }
+        capacitySize = newCapacity;
+    }
+
+    uint32_t capacity() const { return capacitySize; }
+    uint32_t used() const { return usedSize; }
+    // Largest range allocate can hand out right now
+    uint32_t largest_free() const
+    {
+        if (!flBitmap) {
+            return 0;
+        }
+        uint32_t fl = 31 - highest_bit_lz(flBitmap);
+        uint32_t sl = 31 - highest_bit_lz(slBitmap[fl]);
+        uint32_t largest = 0;
+        for (uint32_t id = freeHeads[fl][sl]; id != INVALID; id = blocks[id].nextFree) {
+            largest = std::max(largest, blocks[id].size);
+        }
+        return largest;
+    }
+
+private:
+    static const uint32_t SL_BITS = 3;
+    static const uint32_t SL_COUNT = 1 << SL_BITS;
+    static const uint32_t FL_COUNT = 32 - SL_BITS + 1;
+
+    struct Block {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t prevPhys, nextPhys;    // neighbours in address order
+        uint32_t prevFree, nextFree;    // neighbours in the free list of the block's bin
+        bool free;
+    };
+    std::vector<Block> blocks;
+    std::vector<uint32_t> unusedIds;
+    uint32_t freeHeads[FL_COUNT][SL_COUNT];
+    uint32_t flBitmap = 0;
+    uint32_t slBitmap[FL_COUNT] = {};
+    uint32_t lastBlock = INVALID;
+    uint32_t capacitySize = 0;
+    uint32_t usedSize = 0;
+
+    static uint32_t highest_bit_lz(uint32_t value)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse(&index, value);
+        return 31 - (uint32_t)index;
+#else
+        return (uint32_t)__builtin_clz(value);
+#endif
+    }
+    static uint32_t lowest_bit(uint32_t value)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, value);
+        return (uint32_t)index;
+#else
+        return (uint32_t)__builtin_ctz(value);
+#endif
+    }
+    // Bin of a free block: sizes below SL_COUNT are binned linearly in the first row
+    static void mapping(uint32_t size, uint32_t& fl, uint32_t& sl)
+    {
+        if (size < SL_COUNT) {
+            fl = 0;
+            sl = size;
+            return;
+        }
+        uint32_t msb = 31 - highest_bit_lz(size);
+        fl = msb - SL_BITS + 1;
+        sl = (size >> (msb - SL_BITS)) & (SL_COUNT - 1);
+    }
+    // First non empty bin whose blocks are all at least size long
+    bool find_free(uint32_t size, uint32_t& fl, uint32_t& sl) const
+    {
+        if (size >= SL_COUNT) {
+            uint32_t msb = 31 - highest_bit_lz(size);
+            size += (1u << (msb - SL_BITS)) - 1;
+        }
+        mapping(size, fl, sl);
+        uint32_t slMap = fl < FL_COUNT ? slBitmap[fl] & (~0u << sl) : 0;
+        if (!slMap) {
+            uint32_t flMap = fl + 1 < FL_COUNT ? flBitmap & (~0u << (fl + 1)) : 0;
+            if (!flMap) {
+                return false;
+            }
+            fl = lowest_bit(flMap);
+            slMap = slBitmap[fl];
+        }
+        sl = lowest_bit(slMap);
+        return true;
+    }
+    void insert_free(uint32_t id)
+    {
+        uint32_t fl, sl;
+        mapping(blocks[id].size, fl, sl);
+        blocks[id].free = true;
+        blocks[id].prevFree = INVALID;
+        blocks[id].nextFree = freeHeads[fl][sl];
+        if (freeHeads[fl][sl] != INVALID) {
+            blocks[freeHeads[fl][sl]].prevFree = id;
+        }
+        freeHeads[fl][sl] = id;
+        flBitmap |= 1u << fl;
+        slBitmap[fl] |= 1u << sl;
+    }
+    void remove_free(uint32_t id)
+    {
+        uint32_t fl, sl;
+        mapping(blocks[id].size, fl, sl);
+        Block& block = blocks[id];
+        if (block.prevFree != INVALID) {
+            blocks[block.prevFree].nextFree = block.nextFree;
+        }
+        else {
+            freeHeads[fl][sl] = block.nextFree;
+            if (freeHeads[fl][sl] == INVALID) {
+                slBitmap[fl] &= ~(1u << sl);
+                if (!slBitmap[fl]) {
+                    flBitmap &= ~(1u << fl);
+                }
+            }
+        }
+        if (block.nextFree != INVALID) {
+            blocks[block.nextFree].prevFree = block.prevFree;
+        }
+        block.free = false;
+    }
+    // Drops a block that has been merged into its previous neighbour
+    void unlink(uint32_t id)
+    {
+        uint32_t prev = blocks[id].prevPhys;
+        uint32_t next = blocks[id].nextPhys;
+        blocks[prev].nextPhys = next;
+        if (next != INVALID) {
+            blocks[next].prevPhys = prev;
+        }
+        else {
+            lastBlock = prev;
+        }
+        unusedIds.push_back(id);
+    }
+    uint32_t new_block()
+    {
+        if (!unusedIds.empty()) {
+            uint32_t id = unusedIds.back();
+            unusedIds.pop_back();
+            return id;
+        }
+        blocks.push_back(Block());
+        return (uint32_t)blocks.size() - 1;
+    }
+};
+
+// Vertices of one chunk to copy into the heap
+struct TerrainUpload {
+    uint32_t firstVertex;
+    const Vertex* data;
+    uint32_t count;
+};
+
+// Every chunk's vertices live in one device local vertex buffer, sub-allocated with TlsfAllocator.
+// The terrain is drawn with a single vkCmdBindVertexBuffers and a firstVertex per chunk instead of a
+// buffer (and a memory allocation) per chunk.
+// When the heap runs out it is replaced by a larger buffer and the live ranges are copied over; offsets
+// stay valid but the buffer handle changes, so command buffers recorded against it must be rebuilt.
+// Ranges are freed right away: callers that replace a mesh defer the free through their deletion queue.
+// Where the memory strategy places the heap in host visible memory (UMA, ReBAR) vertices are written in
+// place, otherwise they go through the upload manager's staging ring.
+// The heap never grows past the memory budget: allocate returns INVALID instead, and the caller makes
+// room by evicting meshes.
+class TerrainHeap
+{
+public:
+    void create(MemoryStrategy* memory, UploadManager* uploads, DeletionQueue* deletionQueue, uint32_t vertexCapacity)
+    {
+        this->memory = memory;
+        this->uploads = uploads;
+        this->deletionQueue = deletionQueue;
+        // Start smaller when the budget does not fit the request, the heap grows later if it can
+        vertexCapacity = std::max(vertexCapacity, (uint32_t)MIN_CAPACITY);
+        while (createBuffer(vertexCapacity, buffer) != VK_SUCCESS) {
+            if (vertexCapacity == MIN_CAPACITY) {
+                vks::tools::exitFatal("Could not allocate the terrain heap within the memory budget", VK_ERROR_OUT_OF_DEVICE_MEMORY);
+            }
+            vertexCapacity = std::max(vertexCapacity / 2, (uint32_t)MIN_CAPACITY);
+        }
+        allocator.grow(capacity());
+    }
+    void destroy()
+    {
+        memory->destroyBuffer(buffer);
+    }
+
+    // Reserves count vertices, growing the heap if needed. Returns the allocation to pass to free, or
+    // INVALID when the heap is full and growing it would exceed the memory budget.
+    uint32_t allocate(uint32_t count, uint32_t& firstVertex)
+    {
+        firstVertex = 0;
+        if (count == 0) {
+            return TlsfAllocator::INVALID;
+        }
+        uint32_t allocation = allocator.allocate(count, firstVertex);
+        if (allocation == TlsfAllocator::INVALID) {
+            // Ask for the doubling first, then for just enough
+            if (!grow(std::max(capacity() * 2, capacity() + count * 2)) && !grow(capacity() + count)) {
+                return TlsfAllocator::INVALID;
+            }
+            allocation = allocator.allocate(count, firstVertex);
+        }
+        return allocation;
+    }
+    void free(uint32_t allocation)
+    {
+        allocator.free(allocation);
+    }
+    // Writes a batch of chunk meshes into their ranges, in place or queued for the upload manager's next flush
+    void upload(const std::vector<TerrainUpload>& batch)
+    {
+        for (const TerrainUpload& upload : batch) {
+            if (upload.count && buffer.mapped) {
+                memcpy(static_cast<Vertex*>(buffer.mapped) + upload.firstVertex, upload.data, upload.count * sizeof(Vertex));
+            }
+            else if (upload.count) {
+                uploads->copy(buffer.buffer, (VkDeviceSize)upload.firstVertex * sizeof(Vertex), upload.data, upload.count * sizeof(Vertex));
+            }
+        }
+    }
+
+    VkBuffer vertexBuffer() const { return buffer.buffer; }
+    uint32_t capacity() const { return static_cast<uint32_t>(buffer.size / sizeof(Vertex)); }
+    uint32_t used() const { return allocator.used(); }
+    // Largest chunk mesh that fits without growing, well below capacity - used when the heap is fragmented
+    uint32_t largest_free() const { return allocator.largest_free(); }
+    // Vertices are copied straight into host visible memory, no staging
+    bool written_in_place() const { return buffer.mapped != nullptr; }
+    // Host mapping of the vertex storage when written in place, else nullptr
+    void* mapped_vertices() const { return buffer.mapped; }
+    // Bumped every time the buffer is replaced
+    uint32_t generation() const { return bufferGeneration; }
+
+private:
+    static const uint32_t MIN_CAPACITY = 1 << 16;
+    MemoryStrategy* memory = nullptr;
+    UploadManager* uploads = nullptr;
+    DeletionQueue* deletionQueue = nullptr;
+    vks::Buffer buffer;
+    TlsfAllocator allocator;
+    uint32_t bufferGeneration = 0;
+
+    // Written on the transfer queue and read on the graphics queue, so shared between both families when they differ
+    VkResult createBuffer(uint32_t vertexCapacity, vks::Buffer& target)
+    {
+        const uint32_t* families;
+        uint32_t familyCount = uploads->sharing_info(families);
+        VkResult result = memory->createBuffer(
+            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            MemoryUsage::GpuOnly,
+            MemoryCategory::Terrain,
+            &target,
+            (VkDeviceSize)vertexCapacity * sizeof(Vertex),
+            nullptr,
+            families,
+            familyCount);
+        if (result == VK_SUCCESS && (target.memoryPropertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+            VK_CHECK_RESULT(target.map());
+        }
+        return result;
+    }
+    // The old contents are copied on the transfer queue with the upload manager's next flush, behind the
+    // copies still queued for the old buffer, and the frame drawing from the new buffer waits for that flush
+    // like for any upload. A heap written in place has to hold its old contents before the next vertices
+    // are written into it, that case waits for the copy (on the transfer queue, the graphics queue keeps
+    // going). Frames in flight may still draw from the old buffer, it is destroyed once they have retired.
+    // False when the larger buffer does not fit the budget.
+    bool grow(uint32_t vertexCapacity)
+    {
+        vks::Buffer larger;
+        if (createBuffer(vertexCapacity, larger) != VK_SUCCESS) {
+            return false;
+        }
+        VkBufferCopy region = {};
+        region.size = buffer.size;
+        uploads->copy_buffer(buffer.buffer, larger.buffer, region);
+        if (larger.mapped) {
+            uploads->wait_idle();
+        }
+        vks::Buffer retired = buffer;
+        deletionQueue->push([this, retired]() mutable { memory->destroyBuffer(retired); });
+        buffer = larger;
+        allocator.grow(capacity());
+        bufferGeneration++;
+        return true;
+    }
+};
@@ -0,0 +1,267 @@
+#pragma once
+#include <vector>
+#include "vulkanexamplebase.h"
+#include "MemoryStrategy.h"
+
+// Host to device copies through one persistently mapped staging ring.
+// Copies are recorded into the open batch as they come and go out with a single submit per flush (once
+// per frame, or once for a whole load phase), on the dedicated transfer queue when the device has one.
+// Each submitted batch owns the ring bytes it wrote and gives them back when its fence has signalled, so
+// the host only ever blocks when the ring is full.
+// Readers of the copied data wait on acquire_wait_semaphore() in their next submit; buffers written
+// here must be created with the sharing mode from sharing_info when the transfer family is separate.
+// The semaphores are handed out round robin, one per frame the owner may have in flight, so a semaphore
+// is only signalled again once the frame that waited on it has retired.
+class UploadManager
+{
+public:
+    struct Stats {
+        uint64_t bytes = 0;         // copied since creation
+        uint32_t submits = 0;       // batches submitted since creation
+        uint32_t ringWaits = 0;     // times the host had to wait for ring space
+    };
+
+    void create(vks::VulkanDevice* device, MemoryStrategy* memory, VkDeviceSize ringSize, uint32_t framesInFlight)
+    {
+        this->device = device;
+        this->memory = memory;
+        queueFamilies[0] = device->queueFamilyIndices.graphics;
+        queueFamilies[1] = device->queueFamilyIndices.transfer;
+        vkGetDeviceQueue(device->logicalDevice, queueFamilies[1], 0, &transferQueue);
+
+        VkCommandPoolCreateInfo poolInfo = vks::initializers::commandPoolCreateInfo();
+        poolInfo.queueFamilyIndex = queueFamilies[1];
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        VK_CHECK_RESULT(vkCreateCommandPool(device->logicalDevice, &poolInfo, nullptr, &commandPool));
+        VkCommandBufferAllocateInfo allocateInfo = vks::initializers::commandBufferAllocateInfo(commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+        VkFenceCreateInfo fenceInfo = vks::initializers::fenceCreateInfo(0);
+        for (Batch& batch : batches) {
+            VK_CHECK_RESULT(vkAllocateCommandBuffers(device->logicalDevice, &allocateInfo, &batch.commandBuffer));
+            VK_CHECK_RESULT(vkCreateFence(device->logicalDevice, &fenceInfo, nullptr, &batch.fence));
+        }
+        VkSemaphoreCreateInfo semaphoreInfo = vks::initializers::semaphoreCreateInfo();
+        uploadComplete.resize(framesInFlight);
+        for (VkSemaphore& semaphore : uploadComplete) {
+            VK_CHECK_RESULT(vkCreateSemaphore(device->logicalDevice, &semaphoreInfo, nullptr, &semaphore));
+        }
+
+        VK_CHECK_RESULT(memory->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, MemoryUsage::Upload, MemoryCategory::Staging, &ring, ringSize));
+        VK_CHECK_RESULT(ring.map());
+    }
+    void destroy()
+    {
+        if (!device) {
+            return;
+        }
+        wait_idle();
+        for (Batch& batch : batches) {
+            vkDestroyFence(device->logicalDevice, batch.fence, nullptr);
+        }
+        for (VkSemaphore semaphore : uploadComplete) {
+            vkDestroySemaphore(device->logicalDevice, semaphore, nullptr);
+        }
+        vkDestroyCommandPool(device->logicalDevice, commandPool, nullptr);
+        ring.unmap();
+        memory->destroyBuffer(ring);
+        device = nullptr;
+    }
+
+    // Stages size bytes and queues their copy to dst at dstOffset; data can be reused on return
+    void copy(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        while (size) {
+            // Anything larger than the ring goes up in ring sized pieces
+            VkDeviceSize piece = std::min(size, ring.size);
+            VkDeviceSize ringOffset = reserve(piece);
+            memcpy(static_cast<char*>(ring.mapped) + ringOffset, bytes, piece);
+            Batch& batch = open_batch();
+            if (!batch.regions.empty() && batch.dst != dst) {
+                record_regions(batch);
+            }
+            batch.dst = dst;
+            batch.regions.push_back({ ringOffset, dstOffset, piece });
+            stats.bytes += piece;
+            bytes += piece;
+            dstOffset += piece;
+            size -= piece;
+        }
+    }
+    // Queues a device side copy between two buffers, ordered after every copy queued before it (e.g. the
+    // ones still landing in src) and before every copy queued after it
+    void copy_buffer(VkBuffer src, VkBuffer dst, const VkBufferCopy& region)
+    {
+        Batch& batch = open_batch();
+        record_regions(batch);
+        VkMemoryBarrier barrier = vks::initializers::memoryBarrier();
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        vkCmdCopyBuffer(batch.commandBuffer, src, dst, 1, &region);
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        stats.bytes += region.size;
+    }
+    // Submits the open batch, if any
+    void flush()
+    {
+        if (!recording) {
+            return;
+        }
+        Batch& batch = batches[(oldest + inFlight) % BATCH_COUNT];
+        record_regions(batch);
+        VK_CHECK_RESULT(vkEndCommandBuffer(batch.commandBuffer));
+        VkSubmitInfo submitInfo = vks::initializers::submitInfo();
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &batch.commandBuffer;
+        VK_CHECK_RESULT(vkQueueSubmit(transferQueue, 1, &submitInfo, batch.fence));
+        recording = false;
+        inFlight++;
+        unsignalled = true;
+        stats.submits++;
+    }
+    // Flushes and returns a semaphore covering every copy submitted so far, to be waited on once by the
+    // next submit reading the data; VK_NULL_HANDLE when nothing was uploaded since the last call. Called at
+    // most once per frame.
+    // A submit signals all the work before it on the same queue, so one empty submit covers every batch.
+    VkSemaphore acquire_wait_semaphore()
+    {
+        flush();
+        retire(false);
+        if (!unsignalled) {
+            return VK_NULL_HANDLE;
+        }
+        VkSemaphore semaphore = uploadComplete[nextSemaphore];
+        nextSemaphore = (nextSemaphore + 1) % static_cast<uint32_t>(uploadComplete.size());
+        VkSubmitInfo submitInfo = vks::initializers::submitInfo();
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &semaphore;
+        VK_CHECK_RESULT(vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE));
+        unsignalled = false;
+        return semaphore;
+    }
+    // Flushes and blocks until every copy has completed, e.g. before the destination buffer is replaced
+    void wait_idle()
+    {
+        flush();
+        while (inFlight) {
+            retire(true);
+        }
+    }
+
+    // Queue families that share buffers written by the manager, count is 1 when transfers run on the graphics family
+    uint32_t sharing_info(const uint32_t*& families) const
+    {
+        families = queueFamilies;
+        return dedicated_transfer_queue() ? 2 : 1;
+    }
+    bool dedicated_transfer_queue() const { return queueFamilies[1] != queueFamilies[0]; }
+    uint32_t transfer_family() const { return queueFamilies[1]; }
+    VkQueue transfer_queue() const { return transferQueue; }
+    const Stats& statistics() const { return stats; }
+
+private:
+    static const uint32_t BATCH_COUNT = 4;
+    static const VkDeviceSize RING_ALIGNMENT = 16;
+
+    struct Batch {
+        VkCommandBuffer commandBuffer;
+        VkFence fence;
+        VkBuffer dst = VK_NULL_HANDLE;
+        std::vector<VkBufferCopy> regions;  // pending regions to dst, recorded as one vkCmdCopyBuffer
+        VkDeviceSize ringBytes = 0;         // ring bytes written by the batch, including a skipped tail
+    };
+    vks::VulkanDevice* device = nullptr;
+    MemoryStrategy* memory = nullptr;
+    VkQueue transferQueue = VK_NULL_HANDLE;
+    uint32_t queueFamilies[2] = {};    // graphics, transfer
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    std::vector<VkSemaphore> uploadComplete;   // one per frame in flight
+    uint32_t nextSemaphore = 0;
+    vks::Buffer ring;
+    VkDeviceSize ringHead = 0;
+    VkDeviceSize ringUsed = 0;
+    // Batches form a FIFO: inFlight submitted ones starting at oldest, then the open one when recording
+    Batch batches[BATCH_COUNT];
+    uint32_t oldest = 0;
+    uint32_t inFlight = 0;
+    bool recording = false;
+    bool unsignalled = false;       // work submitted since a semaphore was last signalled
+    Stats stats;
+
+    Batch& open_batch()
+    {
+        if (!recording) {
+            if (inFlight == BATCH_COUNT) {
+                stats.ringWaits++;
+                retire(true);
+            }
+            Batch& batch = batches[(oldest + inFlight) % BATCH_COUNT];
+            VK_CHECK_RESULT(vkResetCommandBuffer(batch.commandBuffer, 0));
+            VkCommandBufferBeginInfo beginInfo = vks::initializers::commandBufferBeginInfo();
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            VK_CHECK_RESULT(vkBeginCommandBuffer(batch.commandBuffer, &beginInfo));
+            // Order the batch's writes after the ones of earlier batches, a range freed and handed out
+            // again may still be the target of a copy in flight
+            VkMemoryBarrier barrier = vks::initializers::memoryBarrier();
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+            batch.ringBytes = 0;
+            recording = true;
+        }
+        return batches[(oldest + inFlight) % BATCH_COUNT];
+    }
+    void record_regions(Batch& batch)
+    {
+        if (batch.regions.empty()) {
+            return;
+        }
+        vkCmdCopyBuffer(batch.commandBuffer, ring.buffer, batch.dst, static_cast<uint32_t>(batch.regions.size()), batch.regions.data());
+        batch.regions.clear();
+    }
+    // Gives the ring space of completed batches back, oldest first; blocking waits for at least one
+    void retire(bool blocking)
+    {
+        while (inFlight) {
+            Batch& batch = batches[oldest];
+            if (blocking) {
+                VK_CHECK_RESULT(vkWaitForFences(device->logicalDevice, 1, &batch.fence, VK_TRUE, UINT64_MAX));
+                blocking = false;
+            }
+            else if (vkGetFenceStatus(device->logicalDevice, batch.fence) != VK_SUCCESS) {
+                return;
+            }
+            VK_CHECK_RESULT(vkResetFences(device->logicalDevice, 1, &batch.fence));
+            ringUsed -= batch.ringBytes;
+            oldest = (oldest + 1) % BATCH_COUNT;
+            inFlight--;
+        }
+    }
+    // Ring offset of size contiguous free bytes, waiting for the GPU if the ring is full
+    VkDeviceSize reserve(VkDeviceSize size)
+    {
+        size = (size + RING_ALIGNMENT - 1) & ~(RING_ALIGNMENT - 1);
+        retire(false);
+        while (true) {
+            if (ringUsed == 0) {
+                ringHead = 0;
+            }
+            // A piece never wraps, the tail of the ring is skipped instead
+            VkDeviceSize skip = ringHead + size > ring.size ? ring.size - ringHead : 0;
+            if (ringUsed + skip + size <= ring.size) {
+                Batch& batch = open_batch();
+                batch.ringBytes += skip + size;
+                ringUsed += skip + size;
+                VkDeviceSize offset = skip ? 0 : ringHead;
+                ringHead = (offset + size) % ring.size;
+                return offset;
+            }
+            // The open batch holds ring space too, it has to go before it can be waited for
+            if (!inFlight) {
+                flush();
+            }
+            stats.ringWaits++;
+            retire(true);
+        }
+    }
+};
@@ -1,13 +1,19 @@
 #pragma once
 #include "vulkanexamplebase.h"
 #include "marchingCube.h"
+#include <cfloat>
 
 template <typename T>
 #define PLANET_DIMENSION 8
 #define CHUNK_DIMENSION 16
 #define WORLD_LIMIT (-PLANET_DIMENSION * CHUNK_DIMENSION) + 1
-#define CHUNK_RAIDUS (CHUNK_DIMENSION >> 1) * 1.414f // box's longest diagonal / 2
+#define CHUNK_RAIDUS ((CHUNK_DIMENSION >> 1) * 1.7320508f) // half the cube's space diagonal
 #define CHUNK_COUNT (PLANET_DIMENSION * PLANET_DIMENSION * PLANET_DIMENSION)
+// Triangles per meshlet: runs are cut at MESHLET_MAX_TRIANGLES, or after MESHLET_MIN_TRIANGLES at the first
+// triangle facing more than MESHLET_NORMAL_SPREAD (cosine) away from the run's average normal
+#define MESHLET_MIN_TRIANGLES 64
+#define MESHLET_MAX_TRIANGLES 128
+#define MESHLET_NORMAL_SPREAD 0.5f
 //#define MAX_TRI_COUNT_IN_A_CELL 4
 //#define MAX_VERTEX_COUNT_IN_A_CELL MAX_TRI_COUNT_IN_A_CELL*3
 
@@ -21,10 +27,19 @@ struct Vertex {
     glm::vec2 uv;
     glm::vec3 tangent;
 };
+// Run of consecutive triangles of a chunk mesh, culled as a unit (std430 layout of Meshlet in cull.comp)
+struct Meshlet {
+    glm::vec4 sphere;           // xyz: world space center, w: radius
+    glm::vec4 cone;             // xyz: average normal, w: sine of the widest angle to it, 1 when no side faces away from every view
+    uint32_t firstVertex;       // from the start of the chunk's vertices
+    uint32_t vertexCount;
+    uint32_t padding[2];
+};
 struct Vertices {
     int count;
-    VkBuffer buffer;
-    VkDeviceMemory memory;
+    uint32_t firstVertex;           // start of the chunk's range in the terrain heap
+    uint32_t allocation = ~0u;      // TerrainHeap allocation, ~0u while the chunk has no vertices
+    bool evicted = false;           // mesh dropped from the terrain heap to stay within the memory budget
     // Store the mapped address of the particle data for reuse
     //void* mappedMemory;
 };
@@ -34,8 +49,12 @@ struct Chunk {
     uint8_t voxel[CHUNK_DIMENSION * CHUNK_DIMENSION * CHUNK_DIMENSION]; 
     std::vector<MarchingCube::Cell> grid_of_cells_per_chunk;
     std::vector<MarchingCube::TRIANGLE> tri_list_per_chunk;
+    std::vector<uint8_t> tri_count_per_cell; // triangles each cell of grid_of_cells_per_chunk contributed, in grid order
     std::vector<Vertex> vertexBuffer_per_chunk;
     struct Vertices vertices_per_chunk;
+    std::vector<Meshlet> meshlets;              // vertexBuffer_per_chunk in runs of 64 to 128 triangles
+    glm::vec3 boundsMin = glm::vec3(FLT_MAX);     // world space extents of vertexBuffer_per_chunk, min > max without vertices
+    glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
 };
 namespace voxelNS
 {
@@ -43,8 +62,70 @@ namespace voxelNS
     int pos_to_chunkIndex(glm::vec3 pos);
     int pos_to_voxelIndex(glm::vec3 pos);
 
+    // Global grid coordinate >> CHUNK_SHIFT is the chunk coordinate
+    constexpr int Log2(int value) { return value > 1 ? 1 + Log2(value >> 1) : 0; }
+    constexpr int CHUNK_SHIFT = Log2(CHUNK_DIMENSION);
+    static_assert((1 << CHUNK_SHIFT) == CHUNK_DIMENSION, "CHUNK_DIMENSION must be a power of two");
+
     // small, commonly-used functions are better being inline function
     inline int return_voxelIndex(glm::vec3 vec) { return ((int)vec.z * CHUNK_DIMENSION * CHUNK_DIMENSION) + ((int)vec.y * CHUNK_DIMENSION) + (int)vec.x; }
+    inline void Mesh_Bounds(const std::vector<Vertex>& vertices, glm::vec3& min, glm::vec3& max) {
+        min = glm::vec3(FLT_MAX);
+        max = glm::vec3(-FLT_MAX);
+        for (const Vertex& vertex : vertices) {
+            min = glm::min(min, vertex.pos);
+            max = glm::max(max, vertex.pos);
+        }
+    }
+    // Splits a chunk mesh into meshlets in triangle order. The mesher emits triangles cell by cell, so a run
+    // of them covers a compact patch of the chunk. All three vertices of a triangle carry its face normal.
+    inline void Build_Meshlets(const std::vector<Vertex>& vertices, std::vector<Meshlet>& meshlets) {
+        meshlets.clear();
+        size_t triangleCount = vertices.size() / 3;
+        size_t first = 0;
+        while (first < triangleCount) {
+            glm::vec3 normalSum = glm::vec3(0.0f);
+            size_t end = first;
+            for (; end < triangleCount && end - first < MESHLET_MAX_TRIANGLES; end++) {
+                const glm::vec3& normal = vertices[end * 3].normal;
+                if (end - first >= MESHLET_MIN_TRIANGLES && glm::dot(normal, normalSum) < MESHLET_NORMAL_SPREAD * glm::length(normalSum)) {
+                    break;
+                }
+                normalSum += normal;
+            }
+            glm::vec3 min = glm::vec3(FLT_MAX);
+            glm::vec3 max = glm::vec3(-FLT_MAX);
+            for (size_t i = first * 3; i < end * 3; i++) {
+                min = glm::min(min, vertices[i].pos);
+                max = glm::max(max, vertices[i].pos);
+            }
+            Meshlet meshlet = {};
+            glm::vec3 center = (min + max) * 0.5f;
+            float radius = 0.0f;
+            for (size_t i = first * 3; i < end * 3; i++) {
+                radius = std::max(radius, glm::length(vertices[i].pos - center));
+            }
+            meshlet.sphere = glm::vec4(center, radius);
+            // The cone holds every normal; a half angle of 90 degrees or more (or a NaN normal of a
+            // degenerate triangle) leaves the meshlet to the frustum test alone
+            meshlet.cone = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            float length = glm::length(normalSum);
+            if (length > 0.0f) {
+                glm::vec3 axis = normalSum / length;
+                float minDot = 1.0f;
+                for (size_t i = first; i < end; i++) {
+                    minDot = std::min(minDot, glm::dot(axis, vertices[i * 3].normal));
+                }
+                if (minDot > 0.0f) {
+                    meshlet.cone = glm::vec4(axis, std::sqrt(1.0f - minDot * minDot));
+                }
+            }
+            meshlet.firstVertex = static_cast<uint32_t>(first * 3);
+            meshlet.vertexCount = static_cast<uint32_t>((end - first) * 3);
+            meshlets.push_back(meshlet);
+            first = end;
+        }
+    }
 
     int pos_to_chunkIndex(glm::vec3 pos) {
         // Boundnary check, the world starts from 0,0,0 and expands to -x, -y, -z
@@ -90,22 +171,6 @@ namespace voxelNS
         return glm::vec3(x,y,z);
     }
     
-    void Remove_Voxel(glm::vec3 target, Chunk** chunk, std::unordered_set<int>& damagedChunkIndices) {
-        std::vector<glm::vec3> voxel_pos_to_be_removed;
-        Sphere(target, 5.0f, voxel_pos_to_be_removed);
-        for (int i = 0; i < voxel_pos_to_be_removed.size(); i++) {
-            glm::vec3 voxelPos = voxel_pos_to_be_removed[i];
-            int chunk_index = pos_to_chunkIndex(voxelPos);
-            if (chunk_index < 0) { // out of bound
-            }
-            else {
-                damagedChunkIndices.insert(chunk_index);
-                Chunk* target_chunk = chunk[chunk_index];
-                int voxelIndex = pos_to_voxelIndex(voxelPos);
-                target_chunk->voxel[voxelIndex] = 0;
-            }
-        }
-    }
     void Fill_Chunk(Chunk* chunk)
     {
         // Assuming we initialized all elements to 0, we can ignore the padding
@@ -142,54 +207,4 @@ namespace voxelNS
             return false;
         }
     }
-    bool RayCast(glm::ivec3 start, glm::vec3 rd, Chunk** chunk, std::vector<glm::vec3>& particle_pos, glm::vec3* rayHitLocation) {
-        // DDA algorithm https://www.youtube.com/watch?v=NbSee-XM7WA
-        // It can only handle whole numbers
-        float step = 0;
-        float max_step = 200.0f;
-        glm::vec3 initial_ro = start;
-        glm::vec3 curr_ro = initial_ro;
-        unsigned int step_count = 0;
-        while (step < max_step) {
-            // Where I would end up if I take a step
-            glm::vec3 stepX = curr_ro + rd / abs(rd.x);
-            glm::vec3 stepY = curr_ro + rd / abs(rd.y);
-            glm::vec3 stepZ = curr_ro + rd / abs(rd.z);
-            // Walk along the axis of the step that is shortest in distance from the initial ray origin
-            float distX = glm::distance(initial_ro, stepX);
-            float distY = glm::distance(initial_ro, stepY);
-            float distZ = glm::distance(initial_ro, stepZ);
-            if (distX > distY) {
-                step = distY;
-            }
-            else {
-                step = distX;
-            }
-            if (step > distZ) {
-                step = distZ;
-            }
-            glm::vec3 rayLocation = initial_ro + step * rd;
-            int chunk_index = pos_to_chunkIndex(rayLocation);
-            if (chunk_index < 0) { // out of bound
-                return false;
-            }
-            // place a particle in the ray's path
-            //if (step_count < particle_pos.size() / 2) {
-            //    particle_pos[step_count] = rayLocation;
-            //}
-            //step_count++;
-
-            Chunk* target_chunk = chunk[chunk_index];
-            int voxelIndex = pos_to_voxelIndex(rayLocation);
-            if (target_chunk->voxel[voxelIndex] & 1) {
-                // found a present voxel
-                *rayHitLocation = rayLocation;
-                return true;
-            }
-            else {
-                curr_ro = rayLocation;
-            }
-        }
-        return false;
-    }
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+// Fixed set of worker threads pulling jobs from a shared queue.
+// Jobs must not touch Vulkan objects owned by the render thread, they hand their results back instead.
+// The exception is parallel_for, whose caller waits for every task and so can hand them its objects.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(uint32_t threadCount)
+    {
+        for (uint32_t i = 0; i < threadCount; i++) {
+            threads.emplace_back(&WorkerPool::run, this);
+        }
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            stopping = true;
+        }
+        queueCondition.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    void push(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            jobs.push_back(std::move(job));
+        }
+        queueCondition.notify_one();
+    }
+    // Runs task(0) .. task(count - 1) on the workers and the calling thread, and returns once all of them
+    // are done. The tasks go ahead of the queued jobs and the caller runs every task no worker has taken
+    // yet, so a pool busy with long jobs costs parallelism but never blocks the caller.
+    void parallel_for(uint32_t count, const std::function<void(uint32_t)>& task)
+    {
+        // Helpers can start after this call returned, they find every task taken and only touch the batch
+        struct Batch {
+            std::atomic<uint32_t> next{ 0 };
+            uint32_t done = 0;
+            std::mutex lock;
+            std::condition_variable finished;
+        };
+        std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+        const std::function<void(uint32_t)>* work = &task;
+        auto help = [batch, count, work]() {
+            for (;;) {
+                uint32_t index = batch->next.fetch_add(1);
+                if (index >= count) {
+                    return;
+                }
+                (*work)(index);
+                std::lock_guard<std::mutex> guard(batch->lock);
+                if (++batch->done == count) {
+                    batch->finished.notify_all();
+                }
+            }
+        };
+        uint32_t helpers = count > 1 ? std::min(threadCount(), count - 1) : 0;
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            for (uint32_t i = 0; i < helpers; i++) {
+                jobs.push_front(help);
+            }
+        }
+        queueCondition.notify_all();
+        help();
+        std::unique_lock<std::mutex> guard(batch->lock);
+        batch->finished.wait(guard, [&] { return batch->done == count; });
+    }
+    uint32_t threadCount() const { return static_cast<uint32_t>(threads.size()); }
+
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex queueLock;
+    std::condition_variable queueCondition;
+    bool stopping = false;
+
+    void run()
+    {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(queueLock);
+                queueCondition.wait(lock, [this] { return stopping || !jobs.empty(); });
+                // Queued jobs are drained before shutting down
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
@@ -143,6 +143,8 @@ void VulkanExampleBase::renderFrame()
 	submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
 	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 	VulkanExampleBase::submitFrame();
+	// The default path keeps one frame in flight
+	VK_CHECK_RESULT(vkQueueWaitIdle(queue));
 }
 
 std::string VulkanExampleBase::getWindowTitle()
@@ -282,9 +284,7 @@ void VulkanExampleBase::nextFrame()
 		lastTimestamp = tEnd;
 	}
 	tPrevEnd = tEnd;
-	
-	// TODO: Cap UI overlay update rates
-	updateOverlay();
+	// The example updates the UI overlay from render(), once no frame in flight draws its buffers
 }
 
 void VulkanExampleBase::renderLoop()
@@ -391,9 +391,14 @@ void VulkanExampleBase::drawUI(const VkCommandBuffer commandBuffer)
 }
 
 void VulkanExampleBase::prepareFrame()
+{
+	prepareFrame(semaphores.presentComplete);
+}
+
+void VulkanExampleBase::prepareFrame(VkSemaphore presentCompleteSemaphore)
 {
 	// Acquire the next image from the swap chain
-	VkResult result = swapChain.acquireNextImage(semaphores.presentComplete, &currentBuffer);
+	VkResult result = swapChain.acquireNextImage(presentCompleteSemaphore, &currentBuffer);
 	// Recreate the swapchain if it's no longer compatible with the surface (OUT_OF_DATE)
 	// SRS - If no longer optimal (VK_SUBOPTIMAL_KHR), wait until submitFrame() in case number of swapchain images will change on resize
 	if ((result == VK_ERROR_OUT_OF_DATE_KHR) || (result == VK_SUBOPTIMAL_KHR)) {
@@ -409,7 +414,12 @@ void VulkanExampleBase::prepareFrame()
 
 void VulkanExampleBase::submitFrame()
 {
-	VkResult result = swapChain.queuePresent(queue, currentBuffer, semaphores.renderComplete);
+	submitFrame(semaphores.renderComplete);
+}
+
+void VulkanExampleBase::submitFrame(VkSemaphore renderCompleteSemaphore)
+{
+	VkResult result = swapChain.queuePresent(queue, currentBuffer, renderCompleteSemaphore);
 	// Recreate the swapchain if it's no longer compatible with the surface (OUT_OF_DATE) or no longer optimal for presentation (SUBOPTIMAL)
 	if ((result == VK_ERROR_OUT_OF_DATE_KHR) || (result == VK_SUBOPTIMAL_KHR)) {
 		windowResize();
@@ -420,7 +430,6 @@ void VulkanExampleBase::submitFrame()
 	else {
 		VK_CHECK_RESULT(result);
 	}
-	VK_CHECK_RESULT(vkQueueWaitIdle(queue));
 }
 
 VulkanExampleBase::VulkanExampleBase()
@@ -461,6 +470,8 @@ VulkanExampleBase::VulkanExampleBase()
 	commandLineParser.add("benchmarkresultfile", { "-bf", "--benchfilename" }, 1, "Set file name for benchmark results");
 	commandLineParser.add("benchmarkresultframes", { "-bt", "--benchframetimes" }, 0, "Save frame times to benchmark results file");
 	commandLineParser.add("benchmarkframes", { "-bfs", "--benchmarkframes" }, 1, "Only render the given number of frames");
+	commandLineParser.add("memorystats", { "-ms", "--memorystats" }, 1, "Write GPU memory usage to the given CSV file once per second");
+	commandLineParser.add("cullstats", { "-cs", "--cullstats" }, 1, "Fly a fixed camera path and write culled chunk counts to the given CSV file every frame");
 
 	commandLineParser.parse(args);
 	if (commandLineParser.isSet("help")) {
@@ -708,7 +719,8 @@ bool VulkanExampleBase::initVulkan()
 	// Derived examples can enable extensions based on the list of supported extensions read from the physical device
 	getEnabledExtensions();
 
-	VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain);
+	// Also ask for a dedicated transfer queue, used for uploads when the device has one
+	VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain, true, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT);
 	if (res != VK_SUCCESS) {
 		vks::tools::exitFatal("Could not create Vulkan device: \n" + vks::tools::errorString(res), res);
 		return false;
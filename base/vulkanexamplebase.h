@@ -83,7 +83,6 @@ private:
 	bool resizing = false;
 	void handleMouseMove(int32_t x, int32_t y);
 	void nextFrame();
-	void updateOverlay();
 	void createPipelineCache();
 	void createCommandPool();
 	void createSynchronizationPrimitives();
@@ -283,8 +282,14 @@ public:
 
 	/** Prepare the next frame for workload submission by acquiring the next swap chain image */
 	void prepareFrame();
+	/** @brief Acquires the next swap chain image, signalling presentCompleteSemaphore once it can be rendered to */
+	void prepareFrame(VkSemaphore presentCompleteSemaphore);
 	/** @brief Presents the current image to the swap chain */
 	void submitFrame();
+	/** @brief Presents the current image once renderCompleteSemaphore has been signalled */
+	void submitFrame(VkSemaphore renderCompleteSemaphore);
+	/** @brief Builds the ImGui overlay and updates its buffers, which no submitted frame may still be drawing */
+	void updateOverlay();
 	/** @brief (Virtual) Default image acquire + submission and command buffer submission function */
 	virtual void renderFrame();
 
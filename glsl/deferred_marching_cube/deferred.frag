@@ -1,13 +1,17 @@
 #version 450
 
-layout (binding = 1) uniform sampler2D samplerposition;
-layout (binding = 2) uniform sampler2D samplerNormal;
+layout (binding = 1) uniform sampler2D samplerDepth;
+layout (binding = 2) uniform sampler2D samplerNormal; // octahedral
 layout (binding = 3) uniform sampler2D samplerAlbedo;
 
 layout (location = 0) in vec2 inUV;
 
 layout (location = 0) out vec4 outFragcolor;
 
+// Must match LIGHT_TILE_SIZE and MAX_LIGHTS_PER_TILE in main.cpp and lightcull.comp
+#define LIGHT_TILE_SIZE 16
+#define MAX_LIGHTS_PER_TILE 255
+
 struct Light {
 	vec4 position;
 	vec3 color;
@@ -16,16 +20,50 @@ struct Light {
 
 layout (binding = 4) uniform UBO 
 {
-	Light lights[34];
+	mat4 inverseViewProjection; // camera the G-buffer was drawn with
 	vec4 viewPos; // camera position
 	int debugDisplayTarget;
+	int lightingMode; // 0: tiled, 1: light volumes drawn into samplerLighting
 } ubo;
 
+// Binding 5: Every light
+layout (binding = 5, std430) readonly buffer Lights
+{
+	Light lights[ ];
+};
+
+// Binding 6: Lights per screen tile, written by lightcull.comp: the count, then the light indices
+layout (binding = 6, std430) readonly buffer TileLights
+{
+	uint tileLights[ ];
+};
+
+// Binding 7: Sum of the light volumes
+layout (binding = 7) uniform sampler2D samplerLighting;
+
+// Inverse of octahedralEncode in triangle.frag
+vec3 octahedralDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+// World space position of a G-buffer pixel from its depth
+vec3 worldPosition(vec2 uv, float depth)
+{
+	vec4 position = ubo.inverseViewProjection * vec4(uv * 2.0 - 1.0, depth, 1.0);
+	return position.xyz / position.w;
+}
+
 void main() 
 {
 	// Get G-Buffer values
-	vec3 fragPos = texture(samplerposition, inUV).rgb;
-	vec3 normal = texture(samplerNormal, inUV).rgb;
+	float depth = texture(samplerDepth, inUV).r;
+	vec3 fragPos = worldPosition(inUV, depth);
+	vec3 normal = octahedralDecode(texture(samplerNormal, inUV).rg);
 	vec4 albedo = texture(samplerAlbedo, inUV);
 
 	// Debug display
@@ -50,17 +88,35 @@ void main()
 
 	// Render-target composition
 
-	#define lightCount 34
 	#define MAX_LIGHT_INTENSITY 1.0
 	#define ambient 0.2
 	
 	// Ambient part
 	vec3 fragcolor  = albedo.rgb * ambient;
 
-	for(int i = 0; i < lightCount; ++i)
+	// Sky, no geometry to light
+	if (depth == 1.0)
+	{
+		outFragcolor = vec4(fragcolor, 1.0);
+		return;
+	}
+
+	if (ubo.lightingMode == 1)
+	{
+		outFragcolor = vec4(fragcolor + texture(samplerLighting, inUV).rgb, 1.0);
+		return;
+	}
+
+	// Only the lights touching this pixel's tile
+	ivec2 size = textureSize(samplerAlbedo, 0);
+	ivec2 tile = ivec2(inUV * vec2(size)) / LIGHT_TILE_SIZE;
+	uint tileStart = (tile.y * ((size.x + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE) + tile.x) * (MAX_LIGHTS_PER_TILE + 1);
+	uint lightCount = tileLights[tileStart];
+	for(uint tileLight = 0; tileLight < lightCount; ++tileLight)
 	{
+		Light light = lights[tileLights[tileStart + 1 + tileLight]];
 		// Vector to light
-		vec3 L = ubo.lights[i].position.xyz - fragPos;
+		vec3 L = light.position.xyz - fragPos;
 		// Distance from light to fragment position
 		float dist = length(L);
 //
@@ -68,24 +124,24 @@ void main()
 		vec3 V = ubo.viewPos.xyz - fragPos;
 		V = normalize(V);
 		
-		if(dist < ubo.lights[i].radius)
+		if(dist < light.radius)
 		{
 			// Light to fragment
 			L = normalize(L);
 //
 			// Attenuation
-			float atten = min(MAX_LIGHT_INTENSITY, ubo.lights[i].radius / (pow(dist, 2.0) + 1.0));
+			float atten = min(MAX_LIGHT_INTENSITY, light.radius / (pow(dist, 2.0) + 1.0));
 //			
 			// Diffuse part
 			vec3 N = normalize(normal);
 			float NdotL = max(0.0, dot(N, L));
-			vec3 diff = ubo.lights[i].color * albedo.rgb * NdotL * atten;
+			vec3 diff = light.color * albedo.rgb * NdotL * atten;
 //
 			// Specular part
 			// Specular map values are stored in alpha of albedo mrt
 			vec3 R = reflect(-L, N);
 			float NdotR = max(0.0, dot(R, V));
-			vec3 spec = ubo.lights[i].color * albedo.a * pow(NdotR, 16.0) * atten;
+			vec3 spec = light.color * albedo.a * pow(NdotR, 16.0) * atten;
 //
 			fragcolor += diff + spec;	
 		}	
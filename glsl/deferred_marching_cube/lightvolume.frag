@@ -0,0 +1,79 @@
+#version 450
+
+layout (binding = 1) uniform sampler2D samplerDepth;
+layout (binding = 2) uniform sampler2D samplerNormal; // octahedral
+layout (binding = 3) uniform sampler2D samplerAlbedo;
+
+layout (location = 0) flat in uint inLight;
+
+layout (location = 0) out vec4 outFragcolor;
+
+struct Light {
+	vec4 position;
+	vec3 color;
+	float radius;
+};
+
+layout (binding = 4) uniform UBO 
+{
+	mat4 inverseViewProjection; // camera the G-buffer was drawn with
+	vec4 viewPos; // camera position
+	int debugDisplayTarget;
+	int lightingMode;
+} ubo;
+
+// Binding 5: Every light
+layout (binding = 5, std430) readonly buffer Lights
+{
+	Light lights[ ];
+};
+
+// Inverse of octahedralEncode in triangle.frag
+vec3 octahedralDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+// World space position of a G-buffer pixel from its depth
+vec3 worldPosition(vec2 uv, float depth)
+{
+	vec4 position = ubo.inverseViewProjection * vec4(uv * 2.0 - 1.0, depth, 1.0);
+	return position.xyz / position.w;
+}
+
+// One light's share of a pixel, added to the lighting target. Same shading as deferred.frag.
+void main() 
+{
+	#define MAX_LIGHT_INTENSITY 1.0
+
+	// The target is the G-buffer's size
+	ivec2 pos = ivec2(gl_FragCoord.xy);
+	vec3 fragPos = worldPosition(gl_FragCoord.xy / vec2(textureSize(samplerDepth, 0)), texelFetch(samplerDepth, pos, 0).r);
+	vec3 normal = octahedralDecode(texelFetch(samplerNormal, pos, 0).rg);
+	vec4 albedo = texelFetch(samplerAlbedo, pos, 0);
+
+	Light light = lights[inLight];
+	vec3 L = light.position.xyz - fragPos;
+	float dist = length(L);
+	// The sphere only bounds the light on screen, pixels in front of it or beside it get nothing
+	if (dist >= light.radius)
+	{
+		outFragcolor = vec4(0.0);
+		return;
+	}
+	vec3 V = normalize(ubo.viewPos.xyz - fragPos);
+	L = normalize(L);
+	float atten = min(MAX_LIGHT_INTENSITY, light.radius / (pow(dist, 2.0) + 1.0));
+	vec3 N = normalize(normal);
+	float NdotL = max(0.0, dot(N, L));
+	vec3 diff = light.color * albedo.rgb * NdotL * atten;
+	// Specular map values are stored in alpha of albedo mrt
+	vec3 R = reflect(-L, N);
+	float NdotR = max(0.0, dot(R, V));
+	vec3 spec = light.color * albedo.a * pow(NdotR, 16.0) * atten;
+	outFragcolor = vec4(diff + spec, 0.0);
+}
@@ -0,0 +1,32 @@
+#version 450
+
+layout (location = 0) in vec3 inPos;
+
+layout (binding = 0) uniform UBO 
+{
+	mat4 projection;
+	mat4 modelview;
+} ubo;
+
+// Same layout as Light in main.cpp
+struct Light {
+	vec4 position;
+	vec3 color;
+	float radius;
+};
+
+// Binding 5: Every light, one instance each
+layout (binding = 5, std430) readonly buffer Lights
+{
+	Light lights[ ];
+};
+
+layout (location = 0) flat out uint outLight;
+
+void main() 
+{
+	// The unit sphere scaled to the light's radius
+	Light light = lights[gl_InstanceIndex];
+	outLight = gl_InstanceIndex;
+	gl_Position = ubo.projection * ubo.modelview * vec4(light.position.xyz + inPos * light.radius, 1.0);
+}
@@ -7,9 +7,8 @@ layout (location = 1) in float inAlpha;
 layout (location = 2) in float inRotation;
 
 //layout (location = 0) out vec4 outFragColor;
-layout (location = 0) out vec4 outPosition;
-layout (location = 1) out vec4 outNormal;
-layout (location = 2) out vec4 outAlbedo;
+layout (location = 0) out vec2 outNormal;
+layout (location = 1) out vec4 outAlbedo;
 void main () 
 {
 	vec4 color;
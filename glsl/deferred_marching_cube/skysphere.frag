@@ -3,9 +3,8 @@
 layout (location = 0) in vec2 inUV;
 
 //layout (location = 0) out vec4 outFragColor;
-layout (location = 0) out vec4 outPosition;
-layout (location = 1) out vec4 outNormal;
-layout (location = 2) out vec4 outAlbedo;
+layout (location = 0) out vec2 outNormal;
+layout (location = 1) out vec4 outAlbedo;
 
 void main() 
 {
@@ -9,23 +9,34 @@ layout (binding = 1) uniform sampler2D samplerColor;
 layout (binding = 2) uniform sampler2D samplerNormalMap;
 
 //layout (location = 0) out vec4 outFragColor;
-layout (location = 0) out vec4 outPosition;
-layout (location = 1) out vec4 outNormal;
-layout (location = 2) out vec4 outAlbedo;
+// The position is not stored, the composition reconstructs it from the depth
+layout (location = 0) out vec2 outNormal;
+layout (location = 1) out vec4 outAlbedo;
 
-void main() 
+// Unit vector to the octahedron unfolded onto [-1, 1]^2, the lower half folded over the diagonals.
+// Same as octahedralDecode in deferred.frag and lightvolume.frag.
+vec2 octahedralEncode(vec3 n)
 {
-	outPosition = vec4(inWorldPos, 1.0);
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	if (n.z < 0.0)
+	{
+		return (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return n.xy;
+}
 
+void main() 
+{
 	// Calculate normal in tangent space
 	vec3 N = normalize(inNormal);
 	vec3 T = normalize(inTangent);
 	vec3 B = cross(N, T);
 	mat3 TBN = mat3(T, B, N);
 	vec3 tnorm = TBN * normalize(texture(samplerNormalMap, inUV).xyz * 2.0 - vec3(1.0));
-	outNormal = vec4(tnorm*2.0, 1.0);
+	outNormal = octahedralEncode(normalize(tnorm));
 	//outNormal = vec4(inNormal, 1.0);
 	
+	// Specular map value in alpha
 	vec4 albedo = texture(samplerColor, inUV);
 	outAlbedo = albedo;
 	//outAlbedo = vec4(0.04, 0.07, 0.08, 1.0);
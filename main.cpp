@@ -9,10 +9,28 @@
 #include "frustum.hpp"
 #include "marchingCube.h"
 #include "Voxel.h"
+#include "Brush.h"
+#include "WorkerPool.h"
+#include "DirtyChunks.h"
+#include "Occupancy.h"
+#include "Raycast.h"
+#include "RayBatch.h"
+#include "Collision.h"
+#include "MemoryStrategy.h"
+#include "UploadManager.h"
+#include "TerrainHeap.h"
+#include "DeletionQueue.h"
+#include "ParallelUpload.h"
+#include "MeshCache.h"
+#include "RegionRecorder.h"
+#include "FrustumCuller.h"
+#include "OcclusionRasterizer.h"
 #include "Octree.h"
 #include <queue>
+#include <deque>
 #include <thread>
 #include <mutex> 
+#include <fstream>
 
 #define PARTICLE_SIZE 10.0f
 #define FLAME_RADIUS 2.0f
@@ -21,6 +39,32 @@
 #define SHADOWMAP_DIM 2048
 // deferred framebuffer size
 #define FB_DIM 2048
+// staging ring of the upload manager
+#define UPLOAD_RING_SIZE (32 * 1024 * 1024)
+// frames the CPU may record ahead of the GPU, resources replaced in a frame are kept this long
+#define FRAMES_IN_FLIGHT 2
+// Chunk meshes of the last run, bump MESHER_VERSION whenever the mesher's output changes
+#define MESH_CACHE_FILE "chunk_meshes.cache"
+#define MESHER_VERSION 1
+#define CHUNK_CELL_COUNT ((CHUNK_DIMENSION - 1) * (CHUNK_DIMENSION - 1) * (CHUNK_DIMENSION - 1))
+// Evicted chunks brought back per frame at most
+#define RESIDENCY_UPLOADS_PER_FRAME 8
+// Must match local_size_x in cull.comp
+#define CULL_WORKGROUP_SIZE 64
+// Enough for a 2^15 texel square G-buffer
+#define DEPTH_PYRAMID_MAX_LEVELS 16
+// Terrain draws are recorded per region of REGION_DIMENSION^3 chunks, each region owns a slice of the
+// indirect commands and its own draw count. PLANET_DIMENSION must be a multiple of REGION_DIMENSION.
+#define REGION_DIMENSION 4
+#define REGIONS_PER_AXIS (PLANET_DIMENSION / REGION_DIMENSION)
+#define REGION_COUNT (REGIONS_PER_AXIS * REGIONS_PER_AXIS * REGIONS_PER_AXIS)
+#define REGION_CHUNK_COUNT (REGION_DIMENSION * REGION_DIMENSION * REGION_DIMENSION)
+// CPU occlusion buffer, a multiple of the rasterizer's 8x4 tiles
+#define OCCLUSION_BUFFER_WIDTH 256
+#define OCCLUSION_BUFFER_HEIGHT 144
+// Deferred lights are binned per screen tile of the G-buffer by lightcull.comp, must match the shaders
+#define LIGHT_TILE_SIZE 16
+#define MAX_LIGHTS_PER_TILE 255
 
 class VulkanExample : public VulkanExampleBase
 {
@@ -29,11 +73,9 @@ public:
 	int max_emitters_count = 32;
 	// Max. number of concurrent threads
 	uint32_t numThreads;
-	std::mutex mutex_lock;
 	int32_t debugDisplayTarget = 0;
 	// Custom
 	// 16x16x16 voxels
-	unsigned int cmdBufferBuildCount = 0;
 	//struct Vertices vertices;
 	struct Indices {
 		int count;
@@ -49,6 +91,67 @@ public:
 	unsigned int total_terrain_triangle_count;
 	
 	Chunk* chunkListBuffer[CHUNK_COUNT];
+	// Asynchronous remeshing
+	struct MeshJob {
+		voxelNS::DirtyRegion region;
+		uint32_t generation;	// dirtyChunks generation of the snapshot
+		uint8_t voxel[CHUNK_DIMENSION * CHUNK_DIMENSION * CHUNK_DIMENSION]; // snapshot, the render thread keeps editing the chunk
+		uint64_t brick4Any, brick4Full; // occupancy of the snapshot
+		std::vector<MarchingCube::Cell> grid;
+		std::vector<MarchingCube::TRIANGLE> tri_list;
+		std::vector<uint8_t> tri_count;
+		std::vector<Vertex> vertexBuffer;
+		std::vector<Meshlet> meshlets;
+		glm::vec3 boundsMin, boundsMax;
+	};
+	std::unique_ptr<WorkerPool> workerPool;
+	std::mutex finishedMeshJobsLock;
+	std::vector<std::shared_ptr<MeshJob>> finishedMeshJobs;
+	voxelNS::DirtyChunkSet dirtyChunks;
+	voxelNS::ChunkBitset meshJobsInFlight;
+	voxelNS::OccupancyPyramid occupancy; // empty space summaries for the raycast and the mesher
+	MemoryStrategy memoryStrategy; // memory type and heap budget of every buffer
+	UploadManager uploadManager; // staging ring, every host to device copy of a frame goes out in one submit
+	TerrainHeap terrainHeap; // vertices of every chunk, drawn from one bound vertex buffer
+	DeletionQueue deletionQueue; // replaced meshes and buffers, released once no frame in flight uses them
+	VkFence frameFences[FRAMES_IN_FLIGHT] = {}; // signalled when the frame using the slot has finished on the GPU
+	uint64_t frameNumber = 1;
+	MeshCache meshCache; // mapped at startup only
+	uint64_t chunkVoxelHash[CHUNK_COUNT] = {}; // MeshCache key of the chunk's startup voxels
+	unsigned int cachedStartupChunks = 0; // startup meshes read from the cache instead of meshed
+	// GPU memory budget
+	bool memoryProperties2Supported = false; // instance side of VK_EXT_memory_budget
+	bool memoryBudgetSupported = false;
+	uint32_t evictedChunkCount = 0; // chunks whose mesh was dropped to stay within budget
+	uint32_t pendingEvictedVertices = 0; // evicted ranges not back in the heap yet, frames in flight still draw them
+	glm::vec3 residencyBlockedAt = glm::vec3(NAN); // camera position at which nothing more could be evicted
+	std::ofstream memoryStatsFile; // --memorystats, one CSV row per second
+	std::chrono::steady_clock::time_point lastMemoryStatsTime;
+	// Minimum time between two shots
+	uint32_t fireInterval = 150;
+	// Rays per shot, more than one fires a spread of shotSpread radians around the view direction
+	int32_t shotPellets = 1;
+	float shotSpread = 0.1f;
+	// A shot is ray cast and carved on the worker pool. Its brushes write into copies of the chunks they
+	// cover and it updates its own copy of the occupancy pyramid, publishFinishedShot copies both back on
+	// the render thread. Only one shot is in flight, so the live voxels and pyramid it reads hold still.
+	struct ShotJob {
+		std::vector<glm::vec3> origins, directions;
+		voxelNS::RayBatchResult hits;
+		Chunk* target[CHUNK_COUNT];	// the live chunk, or its copy in edited when a brush covers it
+		std::vector<std::unique_ptr<Chunk>> edited;
+		std::vector<voxelNS::DirtyRegion> dirtyRegions;
+		voxelNS::OccupancyPyramid occupancy;
+		bool hit = false;
+		glm::vec3 hitLocation;
+	};
+	bool shotInFlight = false;
+	std::mutex finishedShotLock;
+	std::shared_ptr<ShotJob> finishedShot;
+	// Camera collision
+	bool cameraCollision = true;
+	float cameraHalfExtent = 1.25f;
+	glm::vec3 lastCameraPosition;
 	// Custom end
 	struct {
 		// particle system
@@ -67,26 +170,115 @@ public:
 		vkglTF::Model skysphere;
 	} models;
 
-	// Per-instance data block
+	// Per-instance data block, one per chunk (std430 layout of InstanceData in cull.comp)
 	struct InstanceData {
-		glm::vec3 pos;
-		float vertexCount;
+		glm::vec4 boundingSphere;	// xyz: world space center, w: radius
+		glm::vec4 boundsMin;		// xyz: world space box of the mesh, for the occlusion test
+		glm::vec4 boundsMax;
+		uint32_t vertexCount;
+		uint32_t firstVertex;
+		uint32_t region;			// terrain region, picks the slice and count the draw goes to
+		uint32_t occluded;			// 1 when the CPU occlusion culler found the chunk hidden this frame
+		uint32_t firstMeshlet;		// the chunk's meshlets in the frame slot's meshletBuffer
+		uint32_t meshletCount;
+		uint32_t padding[2];
 	};
 
-	// Contains the instanced data
-	vks::Buffer instanceBuffer;
-	// Contains the indirect drawing commands
-	vks::Buffer indirectCommandsBuffer;
-	vks::Buffer indirectDrawCountBuffer;
-	uint32_t indirectDrawCount{ 0 };
+	// Input and output of the culling pass of one frame in flight. The host writes a slot's buffers only
+	// once the frame that used the slot last has finished, and reads that frame's counts back then.
+	struct CullFrame {
+		// Contains the instanced data, culled by cull.comp every frame
+		vks::Buffer instanceBuffer;
+		// Every chunk's meshlets, culled one by one by cull.comp once their chunk is visible
+		vks::Buffer meshletBuffer;
+		uint32_t meshletCapacity = 0;
+		// Contains the indirect drawing commands written by cull.comp, per culling phase regionSlotCount per
+		// region with the region's visible meshlets first
+		vks::Buffer indirectCommandsBuffer;
+		uint32_t commandSlotCount = 0;				// regionSlotCount the commands buffer was sized for
+		// Number of commands cull.comp wrote per phase and region, read by vkCmdDrawIndirectCount and for the
+		// statistics, followed by the number of chunks in the frustum, of chunks drawn and of meshlets culled
+		// by the frustum and by their normal cone
+		vks::Buffer indirectDrawCountBuffer;
+		// Chunk and group levels of the occupancy pyramid, cull.comp skips chunks without a solid voxel
+		vks::Buffer occupancyBuffer;
+		VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+		uint32_t indirectDataVersion = UINT32_MAX;	// indirectDataVersion the instances and meshlets were written for
+		uint64_t frame = 0;							// frame that used the slot last, 0 before the first
+		uint32_t cpuOccluded = 0;					// CPU occlusion culling of that frame, for --cullstats
+		float cpuOcclusionMilliseconds = 0.0f;
+	};
+	CullFrame cullFrames[FRAMES_IN_FLIGHT];
+	// Draw slots per region and phase, a power of two at least the meshlet count of every region
+	uint32_t regionSlotCount = REGION_CHUNK_COUNT;
+	// Meshlets of every chunk with a mesh
+	uint32_t meshletCount = 0;
+	// Per chunk, whether the first culling phase drew it. Only read by the same frame's second phase, so
+	// every frame in flight shares it.
+	vks::Buffer cullVisibilityBuffer;
+	// Same layout as the Occupancy buffer of cull.comp
+	struct OccupancyBits {
+		uint64_t groupAny;
+		uint64_t chunkAny[voxelNS::ChunkBitset::WORD_COUNT];
+	};
+	// Instance data no longer matches the chunks' ranges in the terrain heap
+	bool indirectDataDirty = true;
+	// Bumped by every change of the instance data, each frame slot catches up when its frame comes around
+	uint32_t indirectDataVersion = 0;
+	// VK_KHR_draw_indirect_count, else multiDrawIndirect over every slot
+	bool drawIndirectCountSupported = false;
+	PFN_vkCmdDrawIndirectCountKHR cmdDrawIndirectCount = nullptr;
 
 	// Indirect draw statistics (updated via compute)
 	struct {
-		uint32_t drawCount;						// Total number of indirect draw counts to be issued
+		uint32_t drawCount;						// Total number of indirect draw counts to be issued, one per meshlet
+		uint32_t earlyDrawCount;				// drawn by the first phase, visible in the last frame's depth
+		uint32_t lateDrawCount;					// disoccluded, drawn by the second phase
+		uint32_t frustumCount;					// chunks with a mesh in the frustum
+		uint32_t chunkDrawCount;				// chunks past the occlusion tests, the rest of the frustum's are occluded
+		uint32_t meshletFrustumCulled;			// meshlets of drawn chunks outside the frustum
+		uint32_t meshletConeCulled;				// meshlets of drawn chunks facing away from the camera
 	} indirectStats;
+	std::ofstream cullStatsFile; // --cullstats, one CSV row per frame along a scripted camera path
 
-	// Store the indirect draw commands containing index offsets and instance count per object
-	std::vector<VkDrawIndirectCommand> indirectCommands;
+	// GPU frustum and occlusion culling. Two phases: the first draws the chunks in front of the last
+	// frame's depth pyramid, the second tests the rest against a pyramid of what the first one drew.
+	struct {
+		VkPipeline pipeline{ VK_NULL_HANDLE };
+		VkPipelineLayout pipelineLayout{ VK_NULL_HANDLE };
+		VkDescriptorSetLayout descriptorSetLayout{ VK_NULL_HANDLE };
+	} cull;
+	// Same layout as the push constants of cull.comp
+	struct CullPushConstants {
+		glm::mat4 viewProjection;	// camera the depth pyramid was built with
+		glm::vec4 cameraPosition;	// world space, for the meshlets' normal cones
+		uint32_t instanceCount;
+		uint32_t regionCount;
+		uint32_t regionSlotCount;
+		uint32_t phase;
+		uint32_t occlusion;
+		uint32_t meshletCulling;
+	};
+	bool occlusionCulling = true;
+	bool meshletCulling = true;
+
+	// Hi-Z: farthest G-buffer depth per texel, each level half the one below, built by depthreduce.comp
+	struct {
+		VkImage image = VK_NULL_HANDLE;
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkImageView view = VK_NULL_HANDLE;				// every level, read by cull.comp
+		std::vector<VkImageView> levelViews;			// written one by one, each read to build the next
+		VkImageView depthView = VK_NULL_HANDLE;			// depth aspect of the G-buffer depth attachment
+		VkSampler sampler = VK_NULL_HANDLE;
+		uint32_t size = 0;								// of level 0, half the G-buffer
+		uint32_t levelCount = 0;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+		VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+		std::vector<VkDescriptorSet> descriptorSets;	// per level
+		glm::mat4 viewProjection;						// camera of the depth the pyramid holds
+		bool valid = false;								// built by an earlier frame
+	} depthPyramid;
 
 	struct Light {
 		glm::vec4 position;
@@ -102,10 +294,68 @@ public:
 	} uniformData;
 
 	struct {
-		Light lights[34]; // Must match the LIGHT_COUNT define in the shadow and deferred shaders
+		glm::mat4 inverseViewProjection;	// camera the G-buffer is drawn with, written with uniformData
 		glm::vec4 viewPos;
 		int debugDisplayTarget = 0;
+		int lightingMode = 0;
 	} uboComposition;
+	// Point lights of the composition pass, any number of them (std430 array of Light in the shaders), in a
+	// buffer per frame in flight
+	std::vector<Light> lights;
+	vks::Buffer lightBuffer[FRAMES_IN_FLIGHT];
+	uint32_t lightCapacity[FRAMES_IN_FLIGHT] = {};
+	// Every shot that hits leaves a light that fades out over hitLightLifetime seconds, the oldest
+	// goes first once there are maxHitLights
+	struct HitLight {
+		glm::vec3 position;
+		glm::vec3 color;
+		float age;		// seconds
+	};
+	std::deque<HitLight> hitLights;
+	uint32_t maxHitLights = 64;
+	float hitLightLifetime = 20.0f;
+	float hitLightRadius = 40.0f;
+	uint32_t hitLightColor = 0;		// next entry of colors
+
+	// Tiled light culling: lightcull.comp bins the lights into LIGHT_TILE_SIZE square tiles of the G-buffer
+	// against each tile's depth range, the composition only shades with its tile's lights
+	struct {
+		VkPipeline pipeline{ VK_NULL_HANDLE };
+		VkPipelineLayout pipelineLayout{ VK_NULL_HANDLE };
+		VkDescriptorSetLayout descriptorSetLayout{ VK_NULL_HANDLE };
+		VkDescriptorSet descriptorSet[FRAMES_IN_FLIGHT]{};	// per frame in flight, reading its lights
+		vks::Buffer uniformBuffer[FRAMES_IN_FLIGHT];
+		vks::Buffer tileBuffer;		// per tile the light count, then MAX_LIGHTS_PER_TILE light indices
+		vks::Buffer overflowBuffer[FRAMES_IN_FLIGHT];	// tiles that dropped lights, read back by the host
+		uint32_t overflowTiles = 0;	// of the last frame culled in the slot
+		uint32_t tileCountX = 0;
+		uint32_t tileCountY = 0;
+	} lightCulling;
+	// Same layout as the uniform block of lightcull.comp
+	struct LightCullingUniforms {
+		glm::mat4 view;
+		glm::mat4 inverseProjection;
+		uint32_t lightCount;
+		uint32_t tileCountX;
+	};
+	// Light volumes: every light is an instance of a low poly sphere drawn into an HDR target of the
+	// G-buffer's size with additive blending. The sphere's far side is depth tested against the G-buffer,
+	// so pixels behind the light are rejected before shading; the composition adds the target to the
+	// ambient term.
+	struct {
+		FrameBufferAttachment accumulation;
+		VkRenderPass renderPass = VK_NULL_HANDLE;
+		VkFramebuffer frameBuffer = VK_NULL_HANDLE;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		vks::Buffer sphere;			// triangle list around the unit sphere
+		uint32_t sphereVertexCount = 0;
+	} lightVolumes;
+	enum LightingMode { LIGHTING_TILED, LIGHTING_VOLUMES };
+	int32_t lightingMode = LIGHTING_TILED;
+	// GPU time of the lighting pass (light culling or light volumes) and of the composition, per mode.
+	// Four timestamps per frame in flight: 0 and 1 bracket the pass, 2 and 3 the composition draw.
+	VkQueryPool lightingQueryPool = VK_NULL_HANDLE;
+	float lightingMilliseconds[2][2] = {};
 
 	struct UBOFire {
 		glm::mat4 projection;
@@ -114,11 +364,12 @@ public:
 		float pointSize = PARTICLE_SIZE;
 	} uboFire;
 
-	vks::Buffer uniformBuffer;
+	// Per frame in flight, written once beginFrame has waited for the slot's last frame
+	vks::Buffer uniformBuffer[FRAMES_IN_FLIGHT];
 	struct {
 		vks::Buffer fire; // Particle System
 		vks::Buffer composition; // Deferred
-	} uniformBuffers;
+	} uniformBuffers[FRAMES_IN_FLIGHT];
 
 	struct {
 		VkPipeline ground{ VK_NULL_HANDLE };
@@ -130,7 +381,7 @@ public:
 	} pipelines;
 
 	VkPipelineLayout pipelineLayout{ VK_NULL_HANDLE };
-	VkDescriptorSet descriptorSet{ VK_NULL_HANDLE };
+	VkDescriptorSet descriptorSet[FRAMES_IN_FLIGHT]{};
 	VkDescriptorSetLayout descriptorSetLayout{ VK_NULL_HANDLE };
 
 	// View frustum for culling invisible objects
@@ -152,10 +403,11 @@ public:
 	glm::vec3 maxVel = glm::vec3(3.0f, 7.0f, 3.0f);
 	std::default_random_engine rndEngine;
 	struct {
-		VkBuffer buffer;
-		VkDeviceMemory memory;
+		// One vertex buffer per frame in flight
+		VkBuffer buffer[FRAMES_IN_FLIGHT];
+		VkDeviceMemory memory[FRAMES_IN_FLIGHT];
 		// Store the mapped address of the particle data for reuse
-		void* mappedMemory;
+		void* mappedMemory[FRAMES_IN_FLIGHT];
 		// Size of the particle buffer in bytes
 		size_t size;
 	} particles;
@@ -163,7 +415,7 @@ public:
 	struct {
 		VkDescriptorSet particles;
 		VkDescriptorSet gBuffers;
-	} descriptorSets;
+	} descriptorSets[FRAMES_IN_FLIGHT];
 	unsigned int lastHit_particle_count = 16;
 	unsigned int particle_count = max_emitters_count + lastHit_particle_count;
 	std::vector<glm::vec3> emitter_positions;
@@ -181,17 +433,47 @@ public:
 	struct FrameBuffer {
 		int32_t width, height;
 		VkFramebuffer frameBuffer;
-		FrameBufferAttachment position, normal, albedo;
-		FrameBufferAttachment depth;
+		FrameBufferAttachment normal, albedo;	// octahedral normals, albedo with the specular map in alpha
+		FrameBufferAttachment depth;			// world positions are reconstructed from it
 		VkRenderPass renderPass;
+		VkRenderPass lateRenderPass;	// compatible, keeps what renderPass drew for the second culling phase
 	} offScreenFrameBuf;
 	// One sampler for the frame buffer color attachments
 	VkSampler colorSampler;
 
-	VkCommandBuffer offScreenCmdBuffer = VK_NULL_HANDLE;
-
-	// Semaphore used to synchronize between offscreen and final scene rendering
-	VkSemaphore offscreenSemaphore = VK_NULL_HANDLE;
+	// Command buffers and semaphores of one frame in flight
+	struct FrameCommands {
+		VkCommandPool commandPool = VK_NULL_HANDLE;				// reset every time the frame slot comes around
+		VkCommandBuffer commandBuffer = VK_NULL_HANDLE;			// primary, culling, the render passes and the lighting pass
+		VkCommandBuffer compositionCmdBuffer = VK_NULL_HANDLE;	// primary, composition and UI into the swap chain image
+		VkCommandBuffer skysphereCmdBuffer = VK_NULL_HANDLE;	// secondary, recorded once from offscreenStaticPool
+		VkCommandBuffer particlesCmdBuffer = VK_NULL_HANDLE;
+		VkSemaphore presentComplete = VK_NULL_HANDLE;			// the swap chain image can be rendered to
+		VkSemaphore offscreenComplete = VK_NULL_HANDLE;			// the composition waits for the offscreen pass
+		VkSemaphore renderComplete = VK_NULL_HANDLE;			// presentation waits for the composition
+		int32_t timestampLightingMode = -1;						// lighting mode the slot's timestamps measured, -1 before its first frame
+	};
+	FrameCommands frameCommands[FRAMES_IN_FLIGHT];
+	// Pool of the secondary command buffers recorded once per frame slot
+	VkCommandPool offscreenStaticPool = VK_NULL_HANDLE;
+	// Terrain draws, one secondary command buffer per region and frame in flight recorded on worker threads
+	struct TerrainRegion {
+		uint32_t drawCapacity = 0;								// meshlets of its chunks, the most draws the region issues
+		uint32_t recordedCapacity[FRAMES_IN_FLIGHT];			// drawCapacity the frame's buffer was recorded with
+		uint32_t recordedSlotCount[FRAMES_IN_FLIGHT];			// regionSlotCount the frame's buffer was recorded with
+		uint32_t recordedGeneration[FRAMES_IN_FLIGHT];			// terrain heap buffer the frame's buffer binds
+	};
+	TerrainRegion terrainRegions[REGION_COUNT];
+	RegionRecorder regionRecorder;
+	uint32_t visibleRegionCount = 0;
+	// CPU frustum culling of the chunks' mesh bounds, decides which regions are executed
+	FrustumCuller chunkCuller;
+	uint32_t chunkCullerLeaf[CHUNK_COUNT];	// leaf of each chunk, leaves are in morton order so a node of 8 is a 2x2x2 block
+	uint32_t leafChunk[CHUNK_COUNT];
+	std::vector<uint8_t> visibleLeaves;
+	// CPU occlusion culling of the frustum visible chunks behind the solid ones, no GPU feedback involved
+	OcclusionRasterizer occlusionRasterizer;
+	bool cpuOcclusionCulling = true;
 
 	int highestPowerOf2(int N) {
 		return std::pow(2, std::floor(std::log2(N)));
@@ -204,6 +486,7 @@ public:
 		camera.setPerspective(60.0f, (float)width / (float)height, 0.1f, 512.0f);
 		camera.setRotation(glm::vec3(-45.0f, 135.0f, 0.0f));
 		camera.setTranslation(glm::vec3(-5.0f, 0.0f, -5.0f));
+		lastCameraPosition = camera.position;
 		camera.movementSpeed = 100.0f;
 		numThreads = highestPowerOf2(std::thread::hardware_concurrency());
 		colors.push_back(glm::vec3(1.0f, 0.1f, 0.1f)); // Red
@@ -217,10 +500,33 @@ public:
 		colors.push_back(glm::vec3(0.7f, 0.1f, 1.0f)); // Violet
 		colors.push_back(glm::vec3(1.0f, 0.1f, 0.6f)); // Pink
 		memset(&indirectStats, 0, sizeof(indirectStats));
+		// Leave one core to the render thread
+		uint32_t cores = std::thread::hardware_concurrency();
+		workerPool = std::make_unique<WorkerPool>(cores > 1 ? cores - 1 : 1);
+		// VK_EXT_memory_budget is read through vkGetPhysicalDeviceMemoryProperties2
+		uint32_t extensionCount = 0;
+		vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+		std::vector<VkExtensionProperties> extensions(extensionCount);
+		vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, extensions.data());
+		for (const VkExtensionProperties& extension : extensions) {
+			if (strcmp(extension.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0) {
+				enabledInstanceExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+				memoryProperties2Supported = true;
+			}
+		}
+		if (commandLineParser.isSet("memorystats")) {
+			memoryStatsFile.open(commandLineParser.getValueAsString("memorystats", "memory_stats.csv"));
+		}
+		if (commandLineParser.isSet("cullstats")) {
+			cullStatsFile.open(commandLineParser.getValueAsString("cullstats", "cull_stats.csv"));
+			cullStatsFile << "frame,frustum,drawnEarly,drawnLate,occluded,cpuOccluded,cpuOcclusionMs,meshletFrustumCulled,meshletConeCulled\n";
+		}
 	}
 
 	~VulkanExample()
 	{
+		// Finish outstanding remeshing before anything it references goes away
+		workerPool.reset();
 		if (device) {
 			vkDestroyPipeline(device, pipelines.ground, nullptr);
 			vkDestroyPipeline(device, pipelines.skysphere, nullptr);
@@ -232,10 +538,80 @@ public:
 			textures.particles.fire.destroy();
 			textures.ground.colorMap.destroy();
 			textures.ground.normalMap.destroy();
-			instanceBuffer.destroy();
-			indirectCommandsBuffer.destroy();
-			uniformBuffer.destroy();
-			uniformBuffers.fire.destroy();
+			regionRecorder.destroy();
+			for (FrameCommands& frame : frameCommands) {
+				vkDestroyCommandPool(device, frame.commandPool, nullptr);
+				vkDestroySemaphore(device, frame.presentComplete, nullptr);
+				vkDestroySemaphore(device, frame.offscreenComplete, nullptr);
+				vkDestroySemaphore(device, frame.renderComplete, nullptr);
+			}
+			vkDestroyCommandPool(device, offscreenStaticPool, nullptr);
+			vkDestroyPipeline(device, cull.pipeline, nullptr);
+			vkDestroyPipelineLayout(device, cull.pipelineLayout, nullptr);
+			vkDestroyDescriptorSetLayout(device, cull.descriptorSetLayout, nullptr);
+			for (CullFrame& frame : cullFrames) {
+				memoryStrategy.destroyBuffer(frame.instanceBuffer);
+				memoryStrategy.destroyBuffer(frame.indirectCommandsBuffer);
+				memoryStrategy.destroyBuffer(frame.indirectDrawCountBuffer);
+				memoryStrategy.destroyBuffer(frame.occupancyBuffer);
+				memoryStrategy.destroyBuffer(frame.meshletBuffer);
+			}
+			memoryStrategy.destroyBuffer(cullVisibilityBuffer);
+			vkDestroyPipeline(device, depthPyramid.pipeline, nullptr);
+			vkDestroyPipelineLayout(device, depthPyramid.pipelineLayout, nullptr);
+			vkDestroyDescriptorSetLayout(device, depthPyramid.descriptorSetLayout, nullptr);
+			for (VkImageView levelView : depthPyramid.levelViews) {
+				vkDestroyImageView(device, levelView, nullptr);
+			}
+			vkDestroyImageView(device, depthPyramid.view, nullptr);
+			vkDestroyImageView(device, depthPyramid.depthView, nullptr);
+			vkDestroySampler(device, depthPyramid.sampler, nullptr);
+			vkDestroyImage(device, depthPyramid.image, nullptr);
+			vkFreeMemory(device, depthPyramid.memory, nullptr);
+			vkDestroyRenderPass(device, offScreenFrameBuf.lateRenderPass, nullptr);
+			vkDestroyPipeline(device, lightCulling.pipeline, nullptr);
+			vkDestroyPipelineLayout(device, lightCulling.pipelineLayout, nullptr);
+			vkDestroyDescriptorSetLayout(device, lightCulling.descriptorSetLayout, nullptr);
+			memoryStrategy.destroyBuffer(lightCulling.tileBuffer);
+			vkDestroyPipeline(device, lightVolumes.pipeline, nullptr);
+			vkDestroyFramebuffer(device, lightVolumes.frameBuffer, nullptr);
+			vkDestroyRenderPass(device, lightVolumes.renderPass, nullptr);
+			vkDestroyImageView(device, lightVolumes.accumulation.view, nullptr);
+			vkDestroyImage(device, lightVolumes.accumulation.image, nullptr);
+			vkFreeMemory(device, lightVolumes.accumulation.mem, nullptr);
+			memoryStrategy.destroyBuffer(lightVolumes.sphere);
+			if (lightingQueryPool != VK_NULL_HANDLE) {
+				vkDestroyQueryPool(device, lightingQueryPool, nullptr);
+			}
+			uploadManager.destroy();
+			deletionQueue.flush();
+			terrainHeap.destroy();
+			for (VkFence fence : frameFences) {
+				vkDestroyFence(device, fence, nullptr);
+			}
+			for (int frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+				memoryStrategy.destroyBuffer(uniformBuffer[frame]);
+				memoryStrategy.destroyBuffer(uniformBuffers[frame].fire);
+				memoryStrategy.destroyBuffer(uniformBuffers[frame].composition);
+				memoryStrategy.destroyBuffer(lightBuffer[frame]);
+				memoryStrategy.destroyBuffer(lightCulling.uniformBuffer[frame]);
+				memoryStrategy.destroyBuffer(lightCulling.overflowBuffer[frame]);
+				memoryStrategy.destroyBuffer(particles.buffer[frame], particles.memory[frame]);
+			}
+		}
+	}
+
+	virtual void getEnabledExtensions()
+	{
+		// Heap budgets from the driver, otherwise the memory strategy keeps a fixed share of each heap
+		if (memoryProperties2Supported && vulkanDevice->extensionSupported(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+			enabledDeviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+			memoryBudgetSupported = true;
+		}
+		// Lets the GPU culling pass decide how many terrain draws are issued
+		if (vulkanDevice->extensionSupported(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+			enabledDeviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+			drawIndirectCountSupported = true;
 		}
 	}
 
@@ -272,22 +648,13 @@ public:
 
 	};
 
-	bool frustumCheck(glm::vec3 pos, float radius)
-	{
-		// Check sphere against frustum planes
-		for (int i = 0; i < 6; i++)
-		{
-			if (glm::dot(glm::vec4(pos, 1.0f), frustum.planes.data()[i]) + radius < 0.0)
-			{
-				return false;
-			}
-		}
-		return true;
-	}
-	void buildCommandBuffers()
+	// Final composition as full screen quad and the UI overlay into the acquired swap chain image, recorded
+	// every frame from the frame slot's pool with the slot's descriptor set
+	void buildCompositionCommandBuffer(uint32_t frameSlot)
 	{
-		cmdBufferBuildCount++;
+		VkCommandBuffer cmdBuffer = frameCommands[frameSlot].compositionCmdBuffer;
 		VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
+		cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
 		VkClearValue clearValues[2];
 		clearValues[0].color = { { 0.18f, 0.27f, 0.5f, 0.0f } };
@@ -301,61 +668,274 @@ public:
 		renderPassBeginInfo.renderArea.extent.height = height;
 		renderPassBeginInfo.clearValueCount = 2;
 		renderPassBeginInfo.pClearValues = clearValues;
+		// Set target frame buffer
+		renderPassBeginInfo.framebuffer = VulkanExampleBase::frameBuffers[currentBuffer];
 
-		for (int32_t i = 0; i < drawCmdBuffers.size(); ++i)
-		{
-			// Set target frame buffer
-			renderPassBeginInfo.framebuffer = VulkanExampleBase::frameBuffers[i];
+		VK_CHECK_RESULT(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
 
-			VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
+		if (lightingQueryPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, lightingQueryPool, frameSlot * 4 + 2);
+		}
+		vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-			vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		VkViewport viewport = vks::initializers::viewport((float)width, (float)height, 0.0f, 1.0f);
+		vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
 
-			VkViewport viewport = vks::initializers::viewport((float)width, (float)height, 0.0f, 1.0f);
-			vkCmdSetViewport(drawCmdBuffers[i], 0, 1, &viewport);
+		VkRect2D scissor = vks::initializers::rect2D(width, height, 0, 0);
+		vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
 
-			VkRect2D scissor = vks::initializers::rect2D(width, height, 0, 0);
-			vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[frameSlot].gBuffers, 0, nullptr);
 
-			vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets.gBuffers, 0, nullptr);
-			
-			vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.composition);
-			// Final composition as full screen quad
-			// Note: Also used for debug display if debugDisplayTarget > 0
-			vkCmdDraw(drawCmdBuffers[i], 3, 1, 0, 0);
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.composition);
+		// Final composition as full screen quad
+		// Note: Also used for debug display if debugDisplayTarget > 0
+		vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+		if (lightingQueryPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, lightingQueryPool, frameSlot * 4 + 3);
+		}
 
-			//// Voxel points
-			////vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.voxelPoint);
-			////vkCmdBindVertexBuffers(drawCmdBuffers[i], 0, 1, &voxels.buffer, offsets);
-			////vkCmdDraw(drawCmdBuffers[i], voxels.count, 1, 0, 0);
+		//// Voxel points
+		////vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.voxelPoint);
+		////vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &voxels.buffer, offsets);
+		////vkCmdDraw(cmdBuffer, voxels.count, 1, 0, 0);
 
-			drawUI(drawCmdBuffers[i]);
+		drawUI(cmdBuffer);
 
-			vkCmdEndRenderPass(drawCmdBuffers[i]);
+		vkCmdEndRenderPass(cmdBuffer);
 
-			VK_CHECK_RESULT(vkEndCommandBuffer(drawCmdBuffers[i]));
+		VK_CHECK_RESULT(vkEndCommandBuffer(cmdBuffer));
+	}
+	// Command pools, buffers and semaphores of every frame slot, the static parts of the offscreen pass and
+	// the terrain regions' recording threads, created once
+	void prepareOffscreenCommandBuffers()
+	{
+		VkCommandPoolCreateInfo poolInfo = vks::initializers::commandPoolCreateInfo();
+		poolInfo.queueFamilyIndex = vulkanDevice->queueFamilyIndices.graphics;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		VkSemaphoreCreateInfo semaphoreCreateInfo = vks::initializers::semaphoreCreateInfo();
+		for (FrameCommands& frame : frameCommands) {
+			VK_CHECK_RESULT(vkCreateCommandPool(device, &poolInfo, nullptr, &frame.commandPool));
+			VkCommandBuffer primaryCmdBuffers[2];
+			VkCommandBufferAllocateInfo allocateInfo = vks::initializers::commandBufferAllocateInfo(frame.commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 2);
+			VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocateInfo, primaryCmdBuffers));
+			frame.commandBuffer = primaryCmdBuffers[0];
+			frame.compositionCmdBuffer = primaryCmdBuffers[1];
+			// Acquired image ready, offscreen pass done, composition done
+			VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.presentComplete));
+			VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.offscreenComplete));
+			VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.renderComplete));
 		}
+		poolInfo.flags = 0;
+		VK_CHECK_RESULT(vkCreateCommandPool(device, &poolInfo, nullptr, &offscreenStaticPool));
+		VkCommandBuffer staticCmdBuffers[2 * FRAMES_IN_FLIGHT];
+		VkCommandBufferAllocateInfo allocateInfo = vks::initializers::commandBufferAllocateInfo(offscreenStaticPool, VK_COMMAND_BUFFER_LEVEL_SECONDARY, 2 * FRAMES_IN_FLIGHT);
+		VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &allocateInfo, staticCmdBuffers));
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			frameCommands[frameSlot].skysphereCmdBuffer = staticCmdBuffers[2 * frameSlot];
+			frameCommands[frameSlot].particlesCmdBuffer = staticCmdBuffers[2 * frameSlot + 1];
+		}
+		buildStaticOffscreenCommandBuffers();
+
+		for (uint32_t regionIndex = 0; regionIndex < REGION_COUNT; regionIndex++) {
+			TerrainRegion& region = terrainRegions[regionIndex];
+			for (int frame = 0; frame < FRAMES_IN_FLIGHT; frame++) {
+				region.recordedCapacity[frame] = UINT32_MAX;
+				region.recordedSlotCount[frame] = UINT32_MAX;
+				region.recordedGeneration[frame] = UINT32_MAX;
+			}
+		}
+		// One buffer per region and culling phase, buffer region + phase * REGION_COUNT. A lane per worker
+		// and one for the render thread, which records along.
+		regionRecorder.create(device, vulkanDevice->queueFamilyIndices.graphics, workerPool.get(), std::min(workerPool->threadCount() + 1, (uint32_t)REGION_COUNT), FRAMES_IN_FLIGHT, 2 * REGION_COUNT);
+	}
+	// Region of the chunk grid the chunk belongs to
+	uint32_t chunkRegion(int chunkIndex) {
+		glm::ivec3 regionCoord = glm::ivec3(voxelNS::chunkIndex_to_pos(chunkIndex)) / REGION_DIMENSION;
+		return (regionCoord.z * REGIONS_PER_AXIS + regionCoord.y) * REGIONS_PER_AXIS + regionCoord.x;
+	}
+	// Orders the culler's leaves along a morton curve of the chunk grid, so that every node of the
+	// hierarchy bounds a compact block of chunks
+	void prepareChunkCuller() {
+		std::vector<std::pair<uint32_t, uint32_t>> order(CHUNK_COUNT);
+		for (uint32_t chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
+			glm::uvec3 coord = glm::uvec3(voxelNS::chunkIndex_to_pos(chunkIndex));
+			order[chunkIndex] = { FrustumCuller::morton_code(coord.x, coord.y, coord.z), chunkIndex };
+		}
+		std::sort(order.begin(), order.end());
+		for (uint32_t leaf = 0; leaf < CHUNK_COUNT; leaf++) {
+			leafChunk[leaf] = order[leaf].second;
+			chunkCullerLeaf[order[leaf].second] = leaf;
+		}
+		chunkCuller.resize(CHUNK_COUNT);
+		occlusionRasterizer.create(OCCLUSION_BUFFER_WIDTH, OCCLUSION_BUFFER_HEIGHT, workerPool.get(), std::min(workerPool->threadCount() + 1, 4u));
+	}
+	// Rasterizes the solid box of every chunk into the CPU occlusion buffer. The boxes span voxel centers,
+	// the marching cubes surface lies half a voxel further out, so a box never reaches past the terrain.
+	void rasterizeOccluders() {
+		occlusionRasterizer.begin(uniformData.projection * uniformData.view, -camera.position);
+		for (int chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
+			const voxelNS::SolidBox& box = occupancy.solidBox[chunkIndex];
+			if (box.empty()) {
+				continue;
+			}
+			glm::vec3 chunkOrigin = voxelNS::chunkIndex_to_pos(chunkIndex) * (float)CHUNK_DIMENSION;
+			occlusionRasterizer.add_occluder(chunkOrigin + glm::vec3(box.min), chunkOrigin + glm::vec3(box.max));
+		}
+		occlusionRasterizer.rasterize();
 	}
-	// Build command buffer for rendering the scene to the offscreen frame buffer attachments
-	void buildDeferredCommandBuffer()
+	// Skysphere and particles, drawn before and after the terrain. Nothing in them changes from frame to
+	// frame (the particles are rewritten in place), so they are recorded once per frame slot, against the
+	// slot's descriptor sets and particle buffer.
+	void buildStaticOffscreenCommandBuffers()
 	{
-		if (offScreenCmdBuffer == VK_NULL_HANDLE)
-		{
-			offScreenCmdBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
+		VkCommandBufferInheritanceInfo inheritanceInfo = offscreenInheritanceInfo();
+		VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
+		cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+		cmdBufInfo.pInheritanceInfo = &inheritanceInfo;
+		VkDeviceSize offsets[1] = { 0 };
+
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			VkCommandBuffer skysphereCmdBuffer = frameCommands[frameSlot].skysphereCmdBuffer;
+			VkCommandBuffer particlesCmdBuffer = frameCommands[frameSlot].particlesCmdBuffer;
+
+			// Skysphere
+			VK_CHECK_RESULT(vkBeginCommandBuffer(skysphereCmdBuffer, &cmdBufInfo));
+			setOffscreenViewport(skysphereCmdBuffer);
+			vkCmdBindDescriptorSets(skysphereCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet[frameSlot], 0, NULL);
+			vkCmdBindPipeline(skysphereCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.skysphere);
+			models.skysphere.draw(skysphereCmdBuffer);
+			VK_CHECK_RESULT(vkEndCommandBuffer(skysphereCmdBuffer));
+
+			// Particle system (no index buffer)
+			VK_CHECK_RESULT(vkBeginCommandBuffer(particlesCmdBuffer, &cmdBufInfo));
+			setOffscreenViewport(particlesCmdBuffer);
+			vkCmdBindDescriptorSets(	particlesCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[frameSlot].particles, 0, nullptr);
+			vkCmdBindPipeline(			particlesCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.particles);
+			vkCmdBindVertexBuffers(		particlesCmdBuffer, 0, 1, &particles.buffer[frameSlot], offsets);
+			vkCmdDraw(					particlesCmdBuffer, particle_count, 1, 0, 0);
+			VK_CHECK_RESULT(vkEndCommandBuffer(particlesCmdBuffer));
 		}
+	}
+	VkCommandBufferInheritanceInfo offscreenInheritanceInfo()
+	{
+		VkCommandBufferInheritanceInfo inheritanceInfo = vks::initializers::commandBufferInheritanceInfo();
+		inheritanceInfo.renderPass = offScreenFrameBuf.renderPass;
+		inheritanceInfo.subpass = 0;
+		inheritanceInfo.framebuffer = offScreenFrameBuf.frameBuffer;
+		return inheritanceInfo;
+	}
+	// Dynamic state is not inherited, every secondary command buffer sets its own
+	void setOffscreenViewport(VkCommandBuffer cmdBuffer)
+	{
+		VkViewport viewport = vks::initializers::viewport((float)offScreenFrameBuf.width, (float)offScreenFrameBuf.height, 0.0f, 1.0f);
+		vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
 
-		// Create a semaphore used to synchronize offscreen rendering and usage
-		VkSemaphoreCreateInfo semaphoreCreateInfo = vks::initializers::semaphoreCreateInfo();
-		VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &offscreenSemaphore));
+		VkRect2D scissor = vks::initializers::rect2D(offScreenFrameBuf.width, offScreenFrameBuf.height, 0, 0);
+		vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+	}
+	// Terrain draws of one region in one culling phase (slice is region + phase * REGION_COUNT), on a
+	// recording thread. Which of its chunks are visible comes from the culling pass, so the recording only
+	// depends on the terrain heap buffer, the region's capacity and its slice of the frame slot's commands.
+	void recordTerrainRegion(VkCommandBuffer cmdBuffer, uint32_t frameSlot, uint32_t slice)
+	{
+		const CullFrame& frame = cullFrames[frameSlot];
+		uint32_t region = slice % REGION_COUNT;
+		setOffscreenViewport(cmdBuffer);
+		VkDeviceSize offsets[1] = { 0 };
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet[frameSlot], 0, NULL);
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.triangle);
+		// Every chunk lives in the one terrain heap buffer, the region's visible meshlets go out in a single draw
+		VkBuffer terrainVertexBuffer = terrainHeap.vertexBuffer();
+		vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &terrainVertexBuffer, offsets);
+		VkDeviceSize commandsOffset = (VkDeviceSize)slice * regionSlotCount * sizeof(VkDrawIndirectCommand);
+		uint32_t drawCapacity = terrainRegions[region].drawCapacity;
+		if (drawIndirectCountSupported) {
+			cmdDrawIndirectCount(cmdBuffer, frame.indirectCommandsBuffer.buffer, commandsOffset, frame.indirectDrawCountBuffer.buffer, slice * sizeof(uint32_t), drawCapacity, sizeof(VkDrawIndirectCommand));
+		}
+		else if (vulkanDevice->features.multiDrawIndirect) {
+			vkCmdDrawIndirect(cmdBuffer, frame.indirectCommandsBuffer.buffer, commandsOffset, drawCapacity, sizeof(VkDrawIndirectCommand));
+		}
+		else {
+			// If multi draw is not available, we must issue separate draw commands
+			for (uint32_t slot = 0; slot < drawCapacity; slot++) {
+				vkCmdDrawIndirect(cmdBuffer, frame.indirectCommandsBuffer.buffer, commandsOffset + slot * sizeof(VkDrawIndirectCommand), 1, sizeof(VkDrawIndirectCommand));
+			}
+		}
+	}
+	// Build command buffer for rendering the scene to the offscreen frame buffer attachments.
+	// Recorded every frame from the frame slot's pool, which beginFrame has made sure the GPU is done with:
+	// the culling dispatches and the render passes are recorded afresh, the draws inside them are secondary
+	// command buffers that are reused, terrain regions are recorded again only when they changed.
+	// Culling runs in two phases around two render passes into the same G-buffer: the chunks in front of
+	// the last frame's depth pyramid are drawn first, a pyramid is built from that depth, and the chunks
+	// the first phase held back are tested against it and drawn if they came into view.
+	void buildDeferredCommandBuffer(uint32_t frameSlot)
+	{
+		FrameCommands& frame = frameCommands[frameSlot];
+		VK_CHECK_RESULT(vkResetCommandPool(device, frame.commandPool, 0));
+		updateCullFrame(frameSlot);
+		CullFrame& cullFrame = cullFrames[frameSlot];
+		cullFrame.frame = frameNumber;
+
+		// Regions whose buffers for this frame slot bind an old heap buffer, issue too few draws or read
+		// their commands from an old offset
+		std::vector<uint32_t> staleRegions;
+		for (uint32_t region = 0; region < REGION_COUNT; region++) {
+			TerrainRegion& terrainRegion = terrainRegions[region];
+			if (terrainRegion.recordedGeneration[frameSlot] != terrainHeap.generation() || terrainRegion.recordedCapacity[frameSlot] != terrainRegion.drawCapacity ||
+				terrainRegion.recordedSlotCount[frameSlot] != regionSlotCount) {
+				terrainRegion.recordedGeneration[frameSlot] = terrainHeap.generation();
+				terrainRegion.recordedCapacity[frameSlot] = terrainRegion.drawCapacity;
+				terrainRegion.recordedSlotCount[frameSlot] = regionSlotCount;
+				staleRegions.push_back(region);
+				staleRegions.push_back(region + REGION_COUNT);
+			}
+		}
+		VkCommandBufferInheritanceInfo inheritanceInfo = offscreenInheritanceInfo();
+		regionRecorder.record(frameSlot, staleRegions, inheritanceInfo, [this, frameSlot](VkCommandBuffer cmdBuffer, uint32_t slice) { recordTerrainRegion(cmdBuffer, frameSlot, slice); });
+		// Regions without a single chunk mesh in the frustum and in front of the solid chunks are not
+		// executed at all. cull.comp skips the occluded chunks of the other regions.
+		chunkCuller.cull(frustum.planes.data(), visibleLeaves);
+		if (cpuOcclusionCulling) {
+			rasterizeOccluders();
+		}
+		InstanceData* instances = static_cast<InstanceData*>(cullFrame.instanceBuffer.mapped);
+		bool regionVisible[REGION_COUNT] = {};
+		for (uint32_t leaf = 0; leaf < CHUNK_COUNT; leaf++) {
+			uint32_t chunkIndex = leafChunk[leaf];
+			const Chunk* chunk = chunkListBuffer[chunkIndex];
+			bool occluded = visibleLeaves[leaf] && cpuOcclusionCulling && !occlusionRasterizer.test_box(chunk->boundsMin, chunk->boundsMax);
+			instances[chunkIndex].occluded = occluded ? 1 : 0;
+			if (visibleLeaves[leaf] && !occluded) {
+				regionVisible[chunkRegion(chunkIndex)] = true;
+			}
+		}
+		cullFrame.cpuOccluded = cpuOcclusionCulling ? occlusionRasterizer.statistics().culled : 0;
+		cullFrame.cpuOcclusionMilliseconds = cpuOcclusionCulling ? occlusionRasterizer.statistics().rasterMilliseconds + occlusionRasterizer.statistics().testMilliseconds : 0.0f;
+		OccupancyBits* occupancyBits = static_cast<OccupancyBits*>(cullFrame.occupancyBuffer.mapped);
+		occupancyBits->groupAny = occupancy.groupAny;
+		memcpy(occupancyBits->chunkAny, occupancy.chunkAny.words, sizeof(occupancyBits->chunkAny));
+		std::vector<VkCommandBuffer> earlyCmdBuffers;
+		std::vector<VkCommandBuffer> lateCmdBuffers;
+		earlyCmdBuffers.push_back(frame.skysphereCmdBuffer);
+		for (uint32_t region = 0; region < REGION_COUNT; region++) {
+			if (regionVisible[region]) {
+				earlyCmdBuffers.push_back(regionRecorder.command_buffer(frameSlot, region));
+				lateCmdBuffers.push_back(regionRecorder.command_buffer(frameSlot, region + REGION_COUNT));
+			}
+		}
+		visibleRegionCount = static_cast<uint32_t>(lateCmdBuffers.size());
+		lateCmdBuffers.push_back(frame.particlesCmdBuffer);
 
+		VkCommandBuffer cmdBuffer = frame.commandBuffer;
 		VkCommandBufferBeginInfo cmdBufInfo = vks::initializers::commandBufferBeginInfo();
+		cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
 		// Clear values for all attachments written in the fragment shader
-		std::array<VkClearValue, 4> clearValues;
+		std::array<VkClearValue, 3> clearValues;
 		clearValues[0].color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
 		clearValues[1].color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
-		clearValues[2].color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
-		clearValues[3].depthStencil = { 1.0f, 0 };
+		clearValues[2].depthStencil = { 1.0f, 0 };
 
 		VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
 		renderPassBeginInfo.renderPass = offScreenFrameBuf.renderPass;
@@ -365,47 +945,162 @@ public:
 		renderPassBeginInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
 		renderPassBeginInfo.pClearValues = clearValues.data();
 
-		VK_CHECK_RESULT(vkBeginCommandBuffer(offScreenCmdBuffer, &cmdBufInfo));
-
-		vkCmdBeginRenderPass(offScreenCmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-		VkViewport viewport = vks::initializers::viewport((float)offScreenFrameBuf.width, (float)offScreenFrameBuf.height, 0.0f, 1.0f);
-		vkCmdSetViewport(offScreenCmdBuffer, 0, 1, &viewport);
-
-		VkRect2D scissor = vks::initializers::rect2D(offScreenFrameBuf.width, offScreenFrameBuf.height, 0, 0);
-		vkCmdSetScissor(offScreenCmdBuffer, 0, 1, &scissor);
+		VK_CHECK_RESULT(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
+		if (lightingQueryPool != VK_NULL_HANDLE) {
+			vkCmdResetQueryPool(cmdBuffer, lightingQueryPool, frameSlot * 4, 4);
+		}
+		frame.timestampLightingMode = lightingQueryPool != VK_NULL_HANDLE ? lightingMode : -1;
+
+		// The frame before this one may still be on the queue, reading the G-buffer, the depth pyramid, the
+		// visibility buffer, the light tiles and the lighting target that this frame writes again. Only the CPU
+		// work of the next frame overlaps the GPU, the GPU frames run one after another.
+		VkMemoryBarrier frameBarrier = vks::initializers::memoryBarrier();
+		frameBarrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+		frameBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &frameBarrier, 0, nullptr, 0, nullptr);
+
+		// Draw slots the culling passes do not write must draw nothing when their number is not read
+		// from the count buffer
+		vkCmdFillBuffer(cmdBuffer, cullFrame.indirectDrawCountBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+		if (!drawIndirectCountSupported) {
+			vkCmdFillBuffer(cmdBuffer, cullFrame.indirectCommandsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+		}
+		// The depth pyramid was written by the last frame's command buffer
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+		// First phase: against this frame's frustum and the last frame's depth
+		CullPushConstants pushConstants;
+		pushConstants.viewProjection = depthPyramid.viewProjection;
+		pushConstants.cameraPosition = glm::vec4(-camera.position, 1.0f);
+		pushConstants.instanceCount = CHUNK_COUNT;
+		pushConstants.regionCount = REGION_COUNT;
+		pushConstants.regionSlotCount = regionSlotCount;
+		pushConstants.phase = 0;
+		pushConstants.occlusion = depthPyramid.valid && occlusionCulling ? 1 : 0;
+		pushConstants.meshletCulling = meshletCulling ? 1 : 0;
+		dispatchCulling(cmdBuffer, cullFrame, pushConstants);
+
+		vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		vkCmdExecuteCommands(cmdBuffer, static_cast<uint32_t>(earlyCmdBuffers.size()), earlyCmdBuffers.data());
+		vkCmdEndRenderPass(cmdBuffer);
+
+		// Second phase: what the first one held back, against the depth the first one drew
+		depthPyramid.viewProjection = uniformData.projection * uniformData.view;
+		buildDepthPyramid(cmdBuffer);
+		pushConstants.viewProjection = depthPyramid.viewProjection;
+		pushConstants.phase = 1;
+		pushConstants.occlusion = 1;
+		dispatchCulling(cmdBuffer, cullFrame, pushConstants);
+
+		renderPassBeginInfo.renderPass = offScreenFrameBuf.lateRenderPass;
+		vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		vkCmdExecuteCommands(cmdBuffer, static_cast<uint32_t>(lateCmdBuffers.size()), lateCmdBuffers.data());
+		vkCmdEndRenderPass(cmdBuffer);
+
+		// The whole frame's depth, for the first phase of the next frame
+		buildDepthPyramid(cmdBuffer);
+		depthPyramid.valid = true;
+
+		if (lightingQueryPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, lightingQueryPool, frameSlot * 4);
+		}
+		if (lightingMode == LIGHTING_VOLUMES) {
+			drawLightVolumes(cmdBuffer, frameSlot);
+		}
+		else {
+			cullLights(cmdBuffer, frameSlot);
+		}
+		if (lightingQueryPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, lightingQueryPool, frameSlot * 4 + 1);
+		}
 
-		//////DRAW////////////
-		//////DRAW////////////
+		VK_CHECK_RESULT(vkEndCommandBuffer(cmdBuffer));
+	}
+	// One culling phase: commands and counts are read by that phase's terrain draws, the counts also by
+	// the host for the statistics
+	void dispatchCulling(VkCommandBuffer cmdBuffer, const CullFrame& frame, const CullPushConstants& pushConstants)
+	{
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull.pipeline);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull.pipelineLayout, 0, 1, &frame.descriptorSet, 0, nullptr);
+		vkCmdPushConstants(cmdBuffer, cull.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+		vkCmdDispatch(cmdBuffer, (CHUNK_COUNT + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+	}
+	// Bins the lights into the G-buffer's tiles, after the pyramid build has left the depth read only. The
+	// lights are the frame slot's, written with this frame's composition update, the camera is the one the
+	// G-buffer was drawn with; the composition of this frame reads the tiles.
+	void cullLights(VkCommandBuffer cmdBuffer, uint32_t frameSlot)
+	{
+		// The slot's last frame has finished, its count is complete
+		uint32_t* overflowTiles = static_cast<uint32_t*>(lightCulling.overflowBuffer[frameSlot].mapped);
+		lightCulling.overflowTiles = *overflowTiles;
+		*overflowTiles = 0;
+		LightCullingUniforms* uniforms = static_cast<LightCullingUniforms*>(lightCulling.uniformBuffer[frameSlot].mapped);
+		uniforms->view = uniformData.view;
+		uniforms->inverseProjection = glm::inverse(uniformData.projection);
+		uniforms->lightCount = static_cast<uint32_t>(lights.size());
+		uniforms->tileCountX = lightCulling.tileCountX;
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCulling.pipeline);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCulling.pipelineLayout, 0, 1, &lightCulling.descriptorSet[frameSlot], 0, nullptr);
+		vkCmdDispatch(cmdBuffer, lightCulling.tileCountX, lightCulling.tileCountY, 1);
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+	}
+	// Every light as a sphere instance into the lighting target, read by this frame's composition
+	void drawLightVolumes(VkCommandBuffer cmdBuffer, uint32_t frameSlot)
+	{
+		// Only the lighting target is cleared, the depth is the G-buffer's
+		VkClearValue clearValue;
+		clearValue.color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+		VkRenderPassBeginInfo renderPassBeginInfo = vks::initializers::renderPassBeginInfo();
+		renderPassBeginInfo.renderPass = lightVolumes.renderPass;
+		renderPassBeginInfo.framebuffer = lightVolumes.frameBuffer;
+		renderPassBeginInfo.renderArea.extent.width = offScreenFrameBuf.width;
+		renderPassBeginInfo.renderArea.extent.height = offScreenFrameBuf.height;
+		renderPassBeginInfo.clearValueCount = 1;
+		renderPassBeginInfo.pClearValues = &clearValue;
+		vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		setOffscreenViewport(cmdBuffer);
 		VkDeviceSize offsets[1] = { 0 };
-
-		vkCmdBindDescriptorSets(offScreenCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
-		// Skysphere
-		vkCmdBindPipeline(offScreenCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.skysphere);
-		models.skysphere.draw(offScreenCmdBuffer);
-
-		// Terrain
-		vkCmdBindPipeline(offScreenCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.triangle);
-		//vkCmdBindVertexBuffers(drawCmdBuffers[i], 0, 1, &vertices.buffer, offsets);
-		//vkCmdDraw(drawCmdBuffers[i], vertices.count, 1, 0, 0);
-		for (int chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
-			if (frustumCheck((voxelNS::chunkIndex_to_pos(chunkIndex) + glm::vec3(0.5)) * 16.0f, CHUNK_RAIDUS)) {
-				vkCmdBindVertexBuffers(offScreenCmdBuffer, 0, 1, &chunkListBuffer[chunkIndex]->vertices_per_chunk.buffer, offsets);
-				vkCmdDraw(offScreenCmdBuffer, chunkListBuffer[chunkIndex]->vertices_per_chunk.count, 1, 0, 0);
-				//vkCmdDrawIndirect(drawCmdBuffers[i], indirectCommandsBuffer.buffer, chunkIndex * sizeof(VkDrawIndirectCommand), 1, sizeof(VkDrawIndirectCommand));
-			}
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[frameSlot].gBuffers, 0, nullptr);
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, lightVolumes.pipeline);
+		vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &lightVolumes.sphere.buffer, offsets);
+		vkCmdDraw(cmdBuffer, lightVolumes.sphereVertexCount, static_cast<uint32_t>(lights.size()), 0, 0);
+		vkCmdEndRenderPass(cmdBuffer);
+	}
+	// Reduces the G-buffer depth into the pyramid, level by level. The depth attachment is left read only,
+	// the render pass after this one takes it from there.
+	void buildDepthPyramid(VkCommandBuffer cmdBuffer)
+	{
+		VkImageMemoryBarrier depthBarrier = vks::initializers::imageMemoryBarrier();
+		depthBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		depthBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		depthBarrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+		depthBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+		depthBarrier.image = offScreenFrameBuf.depth.image;
+		depthBarrier.subresourceRange = { depthAspectMask(offScreenFrameBuf.depth.format), 0, 1, 0, 1 };
+		// Also keeps the pyramid from being overwritten while the culling pass before still reads it
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &depthBarrier);
+
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, depthPyramid.pipeline);
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		for (uint32_t level = 0; level < depthPyramid.levelCount; level++) {
+			uint32_t levelSize = std::max(depthPyramid.size >> level, 1u);
+			vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, depthPyramid.pipelineLayout, 0, 1, &depthPyramid.descriptorSets[level], 0, nullptr);
+			vkCmdDispatch(cmdBuffer, (levelSize + 7) / 8, (levelSize + 7) / 8, 1);
+			// The next level, or the culling pass, reads this one
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 		}
-		// Particle system (no index buffer)
-		vkCmdBindDescriptorSets(	offScreenCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets.particles, 0, nullptr);
-		vkCmdBindPipeline(			offScreenCmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.particles);
-		vkCmdBindVertexBuffers(		offScreenCmdBuffer, 0, 1, &particles.buffer, offsets);
-		vkCmdDraw(					offScreenCmdBuffer, particle_count, 1, 0, 0);
-		//////DRAW////////////
-		//////DRAW////////////
-
-		vkCmdEndRenderPass(offScreenCmdBuffer);
-
-		VK_CHECK_RESULT(vkEndCommandBuffer(offScreenCmdBuffer));
 	}
 
 	void loadAssets()
@@ -444,6 +1139,11 @@ public:
 		VK_CHECK_RESULT(vkCreateSampler(device, &samplerCreateInfo, nullptr, &textures.particles.sampler));
 	}
 	// Create a frame buffer attachment
+	// Aspects of a depth format from getSupportedDepthFormat, the combined formats also have stencil
+	VkImageAspectFlags depthAspectMask(VkFormat format)
+	{
+		return format >= VK_FORMAT_D16_UNORM_S8_UINT ? VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT : VK_IMAGE_ASPECT_DEPTH_BIT;
+	}
 	void createAttachment(
 		VkFormat format,
 		VkImageUsageFlagBits usage,
@@ -489,6 +1189,7 @@ public:
 		memAlloc.allocationSize = memReqs.size;
 		memAlloc.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 		VK_CHECK_RESULT(vkAllocateMemory(device, &memAlloc, nullptr, &attachment->mem));
+		memoryStrategy.track(MemoryCategory::GBuffer, memAlloc.memoryTypeIndex, attachment->mem, memReqs.size);
 		VK_CHECK_RESULT(vkBindImageMemory(device, attachment->image, attachment->mem, 0));
 
 		VkImageViewCreateInfo imageView = vks::initializers::imageViewCreateInfo();
@@ -510,20 +1211,15 @@ public:
 		offScreenFrameBuf.height = FB_DIM;
 
 		// Color attachments
+		// There is no position attachment, the composition reconstructs world positions from the depth
 
-		// (World space) Positions
+		// (World space) Normals, octahedral encoded into two channels
 		createAttachment(
-			VK_FORMAT_R16G16B16A16_SFLOAT,
-			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-			&offScreenFrameBuf.position);
-
-		// (World space) Normals
-		createAttachment(
-			VK_FORMAT_R16G16B16A16_SFLOAT,
+			VK_FORMAT_R16G16_SFLOAT,
 			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
 			&offScreenFrameBuf.normal);
 
-		// Albedo (color)
+		// Albedo (color), specular in alpha
 		createAttachment(
 			VK_FORMAT_R8G8B8A8_UNORM,
 			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
@@ -542,17 +1238,18 @@ public:
 			&offScreenFrameBuf.depth);
 
 		// Set up separate renderpass with references to the color and depth attachments
-		std::array<VkAttachmentDescription, 4> attachmentDescs = {};
+		std::array<VkAttachmentDescription, 3> attachmentDescs = {};
 
 		// Init attachment properties
-		for (uint32_t i = 0; i < 4; ++i)
+		// The first culling phase clears and draws, the second one draws on top of it (see lateRenderPass)
+		for (uint32_t i = 0; i < 3; ++i)
 		{
 			attachmentDescs[i].samples = VK_SAMPLE_COUNT_1_BIT;
 			attachmentDescs[i].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 			attachmentDescs[i].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 			attachmentDescs[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 			attachmentDescs[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-			if (i == 3)
+			if (i == 2)
 			{
 				attachmentDescs[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 				attachmentDescs[i].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
@@ -560,23 +1257,21 @@ public:
 			else
 			{
 				attachmentDescs[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-				attachmentDescs[i].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+				attachmentDescs[i].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 			}
 		}
 
 		// Formats
-		attachmentDescs[0].format = offScreenFrameBuf.position.format;
-		attachmentDescs[1].format = offScreenFrameBuf.normal.format;
-		attachmentDescs[2].format = offScreenFrameBuf.albedo.format;
-		attachmentDescs[3].format = offScreenFrameBuf.depth.format;
+		attachmentDescs[0].format = offScreenFrameBuf.normal.format;
+		attachmentDescs[1].format = offScreenFrameBuf.albedo.format;
+		attachmentDescs[2].format = offScreenFrameBuf.depth.format;
 
 		std::vector<VkAttachmentReference> colorReferences;
 		colorReferences.push_back({ 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
 		colorReferences.push_back({ 1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
-		colorReferences.push_back({ 2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
 
 		VkAttachmentReference depthReference = {};
-		depthReference.attachment = 3;
+		depthReference.attachment = 2;
 		depthReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
 		VkSubpassDescription subpass = {};
@@ -586,15 +1281,18 @@ public:
 		subpass.pDepthStencilAttachment = &depthReference;
 
 		// Use subpass dependencies for attachment layout transitions
+		// Both render passes use the same ones, so that either is compatible with the secondary command
+		// buffers. Before: the last frame's composition reads the attachments, the first phase writes
+		// them, the depth pyramid reads the depth.
 		std::array<VkSubpassDependency, 2> dependencies;
 
 		dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
 		dependencies[0].dstSubpass = 0;
-		dependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-		dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-		dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-		dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+		dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+		dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		dependencies[0].dependencyFlags = 0;
 
 		dependencies[1].srcSubpass = 0;
 		dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
@@ -615,11 +1313,19 @@ public:
 
 		VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &offScreenFrameBuf.renderPass));
 
-		std::array<VkImageView, 4> attachments;
-		attachments[0] = offScreenFrameBuf.position.view;
-		attachments[1] = offScreenFrameBuf.normal.view;
-		attachments[2] = offScreenFrameBuf.albedo.view;
-		attachments[3] = offScreenFrameBuf.depth.view;
+		// Second culling phase: keeps what the first one drew, the depth comes from the pyramid build
+		for (uint32_t i = 0; i < 3; ++i)
+		{
+			attachmentDescs[i].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+			attachmentDescs[i].initialLayout = i == 2 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			attachmentDescs[i].finalLayout = i == 2 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		}
+		VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &offScreenFrameBuf.lateRenderPass));
+
+		std::array<VkImageView, 3> attachments;
+		attachments[0] = offScreenFrameBuf.normal.view;
+		attachments[1] = offScreenFrameBuf.albedo.view;
+		attachments[2] = offScreenFrameBuf.depth.view;
 
 		VkFramebufferCreateInfo fbufCreateInfo = {};
 		fbufCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
@@ -683,20 +1389,26 @@ public:
 
 		particles.size = particleBuffer.size() * sizeof(Particle);
 
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			particles.size,
-			&particles.buffer,
-			&particles.memory,
-			particleBuffer.data()));
-
-		// Map the memory and store the pointer for reuse
-		VK_CHECK_RESULT(vkMapMemory(device, particles.memory, 0, particles.size, 0, &particles.mappedMemory));
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			VkMemoryPropertyFlags particleMemoryFlags;
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Particles,
+				particles.size,
+				&particles.buffer[frameSlot],
+				&particles.memory[frameSlot],
+				particleMemoryFlags));
+
+			// Map the memory and store the pointer for reuse
+			VK_CHECK_RESULT(vkMapMemory(device, particles.memory[frameSlot], 0, particles.size, 0, &particles.mappedMemory[frameSlot]));
+			memcpy(particles.mappedMemory[frameSlot], particleBuffer.data(), particles.size);
+		}
 	}
 
 
-	void updateUniformBuffer()
+	// Written every frame into the frame slot's buffers, beginFrame has waited for the slot's last frame
+	void updateUniformBuffer(uint32_t frameSlot)
 	{
 		// Voxel Terrain / Tessellation
 		uniformData.projection = camera.matrices.perspective;
@@ -707,45 +1419,73 @@ public:
 			frustum.update(uniformData.projection * uniformData.view);
 			memcpy(uniformData.frustumPlanes, frustum.planes.data(), sizeof(glm::vec4) * 6);
 		}
-		memcpy(uniformBuffer.mapped, &uniformData, sizeof(uniformData));
+		memcpy(uniformBuffer[frameSlot].mapped, &uniformData, sizeof(uniformData));
 
 		// Particle system fire
 		uboFire.projection = camera.matrices.perspective;
 		uboFire.modelView = camera.matrices.view;
 		uboFire.viewportDim = glm::vec2((float)width, (float)height);
-		memcpy(uniformBuffers.fire.mapped, &uboFire, sizeof(uboFire));
+		memcpy(uniformBuffers[frameSlot].fire.mapped, &uboFire, sizeof(uboFire));
+	}
+	// Ages the hit lights by the frame time and drops the ones that have faded out
+	void updateHitLights()
+	{
+		for (HitLight& hitLight : hitLights) {
+			hitLight.age += frameTimer;
+		}
+		while (!hitLights.empty() && hitLights.front().age >= hitLightLifetime) {
+			hitLights.pop_front();
+		}
 	}
-	// Update lights and parameters passed to the composition shaders
-	void updateUniformBufferComposition()
+	// Update lights and parameters passed to the composition shaders, into the frame slot's buffers after
+	// updateUniformBuffer
+	void updateUniformBufferComposition(uint32_t frameSlot)
 	{
+		lights.clear();
+		for (const HitLight& hitLight : hitLights) {
+			float fade = 1.0f - hitLight.age / hitLightLifetime;
+			lights.push_back({ glm::vec4(-hitLight.position, 0.0f), hitLight.color * fade, hitLightRadius });
+		}
 		// White
-		uboComposition.lights[33].position = glm::vec4(-camera.position, 0.0f);
-		uboComposition.lights[33].color = glm::vec3(1.0f, 0.95f, 0.84f);
-		uboComposition.lights[33].radius = 20.0f;
-
-		int index = 0;
-		for (int i = 0; i < max_emitters_count; i++) {
-			uboComposition.lights[i].position = glm::vec4(-emitter_positions[i], 0.0f);
-			uboComposition.lights[i].color = colors[index];
-			uboComposition.lights[i].radius = 125.0f;
-			if (colors.size() - 1 == index) {
-				index = 0;
-			}
-			else {
-				index++;
-			}
+		lights.push_back({ glm::vec4(-camera.position, 0.0f), glm::vec3(1.0f, 0.95f, 0.84f), 20.0f });
+		if (lights.size() > lightCapacity[frameSlot]) {
+			growLightBuffer(frameSlot, static_cast<uint32_t>(lights.size()));
 		}
-		uboComposition.lights[32].position = glm::vec4(-emitter_positions[lastHitPositionIndex], 0.0f);
-		uboComposition.lights[32].color = glm::vec3(0.03f, 0.87f, 1.0f);
-		uboComposition.lights[32].radius = 30.0f;
-		
+		memcpy(lightBuffer[frameSlot].mapped, lights.data(), lights.size() * sizeof(Light));
 
 		// Current view position
 		uboComposition.viewPos = glm::vec4(-camera.position, 0.0f);// *glm::vec4(-1.0f, 1.0f, -1.0f, 1.0f);
+		// The composition reconstructs positions with the camera the G-buffer was drawn with
+		uboComposition.inverseViewProjection = glm::inverse(uniformData.projection * uniformData.view);
 
 		uboComposition.debugDisplayTarget = debugDisplayTarget;
+		uboComposition.lightingMode = lightingMode;
 
-		memcpy(uniformBuffers.composition.mapped, &uboComposition, sizeof(uboComposition));
+		memcpy(uniformBuffers[frameSlot].composition.mapped, &uboComposition, sizeof(uboComposition));
+	}
+	// Host visible, written in place by updateUniformBufferComposition
+	void createLightBuffer(uint32_t frameSlot, uint32_t capacity)
+	{
+		VK_CHECK_RESULT(memoryStrategy.createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			MemoryUsage::Dynamic,
+			MemoryCategory::Uniforms,
+			&lightBuffer[frameSlot],
+			capacity * sizeof(Light)));
+		VK_CHECK_RESULT(lightBuffer[frameSlot].map());
+		lightCapacity[frameSlot] = capacity;
+	}
+	// Called once the frame slot's last frame has finished, so none of the slot's descriptor sets is in use.
+	// The old buffer is released through the deletion queue like every buffer a frame has read.
+	void growLightBuffer(uint32_t frameSlot, uint32_t lightCount)
+	{
+		retireBuffer(lightBuffer[frameSlot]);
+		createLightBuffer(frameSlot, std::max(lightCount, lightCapacity[frameSlot] * 2));
+		std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+			vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &lightBuffer[frameSlot].descriptor),
+			vks::initializers::writeDescriptorSet(lightCulling.descriptorSet[frameSlot], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &lightBuffer[frameSlot].descriptor),
+		};
+		vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 	}
 	void updateParticles()
 	{
@@ -764,16 +1504,23 @@ public:
 			}
 			i++;
 		}
-		size_t size = particleBuffer.size() * sizeof(Particle);
-		memcpy(particles.mappedMemory, particleBuffer.data(), size);
+	}
+	// The frame slot's vertex buffer still holds the particles of the slot's last frame
+	void copyParticles(uint32_t frameSlot)
+	{
+		memcpy(particles.mappedMemory[frameSlot], particleBuffer.data(), particles.size);
 	}
 	void setupDescriptorPool()
 	{
 		std::vector<VkDescriptorPoolSize> poolSizes = {
-			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 6), // setLayoutBindings * number of descriptorSets
-			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 9),
+			// Per frame slot the terrain, particle and composition sets of the shared layout, the light
+			// culling set and the GPU culling set
+			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 8 * FRAMES_IN_FLIGHT),
+			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 14 * FRAMES_IN_FLIGHT + DEPTH_PYRAMID_MAX_LEVELS),
+			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 15 * FRAMES_IN_FLIGHT), // GPU culling, lights and their tiles
+			vks::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, DEPTH_PYRAMID_MAX_LEVELS), // depth pyramid levels
 		};
-		VkDescriptorPoolCreateInfo descriptorPoolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 3);
+		VkDescriptorPoolCreateInfo descriptorPoolInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 5 * FRAMES_IN_FLIGHT + DEPTH_PYRAMID_MAX_LEVELS);
 		VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool));
 	}
 	void setupDescriptorSetLayout()
@@ -790,6 +1537,12 @@ public:
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 3),
 			// Binding 4 : Fragment shader uniform buffer
 			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 4),
+			// Binding 5 : Composition lights, also placing the light volumes
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 5),
+			// Binding 6 : Lights per screen tile
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 6),
+			// Binding 7 : Sum of the light volumes
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 7),
 		};
 		VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
 		VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &descriptorSetLayout));
@@ -797,25 +1550,12 @@ public:
 		VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(&descriptorSetLayout, 1);
 		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &pipelineLayout));
 	}
+	// One set of each per frame slot, reading the slot's uniform and light buffers
 	void setupDescriptorSet()
 	{
 		std::vector<VkWriteDescriptorSet> writeDescriptorSets;
 		VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(descriptorPool, &descriptorSetLayout, 1);
 
-		// < Terrain >
-		VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet));
-		writeDescriptorSets = {
-			// Binding 0: Vertex shader uniform buffer
-			vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &uniformBuffer.descriptor),
-			// Binding 1: Color map
-			vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &textures.ground.colorMap.descriptor),
-			// Binding 2: Normal map
-			vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2, &textures.ground.normalMap.descriptor)
-		};
-		vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
-
-		// < Particles >
-		VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSets.particles));
 		// Image descriptor for the color map texture
 		VkDescriptorImageInfo texDescriptorFire =
 			vks::initializers::descriptorImageInfo(
@@ -823,22 +1563,7 @@ public:
 				textures.particles.fire.view,
 				VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
-		writeDescriptorSets = {
-			// Binding 0: Vertex shader uniform buffer
-			vks::initializers::writeDescriptorSet(descriptorSets.particles, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &uniformBuffers.fire.descriptor),
-			// Binding 1: Fire texture array
-			vks::initializers::writeDescriptorSet(descriptorSets.particles, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &texDescriptorFire)
-		};
-		vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
-
-		// < Deferred composition >
 		// Image descriptors for the offscreen color attachments
-		VkDescriptorImageInfo texDescriptorPosition =
-			vks::initializers::descriptorImageInfo(
-				colorSampler,
-				offScreenFrameBuf.position.view,
-				VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
 		VkDescriptorImageInfo texDescriptorNormal =
 			vks::initializers::descriptorImageInfo(
 				colorSampler,
@@ -851,18 +1576,44 @@ public:
 				offScreenFrameBuf.albedo.view,
 				VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
-		VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSets.gBuffers));
-		writeDescriptorSets = {
-			// Binding 1 : Position texture target
-			vks::initializers::writeDescriptorSet(descriptorSets.gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &texDescriptorPosition),
-			// Binding 2 : Normals texture target
-			vks::initializers::writeDescriptorSet(descriptorSets.gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2, &texDescriptorNormal),
-			// Binding 3 : Albedo texture target
-			vks::initializers::writeDescriptorSet(descriptorSets.gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3, &texDescriptorAlbedo),
-			// Binding 4 : Fragment shader uniform buffer
-			vks::initializers::writeDescriptorSet(descriptorSets.gBuffers, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 4, &uniformBuffers.composition.descriptor),
-		};
-		vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			// < Terrain >
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet[frameSlot]));
+			writeDescriptorSets = {
+				// Binding 0: Vertex shader uniform buffer
+				vks::initializers::writeDescriptorSet(descriptorSet[frameSlot], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &uniformBuffer[frameSlot].descriptor),
+				// Binding 1: Color map
+				vks::initializers::writeDescriptorSet(descriptorSet[frameSlot], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &textures.ground.colorMap.descriptor),
+				// Binding 2: Normal map
+				vks::initializers::writeDescriptorSet(descriptorSet[frameSlot], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2, &textures.ground.normalMap.descriptor)
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+			// < Particles >
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSets[frameSlot].particles));
+			writeDescriptorSets = {
+				// Binding 0: Vertex shader uniform buffer
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].particles, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &uniformBuffers[frameSlot].fire.descriptor),
+				// Binding 1: Fire texture array
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].particles, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &texDescriptorFire)
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+			// < Deferred composition >
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSets[frameSlot].gBuffers));
+			writeDescriptorSets = {
+				// Binding 1 : Depth, written by prepareLightCulling once its view exists
+				// Binding 2 : Normals texture target
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2, &texDescriptorNormal),
+				// Binding 3 : Albedo texture target
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3, &texDescriptorAlbedo),
+				// Binding 4 : Fragment shader uniform buffer
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 4, &uniformBuffers[frameSlot].composition.descriptor),
+				// Binding 5 : Composition lights
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &lightBuffer[frameSlot].descriptor),
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		}
 	}
 
 	void preparePipelines()
@@ -915,8 +1666,7 @@ public:
 		// Blend attachment states required for all color attachments
 		// This is important, as color write mask will otherwise be 0x0 and you
 		// won't see anything rendered to the attachment
-		std::array<VkPipelineColorBlendAttachmentState, 3> blendAttachmentStates = {
-			vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_FALSE),
+		std::array<VkPipelineColorBlendAttachmentState, 2> blendAttachmentStates = {
 			vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_FALSE),
 			vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_FALSE)
 		};
@@ -968,6 +1718,7 @@ public:
 			//inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
 
 			depthStencilState.depthWriteEnable = VK_TRUE;
+			// Keeps the triangles whose normal faces the camera, the normal cone test of cull.comp relies on it
 			rasterizationState.cullMode = VK_CULL_MODE_FRONT_BIT;
 			
 			VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCI, nullptr, &pipelines.triangle));
@@ -993,7 +1744,6 @@ public:
 		//pipelineCI.renderPass = renderPass;
 		//colorBlendState = vks::initializers::pipelineColorBlendStateCreateInfo(1, &blendAttachmentState);
 		blendAttachmentStates = {
-			vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_TRUE),
 			vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_TRUE),
 			vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_TRUE)
 		};
@@ -1021,16 +1771,11 @@ public:
 			// Don t' write to depth buffer
 			depthStencilState.depthWriteEnable = VK_FALSE;
 
-			// Premulitplied alpha
-			blendAttachmentStates[0].blendEnable = VK_TRUE;
-			blendAttachmentStates[0].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-			blendAttachmentStates[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-			blendAttachmentStates[0].colorBlendOp = VK_BLEND_OP_ADD;
-			blendAttachmentStates[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-			blendAttachmentStates[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-			blendAttachmentStates[0].alphaBlendOp = VK_BLEND_OP_ADD;
-			blendAttachmentStates[0].colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+			// The flames only add to the albedo, the normals below them are kept
+			blendAttachmentStates[0].blendEnable = VK_FALSE;
+			blendAttachmentStates[0].colorWriteMask = 0;
 
+			// Premulitplied alpha
 			blendAttachmentStates[1].blendEnable = VK_TRUE;
 			blendAttachmentStates[1].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
 			blendAttachmentStates[1].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
@@ -1040,15 +1785,6 @@ public:
 			blendAttachmentStates[1].alphaBlendOp = VK_BLEND_OP_ADD;
 			blendAttachmentStates[1].colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
 
-			blendAttachmentStates[2].blendEnable = VK_TRUE;
-			blendAttachmentStates[2].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-			blendAttachmentStates[2].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-			blendAttachmentStates[2].colorBlendOp = VK_BLEND_OP_ADD;
-			blendAttachmentStates[2].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-			blendAttachmentStates[2].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-			blendAttachmentStates[2].alphaBlendOp = VK_BLEND_OP_ADD;
-			blendAttachmentStates[2].colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-
 			colorBlendState.attachmentCount = static_cast<uint32_t>(blendAttachmentStates.size());
 			colorBlendState.pAttachments = blendAttachmentStates.data();
 
@@ -1058,27 +1794,552 @@ public:
 		}
 	}
 
+	// Depth pyramid image, one view and descriptor set per level and the reduction pipeline. Level 0 is
+	// half the G-buffer, so every texel holds the farthest of 2x2 depth samples; the image stays in the
+	// general layout, written and read by compute only.
+	void prepareDepthPyramid()
+	{
+		depthPyramid.size = offScreenFrameBuf.width / 2;
+		depthPyramid.levelCount = static_cast<uint32_t>(std::floor(std::log2(depthPyramid.size))) + 1;
+		assert(depthPyramid.levelCount <= DEPTH_PYRAMID_MAX_LEVELS);
+
+		VkImageCreateInfo image = vks::initializers::imageCreateInfo();
+		image.imageType = VK_IMAGE_TYPE_2D;
+		image.format = VK_FORMAT_R32_SFLOAT;
+		image.extent = { depthPyramid.size, depthPyramid.size, 1 };
+		image.mipLevels = depthPyramid.levelCount;
+		image.arrayLayers = 1;
+		image.samples = VK_SAMPLE_COUNT_1_BIT;
+		image.tiling = VK_IMAGE_TILING_OPTIMAL;
+		image.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		VK_CHECK_RESULT(vkCreateImage(device, &image, nullptr, &depthPyramid.image));
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(device, depthPyramid.image, &memReqs);
+		VkMemoryAllocateInfo memAlloc = vks::initializers::memoryAllocateInfo();
+		memAlloc.allocationSize = memReqs.size;
+		memAlloc.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		VK_CHECK_RESULT(vkAllocateMemory(device, &memAlloc, nullptr, &depthPyramid.memory));
+		memoryStrategy.track(MemoryCategory::GBuffer, memAlloc.memoryTypeIndex, depthPyramid.memory, memReqs.size);
+		VK_CHECK_RESULT(vkBindImageMemory(device, depthPyramid.image, depthPyramid.memory, 0));
+
+		VkImageViewCreateInfo imageView = vks::initializers::imageViewCreateInfo();
+		imageView.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		imageView.format = VK_FORMAT_R32_SFLOAT;
+		imageView.image = depthPyramid.image;
+		imageView.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, depthPyramid.levelCount, 0, 1 };
+		VK_CHECK_RESULT(vkCreateImageView(device, &imageView, nullptr, &depthPyramid.view));
+		depthPyramid.levelViews.resize(depthPyramid.levelCount);
+		for (uint32_t level = 0; level < depthPyramid.levelCount; level++) {
+			imageView.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 };
+			VK_CHECK_RESULT(vkCreateImageView(device, &imageView, nullptr, &depthPyramid.levelViews[level]));
+		}
+		// Sampled views may only have one aspect, the stencil of the G-buffer depth is left out
+		imageView.format = offScreenFrameBuf.depth.format;
+		imageView.image = offScreenFrameBuf.depth.image;
+		imageView.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+		VK_CHECK_RESULT(vkCreateImageView(device, &imageView, nullptr, &depthPyramid.depthView));
+
+		// Only read with texelFetch, filtering does not matter
+		VkSamplerCreateInfo sampler = vks::initializers::samplerCreateInfo();
+		sampler.magFilter = VK_FILTER_NEAREST;
+		sampler.minFilter = VK_FILTER_NEAREST;
+		sampler.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+		sampler.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		sampler.addressModeV = sampler.addressModeU;
+		sampler.addressModeW = sampler.addressModeU;
+		sampler.maxAnisotropy = 1.0f;
+		sampler.minLod = 0.0f;
+		sampler.maxLod = (float)depthPyramid.levelCount;
+		VK_CHECK_RESULT(vkCreateSampler(device, &sampler, nullptr, &depthPyramid.sampler));
+
+		VkCommandBuffer layoutCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		vks::tools::setImageLayout(layoutCmd, depthPyramid.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, { VK_IMAGE_ASPECT_COLOR_BIT, 0, depthPyramid.levelCount, 0, 1 });
+		vulkanDevice->flushCommandBuffer(layoutCmd, queue, true);
+
+		std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+			// Binding 0: Level above, the G-buffer depth for level 0
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+			// Binding 1: Level written
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+		};
+		VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
+		VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &depthPyramid.descriptorSetLayout));
+		VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(&depthPyramid.descriptorSetLayout, 1);
+		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &depthPyramid.pipelineLayout));
+
+		depthPyramid.descriptorSets.resize(depthPyramid.levelCount);
+		for (uint32_t level = 0; level < depthPyramid.levelCount; level++) {
+			VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(descriptorPool, &depthPyramid.descriptorSetLayout, 1);
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &depthPyramid.descriptorSets[level]));
+			VkDescriptorImageInfo input = level == 0 ?
+				vks::initializers::descriptorImageInfo(depthPyramid.sampler, depthPyramid.depthView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL) :
+				vks::initializers::descriptorImageInfo(depthPyramid.sampler, depthPyramid.levelViews[level - 1], VK_IMAGE_LAYOUT_GENERAL);
+			VkDescriptorImageInfo output = vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, depthPyramid.levelViews[level], VK_IMAGE_LAYOUT_GENERAL);
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+				vks::initializers::writeDescriptorSet(depthPyramid.descriptorSets[level], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &input),
+				vks::initializers::writeDescriptorSet(depthPyramid.descriptorSets[level], VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &output),
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		}
+
+		VkComputePipelineCreateInfo computePipelineCreateInfo = vks::initializers::computePipelineCreateInfo(depthPyramid.pipelineLayout, 0);
+		computePipelineCreateInfo.stage = loadShader(getShadersPath() + "deferred_marching_cube/depthreduce.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+		VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &depthPyramid.pipeline));
+	}
+	// Tile buffer, uniform buffer and compute pipeline of the light culling pass. The G-buffer depth is read
+	// through the depth pyramid's depth view, which the last pyramid build of a frame leaves read only.
+	void prepareLightCulling()
+	{
+		lightCulling.tileCountX = (offScreenFrameBuf.width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		lightCulling.tileCountY = (offScreenFrameBuf.height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		VK_CHECK_RESULT(memoryStrategy.createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			MemoryUsage::GpuOnly,
+			MemoryCategory::Other,
+			&lightCulling.tileBuffer,
+			(VkDeviceSize)lightCulling.tileCountX * lightCulling.tileCountY * (MAX_LIGHTS_PER_TILE + 1) * sizeof(uint32_t)));
+		for (vks::Buffer& cullingUniforms : lightCulling.uniformBuffer) {
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Uniforms,
+				&cullingUniforms,
+				sizeof(LightCullingUniforms)));
+			VK_CHECK_RESULT(cullingUniforms.map());
+		}
+		for (vks::Buffer& overflow : lightCulling.overflowBuffer) {
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Other,
+				&overflow,
+				sizeof(uint32_t)));
+			VK_CHECK_RESULT(overflow.map());
+			*static_cast<uint32_t*>(overflow.mapped) = 0;
+		}
+
+		std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+			// Binding 0: G-buffer depth
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+			// Binding 1: Camera and light count
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+			// Binding 2: Lights
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+			// Binding 3: Lights per tile output
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3),
+			// Binding 4: Overflowing tile count
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4),
+		};
+		VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
+		VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &lightCulling.descriptorSetLayout));
+		VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(&lightCulling.descriptorSetLayout, 1);
+		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &lightCulling.pipelineLayout));
+
+		VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(descriptorPool, &lightCulling.descriptorSetLayout, 1);
+		VkDescriptorImageInfo depthDescriptor = vks::initializers::descriptorImageInfo(depthPyramid.sampler, depthPyramid.depthView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			VkDescriptorSet& descriptorSet = lightCulling.descriptorSet[frameSlot];
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet));
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &depthDescriptor),
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, &lightCulling.uniformBuffer[frameSlot].descriptor),
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &lightBuffer[frameSlot].descriptor),
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &lightCulling.tileBuffer.descriptor),
+				vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &lightCulling.overflowBuffer[frameSlot].descriptor),
+				// Binding 1 of the composition: the depth it reconstructs positions from, 6: the tiles it reads
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, &depthDescriptor),
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &lightCulling.tileBuffer.descriptor),
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		}
+
+		VkComputePipelineCreateInfo computePipelineCreateInfo = vks::initializers::computePipelineCreateInfo(lightCulling.pipelineLayout, 0);
+		computePipelineCreateInfo.stage = loadShader(getShadersPath() + "deferred_marching_cube/lightcull.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+		VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &lightCulling.pipeline));
+	}
+	// Lighting target, render pass, sphere and pipeline of the light volume mode, and the timestamp queries
+	// of both lighting modes. The G-buffer depth is attached read only, as the last pyramid build of a
+	// frame leaves it.
+	void prepareLightVolumes()
+	{
+		createAttachment(
+			VK_FORMAT_R16G16B16A16_SFLOAT,
+			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+			&lightVolumes.accumulation);
+		// The composition's descriptor refers to the target in either mode
+		VkCommandBuffer layoutCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		vks::tools::setImageLayout(layoutCmd, lightVolumes.accumulation.image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		vulkanDevice->flushCommandBuffer(layoutCmd, queue, true);
+
+		std::array<VkAttachmentDescription, 2> attachmentDescs = {};
+		attachmentDescs[0].format = lightVolumes.accumulation.format;
+		attachmentDescs[0].samples = VK_SAMPLE_COUNT_1_BIT;
+		attachmentDescs[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		attachmentDescs[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		attachmentDescs[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachmentDescs[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachmentDescs[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		attachmentDescs[0].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		attachmentDescs[1].format = offScreenFrameBuf.depth.format;
+		attachmentDescs[1].samples = VK_SAMPLE_COUNT_1_BIT;
+		attachmentDescs[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+		attachmentDescs[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		attachmentDescs[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachmentDescs[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachmentDescs[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+		attachmentDescs[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+		VkAttachmentReference colorReference = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+		VkAttachmentReference depthReference = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL };
+		VkSubpassDescription subpass = {};
+		subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpass.colorAttachmentCount = 1;
+		subpass.pColorAttachments = &colorReference;
+		subpass.pDepthStencilAttachment = &depthReference;
+
+		// Before: the G-buffer passes write the attachments read here, the last frame's composition reads
+		// the lighting target. After: this frame's composition reads it.
+		std::array<VkSubpassDependency, 2> dependencies;
+		dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+		dependencies[0].dstSubpass = 0;
+		dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependencies[0].dependencyFlags = 0;
+		dependencies[1].srcSubpass = 0;
+		dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+		dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		dependencies[1].dependencyFlags = 0;
+
+		VkRenderPassCreateInfo renderPassInfo = {};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+		renderPassInfo.pAttachments = attachmentDescs.data();
+		renderPassInfo.attachmentCount = static_cast<uint32_t>(attachmentDescs.size());
+		renderPassInfo.subpassCount = 1;
+		renderPassInfo.pSubpasses = &subpass;
+		renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+		renderPassInfo.pDependencies = dependencies.data();
+		VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &lightVolumes.renderPass));
+
+		std::array<VkImageView, 2> attachments = { lightVolumes.accumulation.view, offScreenFrameBuf.depth.view };
+		VkFramebufferCreateInfo fbufCreateInfo = {};
+		fbufCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		fbufCreateInfo.renderPass = lightVolumes.renderPass;
+		fbufCreateInfo.pAttachments = attachments.data();
+		fbufCreateInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+		fbufCreateInfo.width = offScreenFrameBuf.width;
+		fbufCreateInfo.height = offScreenFrameBuf.height;
+		fbufCreateInfo.layers = 1;
+		VK_CHECK_RESULT(vkCreateFramebuffer(device, &fbufCreateInfo, nullptr, &lightVolumes.frameBuffer));
+
+		// Unit sphere in rings and segments, pushed out so that every face lies outside the unit sphere.
+		// Wound counter-clockwise seen from outside.
+		const int rings = 6;
+		const int segments = 8;
+		float scale = 1.0f / (std::cos(float(M_PI) / segments) * std::cos(float(M_PI) / (2 * rings)));
+		auto spherePoint = [&](int ring, int segment) {
+			float theta = float(M_PI) * ring / rings;
+			float phi = 2.0f * float(M_PI) * segment / segments;
+			return scale * glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+		};
+		std::vector<glm::vec3> sphereVertices;
+		for (int ring = 0; ring < rings; ring++) {
+			for (int segment = 0; segment < segments; segment++) {
+				glm::vec3 quad[4] = { spherePoint(ring, segment), spherePoint(ring + 1, segment), spherePoint(ring + 1, segment + 1), spherePoint(ring, segment + 1) };
+				// The quads at the poles are triangles
+				if (ring > 0) {
+					sphereVertices.insert(sphereVertices.end(), { quad[0], quad[2], quad[1] });
+				}
+				if (ring < rings - 1) {
+					sphereVertices.insert(sphereVertices.end(), { quad[0], quad[3], quad[2] });
+				}
+			}
+		}
+		lightVolumes.sphereVertexCount = static_cast<uint32_t>(sphereVertices.size());
+		VK_CHECK_RESULT(memoryStrategy.createBuffer(
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			MemoryUsage::GpuOnly,
+			MemoryCategory::Other,
+			&lightVolumes.sphere,
+			sphereVertices.size() * sizeof(glm::vec3),
+			sphereVertices.data()));
+
+		// The sphere's far side only: the projection is not flipped, so in the framebuffer the faces
+		// turned to the camera are clockwise, back faces for VK_FRONT_FACE_COUNTER_CLOCKWISE (as the full
+		// screen triangle of the composition). Pixels whose geometry lies behind the far side fail the
+		// depth test, the camera may be inside the sphere.
+		VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = vks::initializers::pipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, 0, VK_FALSE);
+		VkPipelineRasterizationStateCreateInfo rasterizationState = vks::initializers::pipelineRasterizationStateCreateInfo(VK_POLYGON_MODE_FILL, VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE, 0);
+		VkPipelineColorBlendAttachmentState blendAttachmentState = vks::initializers::pipelineColorBlendAttachmentState(0xf, VK_TRUE);
+		blendAttachmentState.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.colorBlendOp = VK_BLEND_OP_ADD;
+		blendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachmentState.alphaBlendOp = VK_BLEND_OP_ADD;
+		VkPipelineColorBlendStateCreateInfo colorBlendState = vks::initializers::pipelineColorBlendStateCreateInfo(1, &blendAttachmentState);
+		VkPipelineDepthStencilStateCreateInfo depthStencilState = vks::initializers::pipelineDepthStencilStateCreateInfo(VK_TRUE, VK_FALSE, VK_COMPARE_OP_GREATER_OR_EQUAL);
+		VkPipelineViewportStateCreateInfo viewportState = vks::initializers::pipelineViewportStateCreateInfo(1, 1, 0);
+		VkPipelineMultisampleStateCreateInfo multisampleState = vks::initializers::pipelineMultisampleStateCreateInfo(VK_SAMPLE_COUNT_1_BIT, 0);
+		std::vector<VkDynamicState> dynamicStateEnables = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+		VkPipelineDynamicStateCreateInfo dynamicState = vks::initializers::pipelineDynamicStateCreateInfo(dynamicStateEnables);
+		VkVertexInputBindingDescription bindingDescription = vks::initializers::vertexInputBindingDescription(0, sizeof(glm::vec3), VK_VERTEX_INPUT_RATE_VERTEX);
+		VkVertexInputAttributeDescription attributeDescription = vks::initializers::vertexInputAttributeDescription(0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0);
+		VkPipelineVertexInputStateCreateInfo vertexInputState = vks::initializers::pipelineVertexInputStateCreateInfo();
+		vertexInputState.vertexBindingDescriptionCount = 1;
+		vertexInputState.pVertexBindingDescriptions = &bindingDescription;
+		vertexInputState.vertexAttributeDescriptionCount = 1;
+		vertexInputState.pVertexAttributeDescriptions = &attributeDescription;
+		std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages = {
+			loadShader(getShadersPath() + "deferred_marching_cube/lightvolume.vert.spv", VK_SHADER_STAGE_VERTEX_BIT),
+			loadShader(getShadersPath() + "deferred_marching_cube/lightvolume.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT),
+		};
+		VkGraphicsPipelineCreateInfo pipelineCI = vks::initializers::pipelineCreateInfo(pipelineLayout, lightVolumes.renderPass);
+		pipelineCI.pVertexInputState = &vertexInputState;
+		pipelineCI.pInputAssemblyState = &inputAssemblyState;
+		pipelineCI.pRasterizationState = &rasterizationState;
+		pipelineCI.pColorBlendState = &colorBlendState;
+		pipelineCI.pMultisampleState = &multisampleState;
+		pipelineCI.pViewportState = &viewportState;
+		pipelineCI.pDepthStencilState = &depthStencilState;
+		pipelineCI.pDynamicState = &dynamicState;
+		pipelineCI.stageCount = static_cast<uint32_t>(shaderStages.size());
+		pipelineCI.pStages = shaderStages.data();
+		VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCI, nullptr, &lightVolumes.pipeline));
+
+		// The volumes are placed with the terrain's matrices, the composition reads the target
+		VkDescriptorImageInfo accumulationDescriptor = vks::initializers::descriptorImageInfo(colorSampler, lightVolumes.accumulation.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &uniformBuffer[frameSlot].descriptor),
+				vks::initializers::writeDescriptorSet(descriptorSets[frameSlot].gBuffers, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 7, &accumulationDescriptor),
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		}
+
+		if (deviceProperties.limits.timestampComputeAndGraphics) {
+			VkQueryPoolCreateInfo queryPoolInfo = {};
+			queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			queryPoolInfo.queryCount = 4 * FRAMES_IN_FLIGHT;
+			VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &lightingQueryPool));
+		}
+	}
+	// Buffers and compute pipeline of the GPU culling pass: cull.comp skips chunks without a solid voxel,
+	// tests every other chunk's bounding sphere against the frustum and its box against the depth pyramid,
+	// then every meshlet of a visible chunk against the frustum and its normal cone, and packs a draw
+	// command per visible meshlet
+	void prepareIndirectCulling()
+	{
+		VK_CHECK_RESULT(memoryStrategy.createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			MemoryUsage::GpuOnly,
+			MemoryCategory::Other,
+			&cullVisibilityBuffer,
+			CHUNK_COUNT * sizeof(uint32_t)));
+		if (drawIndirectCountSupported) {
+			cmdDrawIndirectCount = reinterpret_cast<PFN_vkCmdDrawIndirectCountKHR>(vkGetDeviceProcAddr(device, "vkCmdDrawIndirectCountKHR"));
+			drawIndirectCountSupported = cmdDrawIndirectCount != nullptr;
+		}
+
+		std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+			// Binding 0: Instance input data buffer
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+			// Binding 1: Indirect draw command output buffer
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+			// Binding 2: Uniform buffer with the frustum planes
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+			// Binding 3: Indirect draw count output buffer
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3),
+			// Binding 4: Depth pyramid
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 4),
+			// Binding 5: Chunks drawn by the first phase
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5),
+			// Binding 6: Meshlets of every chunk
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6),
+			// Binding 7: Occupied chunks and chunk groups
+			vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7),
+		};
+		VkDescriptorSetLayoutCreateInfo descriptorLayout = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
+		VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &cull.descriptorSetLayout));
+
+		// Camera of the pyramid and its position, number of instances (the last work group is partial), draw
+		// slots per region, the phase and which tests run
+		VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(CullPushConstants), 0);
+		VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(&cull.descriptorSetLayout, 1);
+		pipelineLayoutCI.pushConstantRangeCount = 1;
+		pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &cull.pipelineLayout));
+
+		VkDescriptorSetAllocateInfo allocInfo = vks::initializers::descriptorSetAllocateInfo(descriptorPool, &cull.descriptorSetLayout, 1);
+		VkDescriptorImageInfo pyramidDescriptor = vks::initializers::descriptorImageInfo(depthPyramid.sampler, depthPyramid.view, VK_IMAGE_LAYOUT_GENERAL);
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			CullFrame& frame = cullFrames[frameSlot];
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Other,
+				&frame.instanceBuffer,
+				CHUNK_COUNT * sizeof(InstanceData)));
+			// Host visible so the statistics can read back the counts of the slot's last frame
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Other,
+				&frame.indirectDrawCountBuffer,
+				(2 * REGION_COUNT + 4) * sizeof(uint32_t)));
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Other,
+				&frame.occupancyBuffer,
+				sizeof(OccupancyBits)));
+			createMeshletBuffer(frame, CHUNK_COUNT * 16);
+			createIndirectCommandsBuffer(frame);
+			VK_CHECK_RESULT(frame.instanceBuffer.map());
+			VK_CHECK_RESULT(frame.occupancyBuffer.map());
+			VK_CHECK_RESULT(frame.indirectDrawCountBuffer.map());
+
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &frame.descriptorSet));
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0, &frame.instanceBuffer.descriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, &frame.indirectCommandsBuffer.descriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2, &uniformBuffer[frameSlot].descriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &frame.indirectDrawCountBuffer.descriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4, &pyramidDescriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &cullVisibilityBuffer.descriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &frame.meshletBuffer.descriptor),
+				vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &frame.occupancyBuffer.descriptor),
+			};
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		}
+
+		VkComputePipelineCreateInfo computePipelineCreateInfo = vks::initializers::computePipelineCreateInfo(cull.pipelineLayout, 0);
+		computePipelineCreateInfo.stage = loadShader(getShadersPath() + "deferred_marching_cube/cull.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+		VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &cull.pipeline));
+	}
+	// Host visible, written by updateCullFrame
+	void createMeshletBuffer(CullFrame& frame, uint32_t capacity)
+	{
+		VK_CHECK_RESULT(memoryStrategy.createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			MemoryUsage::Dynamic,
+			MemoryCategory::Other,
+			&frame.meshletBuffer,
+			capacity * sizeof(Meshlet)));
+		VK_CHECK_RESULT(frame.meshletBuffer.map());
+		frame.meshletCapacity = capacity;
+	}
+	// Both culling phases' slices at the current regionSlotCount
+	void createIndirectCommandsBuffer(CullFrame& frame)
+	{
+		VK_CHECK_RESULT(memoryStrategy.createBuffer(
+			VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			MemoryUsage::GpuOnly,
+			MemoryCategory::Other,
+			&frame.indirectCommandsBuffer,
+			2 * REGION_COUNT * regionSlotCount * sizeof(VkDrawIndirectCommand)));
+		frame.commandSlotCount = regionSlotCount;
+	}
+	// Released once every frame that could still use the buffer has retired
+	void retireBuffer(vks::Buffer& buffer)
+	{
+		vks::Buffer retired = buffer;
+		deletionQueue.push([this, retired]() mutable { memoryStrategy.destroyBuffer(retired); });
+		buffer = vks::Buffer();
+	}
+	// Brings the frame slot's instances and meshlets up to the current indirect data, growing its buffers
+	// first when the terrain has more meshlets or draw slots than they hold. Called once the slot's last
+	// frame has finished, so neither its buffers nor its descriptor set are in use by the GPU.
+	void updateCullFrame(uint32_t frameSlot)
+	{
+		CullFrame& frame = cullFrames[frameSlot];
+		if (frame.indirectDataVersion == indirectDataVersion) {
+			return;
+		}
+		std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+		if (meshletCount > frame.meshletCapacity) {
+			uint32_t capacity = std::max(meshletCount, frame.meshletCapacity * 2);
+			retireBuffer(frame.meshletBuffer);
+			createMeshletBuffer(frame, capacity);
+			writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &frame.meshletBuffer.descriptor));
+		}
+		if (frame.commandSlotCount != regionSlotCount) {
+			retireBuffer(frame.indirectCommandsBuffer);
+			createIndirectCommandsBuffer(frame);
+			writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, &frame.indirectCommandsBuffer.descriptor));
+		}
+		if (!writeDescriptorSets.empty()) {
+			vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		}
+		InstanceData* instances = static_cast<InstanceData*>(frame.instanceBuffer.mapped);
+		Meshlet* meshlets = static_cast<Meshlet*>(frame.meshletBuffer.mapped);
+		uint32_t firstMeshlet = 0;
+		for (int chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
+			const Chunk* chunk = chunkListBuffer[chunkIndex];
+			const Vertices& vertices = chunk->vertices_per_chunk;
+			// Sphere around the mesh's own extents, the whole chunk's when there is nothing to draw
+			if (vertices.count) {
+				instances[chunkIndex].boundingSphere = glm::vec4((chunk->boundsMin + chunk->boundsMax) * 0.5f, glm::length(chunk->boundsMax - chunk->boundsMin) * 0.5f);
+				instances[chunkIndex].boundsMin = glm::vec4(chunk->boundsMin, 0.0f);
+				instances[chunkIndex].boundsMax = glm::vec4(chunk->boundsMax, 0.0f);
+			}
+			else {
+				instances[chunkIndex].boundingSphere = glm::vec4((voxelNS::chunkIndex_to_pos(chunkIndex) + glm::vec3(0.5f)) * (float)CHUNK_DIMENSION, CHUNK_RAIDUS);
+			}
+			instances[chunkIndex].vertexCount = vertices.count;
+			instances[chunkIndex].firstVertex = vertices.firstVertex;
+			instances[chunkIndex].region = chunkRegion(chunkIndex);
+			instances[chunkIndex].firstMeshlet = firstMeshlet;
+			instances[chunkIndex].meshletCount = 0;
+			if (vertices.count) {
+				instances[chunkIndex].meshletCount = static_cast<uint32_t>(chunk->meshlets.size());
+				memcpy(meshlets + firstMeshlet, chunk->meshlets.data(), chunk->meshlets.size() * sizeof(Meshlet));
+				firstMeshlet += instances[chunkIndex].meshletCount;
+			}
+		}
+		frame.indirectDataVersion = indirectDataVersion;
+	}
+	// Counts the meshlets per region, sizes the draw slots to the fullest region and refits the CPU culler
+	// to the changed bounds. Each frame slot's culling buffers catch up in updateCullFrame.
 	void updateIndirectData() {
+		meshletCount = 0;
+		for (TerrainRegion& region : terrainRegions) {
+			region.drawCapacity = 0;
+		}
 		for (int chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
-			indirectCommands[chunkIndex].vertexCount = chunkListBuffer[chunkIndex]->vertices_per_chunk.count;
-		}
-		vks::Buffer stagingBuffer;
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			&stagingBuffer,
-			indirectCommands.size() * sizeof(VkDrawIndirectCommand),
-			indirectCommands.data()));
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			&indirectCommandsBuffer,
-			stagingBuffer.size));
-		vulkanDevice->copyBuffer(&stagingBuffer, &indirectCommandsBuffer, queue);
+			const Chunk* chunk = chunkListBuffer[chunkIndex];
+			if (chunk->vertices_per_chunk.count) {
+				terrainRegions[chunkRegion(chunkIndex)].drawCapacity += static_cast<uint32_t>(chunk->meshlets.size());
+				meshletCount += static_cast<uint32_t>(chunk->meshlets.size());
+				chunkCuller.set_bounds(chunkCullerLeaf[chunkIndex], chunk->boundsMin, chunk->boundsMax);
+			}
+			else {
+				chunkCuller.clear_bounds(chunkCullerLeaf[chunkIndex]);
+			}
+		}
+		for (const TerrainRegion& region : terrainRegions) {
+			while (regionSlotCount < region.drawCapacity) {
+				regionSlotCount *= 2;
+			}
+		}
+		chunkCuller.update_hierarchy();
+		indirectDataVersion++;
+		indirectDataDirty = false;
+	}
+	// Called once per frame before draw: terrain changes only touch the culling input
+	void updateTerrainDraws() {
+		if (indirectDataDirty) {
+			updateIndirectData();
+		}
 	}
 	
-	void populate_chunk(Chunk* chunkBuffer, unsigned int index, std::vector<MarchingCube::Cell>& grid) {
-		glm::vec3 cellOffsets[8] = {
+	MarchingCube::Cell populate_cell(const uint8_t* voxel, uint64_t brick4Any, uint64_t brick4Full, unsigned int index, int x, int y, int z) {
+		static const glm::vec3 cellOffsets[8] = {
 			glm::vec3(0, 0, 0),	//0
 			glm::vec3(0, 1, 0),	//1
 			glm::vec3(1, 1, 0),	//2
@@ -1088,19 +2349,26 @@ public:
 			glm::vec3(1, 1, 1),	//6
 			glm::vec3(1, 0, 1),	//7
 		};
+		MarchingCube::Cell cell;
+		cell.val = 0;
+		cell.p = glm::vec3(x, y, z) + voxelNS::chunkIndex_to_pos(index) * (float) (CHUNK_DIMENSION);
+		// Cells inside empty or solid bricks need no voxel reads and produce no triangles
+		if (voxelNS::Cell_Uniform(brick4Any, brick4Full, x, y, z, cell.val)) {
+			return cell;
+		}
+		uint8_t presentBit = 1;
+		for (int i = 0; i < 8; i++) {
+			if (voxel[ voxelNS::return_voxelIndex(glm::vec3(x, y, z) + cellOffsets[i] )] & presentBit) {
+				cell.val |= (1 << i);
+			}
+		}
+		return cell;
+	}
+	void populate_chunk(Chunk* chunkBuffer, unsigned int index, std::vector<MarchingCube::Cell>& grid) {
 		for (int x = 0; x < CHUNK_DIMENSION - 1; x++) {
 			for (int y = 0; y < CHUNK_DIMENSION - 1; y++) {
 				for (int z = 0; z < CHUNK_DIMENSION - 1; z++) {
-					MarchingCube::Cell cell;
-					cell.val = 0;
-					cell.p = glm::vec3(x, y, z) + voxelNS::chunkIndex_to_pos(index) * (float) (CHUNK_DIMENSION);
-					uint8_t presentBit = 1;
-					for (int i = 0; i < 8; i++) {
-						if (chunkBuffer->voxel[ voxelNS::return_voxelIndex(glm::vec3(x, y, z) + cellOffsets[i] )] & presentBit) {
-							cell.val |= (1 << i);
-						}
-					}
-					grid.push_back(cell);
+					grid.push_back(populate_cell(chunkBuffer->voxel, occupancy.brick4Any[index], occupancy.brick4Full[index], index, x, y, z));
 				}
 			}
 		}
@@ -1110,41 +2378,42 @@ public:
 			Polygonise(*it, 0.5f, tri_list);
 		}
 	}
-	void populate_triangles_list_chunk(std::vector<MarchingCube::Cell>& grid, std::vector<MarchingCube::TRIANGLE>& tri_list) {
-		for (std::vector<MarchingCube::Cell>::iterator it = grid.begin(); it != grid.end(); ++it) {
-			Polygonise_Cell(*it, tri_list);
+	void populate_triangles_list_chunk(std::vector<MarchingCube::Cell>& grid, std::vector<MarchingCube::TRIANGLE>& tri_list, std::vector<uint8_t>& tri_count) {
+		tri_count.resize(grid.size());
+		for (size_t i = 0; i < grid.size(); i++) {
+			size_t before = tri_list.size();
+			Polygonise_Cell(grid[i], tri_list);
+			tri_count[i] = static_cast<uint8_t>(tri_list.size() - before);
 		}
 	}
-	void gen_vertex_buffers(std::vector<MarchingCube::TRIANGLE>& tri_list, std::vector<Vertex>& vertexBuffer) {
+	void gen_vertices(const MarchingCube::TRIANGLE& tri, std::vector<Vertex>& vertexBuffer) {
 		Vertex vertex;
 		glm::vec3 tri_point;
 		// in Vulkan, X -> -Z, Y -> X, Z -> -Y.
-		for (int i = 0; i < tri_list.size(); i++) {
-			tri_point = tri_list[i].p[0];
-			glm::vec3 A = tri_point;
-			tri_point = tri_list[i].p[1];
-			glm::vec3 B = tri_point;
-			tri_point = tri_list[i].p[2];
-			glm::vec3 C = tri_point;
-			vertex.normal = glm::normalize(glm::cross((B - A), (C - A)));
-			vertex.tangent = glm::normalize((C - B));
-
-			tri_point = tri_list[i].p[0];
-			vertex.pos = glm::vec3(tri_point.x, tri_point.y, tri_point.z);
-			vertexBuffer.push_back(vertex);
-
-			tri_point = tri_list[i].p[1];
-			vertex.pos = glm::vec3(tri_point.x, tri_point.y, tri_point.z);
-			vertexBuffer.push_back(vertex);
-
-			tri_point = tri_list[i].p[2];
-			vertex.pos = glm::vec3(tri_point.x, tri_point.y, tri_point.z);
-			vertexBuffer.push_back(vertex);
-		}
+		tri_point = tri.p[0];
+		glm::vec3 A = tri_point;
+		tri_point = tri.p[1];
+		glm::vec3 B = tri_point;
+		tri_point = tri.p[2];
+		glm::vec3 C = tri_point;
+		vertex.normal = glm::normalize(glm::cross((B - A), (C - A)));
+		vertex.tangent = glm::normalize((C - B));
+
+		tri_point = tri.p[0];
+		vertex.pos = glm::vec3(tri_point.x, tri_point.y, tri_point.z);
+		vertexBuffer.push_back(vertex);
+
+		tri_point = tri.p[1];
+		vertex.pos = glm::vec3(tri_point.x, tri_point.y, tri_point.z);
+		vertexBuffer.push_back(vertex);
+
+		tri_point = tri.p[2];
+		vertex.pos = glm::vec3(tri_point.x, tri_point.y, tri_point.z);
+		vertexBuffer.push_back(vertex);
 	}
-	void polygonizeVoxelsChunks(std::unordered_set<int>& damagedChunkIndices) {
-		for (const int& number : damagedChunkIndices) {
-			polygonizeVoxels(number);
+	void gen_vertex_buffers(std::vector<MarchingCube::TRIANGLE>& tri_list, std::vector<Vertex>& vertexBuffer) {
+		for (int i = 0; i < tri_list.size(); i++) {
+			gen_vertices(tri_list[i], vertexBuffer);
 		}
 	}
 	void polygonizeVoxels(int chunkIndex) {
@@ -1155,118 +2424,336 @@ public:
 		chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.clear();
 		// make new per-Chunk data
 		populate_chunk(chunkListBuffer[chunkIndex], chunkIndex, chunkListBuffer[chunkIndex]->grid_of_cells_per_chunk);
-		populate_triangles_list_chunk(chunkListBuffer[ chunkIndex ]->grid_of_cells_per_chunk, chunkListBuffer[ chunkIndex ]->tri_list_per_chunk);
-		// creating a buffer for an empty buffer (no vertex data) will cause error
-		if (chunkListBuffer[chunkIndex]->tri_list_per_chunk.size()) {
-			total_terrain_triangle_count += chunkListBuffer[chunkIndex]->tri_list_per_chunk.size();
-			gen_vertex_buffers(chunkListBuffer[chunkIndex]->tri_list_per_chunk, chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk);
-			// same thing with Init.
-			chunkListBuffer[chunkIndex]->vertices_per_chunk.count = static_cast<uint32_t>(chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.size());
-			uint32_t vertexBufferSize = chunkListBuffer[chunkIndex]->vertices_per_chunk.count * sizeof(Vertex);
-
-			vkDestroyBuffer(vulkanDevice->logicalDevice, chunkListBuffer[chunkIndex]->vertices_per_chunk.buffer, nullptr);
-			vkFreeMemory(vulkanDevice->logicalDevice, chunkListBuffer[chunkIndex]->vertices_per_chunk.memory, nullptr);
-			// VRAM (Staging) approach: VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-			//struct StagingBuffer {
-			//	VkBuffer buffer;
-			//	VkDeviceMemory memory;
-			//} vertexStaging;
-			//VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			//	VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			//	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			//	vertexBufferSize,
-			//	&vertexStaging.buffer,
-			//	&vertexStaging.memory,
-			//	chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.data()));
-			//VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			//	VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-			//	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			//	vertexBufferSize,
-			//	&chunkListBuffer[chunkIndex]->vertices_per_chunk.buffer,
-			//	&chunkListBuffer[chunkIndex]->vertices_per_chunk.memory,
-			//	nullptr));
-			//VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-			//VkBufferCopy copyRegion = {};
-			//copyRegion.size = vertexBufferSize;
-			//vkCmdCopyBuffer(copyCmd, vertexStaging.buffer, chunkListBuffer[chunkIndex]->vertices_per_chunk.buffer, 1, &copyRegion);
-			//vulkanDevice->flushCommandBuffer(copyCmd, queue, true);
-			//vkDestroyBuffer(vulkanDevice->logicalDevice, vertexStaging.buffer, nullptr);
-			//vkFreeMemory(vulkanDevice->logicalDevice, vertexStaging.memory, nullptr);
-
-			// RAM approach: VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-			//VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			//	VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-			//	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			//	vertexBufferSize,
-			//	&chunkListBuffer[chunkIndex]->vertices_per_chunk.buffer,
-			//	&chunkListBuffer[chunkIndex]->vertices_per_chunk.memory,
-			//	chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.data()));
-
-			// VRAM (Resizeable BAR) approach: VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-			VK_CHECK_RESULT(vulkanDevice->createBuffer(
-				VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-				vertexBufferSize,
-				&chunkListBuffer[chunkIndex]->vertices_per_chunk.buffer,
-				&chunkListBuffer[chunkIndex]->vertices_per_chunk.memory,
-				chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.data()));
+		populate_triangles_list_chunk(chunkListBuffer[ chunkIndex ]->grid_of_cells_per_chunk, chunkListBuffer[ chunkIndex ]->tri_list_per_chunk, chunkListBuffer[ chunkIndex ]->tri_count_per_cell);
+		total_terrain_triangle_count += chunkListBuffer[chunkIndex]->tri_list_per_chunk.size();
+		gen_vertex_buffers(chunkListBuffer[chunkIndex]->tri_list_per_chunk, chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk);
+		voxelNS::Mesh_Bounds(chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk, chunkListBuffer[chunkIndex]->boundsMin, chunkListBuffer[chunkIndex]->boundsMax);
+		voxelNS::Build_Meshlets(chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk, chunkListBuffer[chunkIndex]->meshlets);
+		uploadChunkVertices({ chunkIndex });
+		indirectDataDirty = true;
+	}
+	// Runs on a worker thread: only the cells touching the job's region are re-polygonized,
+	// the triangles and vertices of every other cell are copied over
+	void remeshRegion(MeshJob& job) {
+		int chunkIndex = job.region.chunkIndex;
+		const int cellDimension = CHUNK_DIMENSION - 1;
+		// A cell reads the voxels at its own coordinate and one further along each axis
+		glm::ivec3 cellMin = glm::max(job.region.min - glm::ivec3(1), glm::ivec3(0));
+		glm::ivec3 cellMax = glm::min(job.region.max, glm::ivec3(cellDimension - 1));
+
+		std::vector<MarchingCube::TRIANGLE> tri_list;
+		std::vector<Vertex> vertexBuffer;
+		tri_list.reserve(job.tri_list.size());
+		vertexBuffer.reserve(job.vertexBuffer.size());
+		size_t oldTriangle = 0;
+		for (int x = 0; x < cellDimension; x++) {
+			for (int y = 0; y < cellDimension; y++) {
+				for (int z = 0; z < cellDimension; z++) {
+					int cellIndex = (x * cellDimension + y) * cellDimension + z;
+					uint8_t oldCount = job.tri_count[cellIndex];
+					if (x < cellMin.x || y < cellMin.y || z < cellMin.z || x > cellMax.x || y > cellMax.y || z > cellMax.z) {
+						tri_list.insert(tri_list.end(), job.tri_list.begin() + oldTriangle, job.tri_list.begin() + oldTriangle + oldCount);
+						vertexBuffer.insert(vertexBuffer.end(), job.vertexBuffer.begin() + oldTriangle * 3, job.vertexBuffer.begin() + (oldTriangle + oldCount) * 3);
+					}
+					else {
+						job.grid[cellIndex] = populate_cell(job.voxel, job.brick4Any, job.brick4Full, chunkIndex, x, y, z);
+						size_t before = tri_list.size();
+						Polygonise_Cell(job.grid[cellIndex], tri_list);
+						for (size_t i = before; i < tri_list.size(); i++) {
+							gen_vertices(tri_list[i], vertexBuffer);
+						}
+						job.tri_count[cellIndex] = static_cast<uint8_t>(tri_list.size() - before);
+					}
+					oldTriangle += oldCount;
+				}
+			}
+		}
+		job.tri_list.swap(tri_list);
+		job.vertexBuffer.swap(vertexBuffer);
+		voxelNS::Mesh_Bounds(job.vertexBuffer, job.boundsMin, job.boundsMax);
+		voxelNS::Build_Meshlets(job.vertexBuffer, job.meshlets);
+	}
+	// Hands every dirty chunk without a job in flight to the worker pool, in chunkIndex order.
+	// Chunks edited while their job runs stay in dirtyChunks and go out once that job has been published.
+	void dispatchDirtyChunks() {
+		dirtyChunks.for_each([&](int chunkIndex) {
+			if (meshJobsInFlight.test(chunkIndex)) {
+				return;
+			}
+			Chunk* chunk = chunkListBuffer[chunkIndex];
+			std::shared_ptr<MeshJob> job = std::make_shared<MeshJob>();
+			job->generation = dirtyChunks.generation_of(chunkIndex);
+			job->region = dirtyChunks.take(chunkIndex);
+			memcpy(job->voxel, chunk->voxel, sizeof(chunk->voxel));
+			job->brick4Any = occupancy.brick4Any[chunkIndex];
+			job->brick4Full = occupancy.brick4Full[chunkIndex];
+			// The chunk's CPU side mesh is lent to the job and comes back with the result. The meshlets stay,
+			// they describe the vertices in the terrain heap and are built anew by the job.
+			job->grid.swap(chunk->grid_of_cells_per_chunk);
+			job->tri_list.swap(chunk->tri_list_per_chunk);
+			job->tri_count.swap(chunk->tri_count_per_cell);
+			job->vertexBuffer.swap(chunk->vertexBuffer_per_chunk);
+			total_terrain_triangle_count -= job->tri_list.size();
+			meshJobsInFlight.set(chunkIndex);
+			workerPool->push([this, job]() {
+				remeshRegion(*job);
+				std::lock_guard<std::mutex> lock(finishedMeshJobsLock);
+				finishedMeshJobs.push_back(job);
+			});
+		});
+	}
+	// Called once per frame on the render thread: swaps finished meshes in and uploads them. A chunk edited
+	// again while its job ran keeps the job's mesh on the CPU, as the follow-up job starts from it, but
+	// is not uploaded: the GPU keeps the last mesh until the follow-up job's result is current.
+	void publishFinishedMeshes() {
+		std::vector<std::shared_ptr<MeshJob>> finished;
+		{
+			std::lock_guard<std::mutex> lock(finishedMeshJobsLock);
+			finished.swap(finishedMeshJobs);
+		}
+		if (finished.empty()) {
+			return;
+		}
+		std::vector<int> uploads;
+		uploads.reserve(finished.size());
+		for (auto& job : finished) {
+			int chunkIndex = job->region.chunkIndex;
+			Chunk* chunk = chunkListBuffer[chunkIndex];
+			chunk->grid_of_cells_per_chunk.swap(job->grid);
+			chunk->tri_list_per_chunk.swap(job->tri_list);
+			chunk->tri_count_per_cell.swap(job->tri_count);
+			chunk->vertexBuffer_per_chunk.swap(job->vertexBuffer);
+			total_terrain_triangle_count += chunk->tri_list_per_chunk.size();
+			meshJobsInFlight.reset(chunkIndex);
+			if (job->generation != dirtyChunks.generation_of(chunkIndex)) {
+				continue;
+			}
+			chunk->meshlets.swap(job->meshlets);
+			chunk->boundsMin = job->boundsMin;
+			chunk->boundsMax = job->boundsMax;
+			uploads.push_back(chunkIndex);
+		}
+		uploadChunkVertices(uploads);
+		dispatchDirtyChunks();
+		indirectDataDirty = true;
+	}
+	// Moves the chunks' vertices into fresh ranges of the terrain heap, all copies in one submit.
+	// The new mesh is written next to the old one, which frames still in flight may be drawing: the old
+	// range goes back to the heap through the deletion queue once those frames have retired.
+	void uploadChunkVertices(const std::vector<int>& chunkIndices) {
+		std::vector<TerrainUpload> uploads;
+		uploads.reserve(chunkIndices.size());
+		for (int chunkIndex : chunkIndices) {
+			Vertices& vertices = chunkListBuffer[chunkIndex]->vertices_per_chunk;
+			uint32_t retired = vertices.allocation;
+			if (retired != TlsfAllocator::INVALID) {
+				deletionQueue.push([this, retired]() { terrainHeap.free(retired); });
+			}
+			vertices.count = static_cast<uint32_t>(chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.size());
+			// an empty chunk (no vertex data) keeps no range
+			vertices.allocation = terrainHeap.allocate(vertices.count, vertices.firstVertex);
+			if (vertices.count && vertices.allocation == TlsfAllocator::INVALID) {
+				// Over budget: the chunk waits for updateResidency, room is made at the far end of the world
+				uint32_t vertexCount = vertices.count;
+				setChunkEvicted(chunkIndex, true);
+				evictFarthestChunks(vertexCount, chunkDistance(chunkIndex));
+				continue;
+			}
+			setChunkEvicted(chunkIndex, false);
+			if (vertices.count) {
+				uploads.push_back({ vertices.firstVertex, chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.data(), static_cast<uint32_t>(vertices.count) });
+			}
+		}
+		terrainHeap.upload(uploads);
+	}
+	// Distance from the camera to the center of the chunk, in the same (negated) space as the camera
+	float chunkDistance(int chunkIndex) {
+		return glm::distance((voxelNS::chunkIndex_to_pos(chunkIndex) + glm::vec3(0.5f)) * (float)CHUNK_DIMENSION, -camera.position);
+	}
+	// An evicted chunk has no range and draws nothing, its mesh stays on the CPU for the next upload
+	void setChunkEvicted(int chunkIndex, bool evicted) {
+		Vertices& vertices = chunkListBuffer[chunkIndex]->vertices_per_chunk;
+		if (vertices.evicted != evicted) {
+			evictedChunkCount += evicted ? 1 : -1;
+			vertices.evicted = evicted;
+		}
+		if (evicted) {
+			vertices.count = 0;
+			vertices.allocation = TlsfAllocator::INVALID;
 		}
 	}
+	// Drops the meshes of the chunks farthest from the camera, beyond keepDistance, until vertexCount
+	// vertices are on their way back to the heap. The ranges are freed once the frames drawing them have
+	// retired; until then updateResidency does not ask for more.
+	uint32_t evictFarthestChunks(uint32_t vertexCount, float keepDistance) {
+		std::vector<std::pair<float, int>> candidates;
+		for (int chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
+			if (chunkListBuffer[chunkIndex]->vertices_per_chunk.allocation != TlsfAllocator::INVALID) {
+				float distance = chunkDistance(chunkIndex);
+				if (distance > keepDistance) {
+					candidates.push_back({ distance, chunkIndex });
+				}
+			}
+		}
+		std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<float, int>>());
+		uint32_t released = 0;
+		for (size_t i = 0; i < candidates.size() && released < vertexCount; i++) {
+			Vertices& vertices = chunkListBuffer[candidates[i].second]->vertices_per_chunk;
+			uint32_t retired = vertices.allocation;
+			uint32_t retiredCount = vertices.count;
+			deletionQueue.push([this, retired, retiredCount]() {
+				terrainHeap.free(retired);
+				pendingEvictedVertices -= retiredCount;
+			});
+			pendingEvictedVertices += retiredCount;
+			released += retiredCount;
+			setChunkEvicted(candidates[i].second, true);
+		}
+		if (released) {
+			indirectDataDirty = true;
+		}
+		return released;
+	}
+	// Called once per frame: uploads evicted chunks again, nearest first, evicting chunks farther away
+	// than the one coming back when the heap is full. Moving toward evicted terrain brings it back.
+	void updateResidency() {
+		memoryStrategy.update_budget();
+		// Nothing can change until evicted ranges come back or the camera moves to other chunks
+		if (evictedChunkCount == 0 || pendingEvictedVertices || camera.position == residencyBlockedAt) {
+			return;
+		}
+		std::vector<std::pair<float, int>> evicted;
+		for (int chunkIndex = 0; chunkIndex < CHUNK_COUNT; chunkIndex++) {
+			if (chunkListBuffer[chunkIndex]->vertices_per_chunk.evicted && !meshJobsInFlight.test(chunkIndex)) {
+				evicted.push_back({ chunkDistance(chunkIndex), chunkIndex });
+			}
+		}
+		std::sort(evicted.begin(), evicted.end());
+		std::vector<TerrainUpload> uploads;
+		for (size_t i = 0; i < evicted.size() && i < RESIDENCY_UPLOADS_PER_FRAME; i++) {
+			int chunkIndex = evicted[i].second;
+			Vertices& vertices = chunkListBuffer[chunkIndex]->vertices_per_chunk;
+			uint32_t vertexCount = static_cast<uint32_t>(chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.size());
+			vertices.allocation = terrainHeap.allocate(vertexCount, vertices.firstVertex);
+			if (vertexCount && vertices.allocation == TlsfAllocator::INVALID) {
+				if (!evictFarthestChunks(vertexCount, evicted[i].first)) {
+					residencyBlockedAt = camera.position;
+				}
+				break;
+			}
+			setChunkEvicted(chunkIndex, false);
+			vertices.count = vertexCount;
+			if (vertexCount) {
+				uploads.push_back({ vertices.firstVertex, chunkListBuffer[chunkIndex]->vertexBuffer_per_chunk.data(), vertexCount });
+			}
+		}
+		if (!uploads.empty()) {
+			terrainHeap.upload(uploads);
+			indirectDataDirty = true;
+		}
+	}
+	// Appends a row to the --memorystats file once per second
+	void writeMemoryStats() {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (!memoryStatsFile.is_open() || std::chrono::duration_cast<std::chrono::milliseconds>(now - lastMemoryStatsTime).count() < 1000) {
+			return;
+		}
+		lastMemoryStatsTime = now;
+		memoryStatsFile << std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() << "," << frameNumber;
+		memoryStrategy.write_stats(memoryStatsFile);
+		const UploadManager::Stats& uploadStats = uploadManager.statistics();
+		memoryStatsFile << "," << terrainHeap.used() << "," << terrainHeap.capacity() << "," << terrainHeap.largest_free() << "," << evictedChunkCount;
+		memoryStatsFile << "," << uploadStats.bytes << "," << uploadStats.submits << "," << uploadStats.ringWaits << "\n";
+		memoryStatsFile.flush();
+	}
+	// Creates the terrain heap with some headroom for edits and uploads every chunk
+	void uploadAllChunkVertices() {
+		uint32_t totalVertexCount = 0;
+		std::vector<int> chunkIndices(CHUNK_COUNT);
+		for (int i = 0; i < CHUNK_COUNT; i++) {
+			totalVertexCount += static_cast<uint32_t>(chunkListBuffer[i]->vertexBuffer_per_chunk.size());
+			chunkIndices[i] = i;
+		}
+		// Static data like vertex and index buffer should be stored on the device memory for optimal (and fastest) access by the GPU
+		//
+		// To achieve this we use so-called "staging buffers" :
+		// - Create a buffer that's visible to the host (and can be mapped)
+		// - Copy the data to this buffer
+		// - Create another buffer that's local on the device (VRAM) with the same size
+		// - Copy the data from the host to the device using a command buffer
+		// - Delete the host visible (staging) buffer
+		// - Use the device local buffers for rendering
+		//
+		// Note: On unified memory architectures where host (CPU) and GPU share the same memory, staging is not necessary
+		// To keep this sample easy to follow, there is no check for that in place
+		terrainHeap.create(&memoryStrategy, &uploadManager, &deletionQueue, totalVertexCount + totalVertexCount / 2);
+		uploadChunkVertices(chunkIndices);
+	}
 	void polygonizeVoxelsInit() {
 		for (int i = 0; i < CHUNK_COUNT; i++) {
 			chunkListBuffer[i] = new Chunk();
 			voxelNS::Fill_Chunk(chunkListBuffer[i]);
+			occupancy.Build_Chunk(chunkListBuffer[i], i);
 			//std::fill(chunkListBuffer[i]->voxel, chunkListBuffer[i]->voxel + CHUNK_DIMENSION * CHUNK_DIMENSION * CHUNK_DIMENSION, 1);
 		}
 		for (int i = 0; i < CHUNK_COUNT; i++) {
 			populate_chunk(chunkListBuffer[i], i, chunkListBuffer[i]->grid_of_cells_per_chunk);
 		}
 		for (int i = 0; i < CHUNK_COUNT; i++) {
-			populate_triangles_list_chunk(chunkListBuffer[i]->grid_of_cells_per_chunk, chunkListBuffer[i]->tri_list_per_chunk);
+			populate_triangles_list_chunk(chunkListBuffer[i]->grid_of_cells_per_chunk, chunkListBuffer[i]->tri_list_per_chunk, chunkListBuffer[i]->tri_count_per_cell);
 		}
 		total_terrain_triangle_count = 0;
 		for (int i = 0; i < CHUNK_COUNT; i++) {
 			total_terrain_triangle_count += chunkListBuffer[i]->tri_list_per_chunk.size();
 			gen_vertex_buffers(chunkListBuffer[i]->tri_list_per_chunk, chunkListBuffer[i]->vertexBuffer_per_chunk);
+			voxelNS::Mesh_Bounds(chunkListBuffer[i]->vertexBuffer_per_chunk, chunkListBuffer[i]->boundsMin, chunkListBuffer[i]->boundsMax);
+			voxelNS::Build_Meshlets(chunkListBuffer[i]->vertexBuffer_per_chunk, chunkListBuffer[i]->meshlets);
 		}
-		for (int i = 0; i < CHUNK_COUNT; i++) {
-			chunkListBuffer[i]->vertices_per_chunk.count = static_cast<uint32_t>(chunkListBuffer[i]->vertexBuffer_per_chunk.size());
-			uint32_t vertexBufferSize = chunkListBuffer[i]->vertices_per_chunk.count * sizeof(Vertex);
-			struct StagingBuffer {
-				VkBuffer buffer;
-				VkDeviceMemory memory;
-			} vertexStaging, indexStaging, voxelStaging;
-			if (vertexBufferSize) {
-				VK_CHECK_RESULT(vulkanDevice->createBuffer(
-					VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-					vertexBufferSize,
-					&vertexStaging.buffer,
-					&vertexStaging.memory,
-					chunkListBuffer[i]->vertexBuffer_per_chunk.data()));
-				VK_CHECK_RESULT(vulkanDevice->createBuffer(
-					VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-					vertexBufferSize,
-					&chunkListBuffer[i]->vertices_per_chunk.buffer,
-					&chunkListBuffer[i]->vertices_per_chunk.memory,
-					nullptr));
-				// Put buffer region copies into command buffer
-				VkBufferCopy copyRegion = {};
-				copyRegion.size = vertexBufferSize;
-				// Copy from staging buffers
-				VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-				vkCmdCopyBuffer(copyCmd, vertexStaging.buffer, chunkListBuffer[i]->vertices_per_chunk.buffer, 1, &copyRegion);
-				vulkanDevice->flushCommandBuffer(copyCmd, queue, true);
-				// Note: Staging buffer must not be deleted before the copies have been submitted and executed
-				vkDestroyBuffer(vulkanDevice->logicalDevice, vertexStaging.buffer, nullptr);
-				vkFreeMemory(vulkanDevice->logicalDevice, vertexStaging.memory, nullptr);
+	}
+	// Chunks [first, last) meshed and uploaded by startup thread threadID
+	void startupChunkRange(unsigned int threadID, int& first, int& last) {
+		first = (CHUNK_COUNT / numThreads) * threadID;
+		last = (CHUNK_COUNT / numThreads) * (threadID + 1);
+	}
+	// Filled by one startup thread for its own chunks, summed once every thread is done
+	struct StartupStats {
+		unsigned int triangleCount = 0;
+		unsigned int cachedChunks = 0; // meshes read from the mesh cache
+	};
+	// Takes the chunk's mesh from the mesh cache, false on a miss
+	bool loadCachedMesh(int chunkIndex) {
+		MeshCache::Mesh mesh;
+		if (!meshCache.find(chunkIndex, chunkVoxelHash[chunkIndex], mesh)) {
+			return false;
+		}
+		Chunk* chunk = chunkListBuffer[chunkIndex];
+		chunk->vertexBuffer_per_chunk.assign(mesh.vertices, mesh.vertices + mesh.vertexCount);
+		chunk->tri_count_per_cell.assign(mesh.triangleCounts, mesh.triangleCounts + CHUNK_CELL_COUNT);
+		// Every vertex holds its triangle's corner as is, see gen_vertices
+		chunk->tri_list_per_chunk.resize(mesh.vertexCount / 3);
+		for (uint32_t i = 0; i < mesh.vertexCount / 3; i++) {
+			for (int corner = 0; corner < 3; corner++) {
+				chunk->tri_list_per_chunk[i].p[corner] = mesh.vertices[i * 3 + corner].pos;
 			}
 		}
+		// remeshRegion only reads the cells it rebuilds, the grid just needs its size
+		chunk->grid_of_cells_per_chunk.resize(CHUNK_CELL_COUNT);
+		return true;
+	}
+	// Writes the startup meshes for the next launch
+	void saveMeshCache() {
+		std::vector<MeshCache::ChunkMesh> meshes(CHUNK_COUNT);
+		for (int i = 0; i < CHUNK_COUNT; i++) {
+			meshes[i] = { chunkVoxelHash[i], chunkListBuffer[i]->vertexBuffer_per_chunk.data(), static_cast<uint32_t>(chunkListBuffer[i]->vertexBuffer_per_chunk.size()), chunkListBuffer[i]->tri_count_per_cell.data() };
+		}
+		if (!MeshCache::write(MESH_CACHE_FILE, MESHER_VERSION, CHUNK_CELL_COUNT, meshes)) {
+			std::cerr << "Could not write the mesh cache " << MESH_CACHE_FILE << "\n";
+		}
 	}
-	void polygonizeVoxelsInitMultiThread(unsigned int threadID) {
-		int Lower_Chunk_Index = (CHUNK_COUNT / numThreads) * threadID;
-		int Upper_Chunk_Index = (CHUNK_COUNT / numThreads) * (threadID + 1);
+	// Counts only the thread's own chunks into stats, the caller sums the threads' stats
+	void polygonizeVoxelsInitMultiThread(unsigned int threadID, StartupStats& stats) {
+		int Lower_Chunk_Index, Upper_Chunk_Index;
+		startupChunkRange(threadID, Lower_Chunk_Index, Upper_Chunk_Index);
 		// Generate volumetric data
 		//voxelNS::Cube(glm::vec3(0, 0, 0), 1, voxelBuffer);
 		for (int i = Lower_Chunk_Index; i < Upper_Chunk_Index; i++) {
@@ -1277,193 +2764,253 @@ public:
 				voxelNS::Fill_Chunk(chunkListBuffer[i]);
 
 			}
+			occupancy.Build_Chunk(chunkListBuffer[i], i);
+		}
+		// Chunks whose voxels match the mesh cache skip the mesher
+		std::vector<bool> cached(Upper_Chunk_Index - Lower_Chunk_Index);
+		for (int i = Lower_Chunk_Index; i < Upper_Chunk_Index; i++) {
+			chunkVoxelHash[i] = MeshCache::hash(chunkListBuffer[i]->voxel, sizeof(chunkListBuffer[i]->voxel), i);
+			cached[i - Lower_Chunk_Index] = loadCachedMesh(i);
 		}
 		// Loop over a block of space. Based on the volumetric data, populate Grid cells with values 
 		//std::vector<MarchingCube::GRIDCELL> grid;
 		for (int i = Lower_Chunk_Index; i < Upper_Chunk_Index; i++) {
-			populate_chunk(chunkListBuffer[i], i, chunkListBuffer[i]->grid_of_cells_per_chunk);
+			if (!cached[i - Lower_Chunk_Index]) {
+				populate_chunk(chunkListBuffer[i], i, chunkListBuffer[i]->grid_of_cells_per_chunk);
+			}
 		}
 		// Run Marching Cube algorithm on each Grid cell, which returns a list of triangles based on the cells' value
 		for (int i = Lower_Chunk_Index; i < Upper_Chunk_Index; i++) {
-			populate_triangles_list_chunk(chunkListBuffer[i]->grid_of_cells_per_chunk, chunkListBuffer[i]->tri_list_per_chunk);
+			if (!cached[i - Lower_Chunk_Index]) {
+				populate_triangles_list_chunk(chunkListBuffer[i]->grid_of_cells_per_chunk, chunkListBuffer[i]->tri_list_per_chunk, chunkListBuffer[i]->tri_count_per_cell);
+			}
 		}
 		// Using the triangles list, Generate vertex and index buffers
 		//std::vector<uint32_t> indexBuffer;
-		total_terrain_triangle_count = 0;
+		stats = StartupStats();
 		for (int i = Lower_Chunk_Index; i < Upper_Chunk_Index; i++) {
-			total_terrain_triangle_count += chunkListBuffer[i]->tri_list_per_chunk.size();
-			gen_vertex_buffers(chunkListBuffer[i]->tri_list_per_chunk, chunkListBuffer[i]->vertexBuffer_per_chunk);
+			stats.triangleCount += chunkListBuffer[i]->tri_list_per_chunk.size();
+			if (cached[i - Lower_Chunk_Index]) {
+				stats.cachedChunks++;
+			}
+			else {
+				gen_vertex_buffers(chunkListBuffer[i]->tri_list_per_chunk, chunkListBuffer[i]->vertexBuffer_per_chunk);
+			}
+			voxelNS::Mesh_Bounds(chunkListBuffer[i]->vertexBuffer_per_chunk, chunkListBuffer[i]->boundsMin, chunkListBuffer[i]->boundsMax);
+			voxelNS::Build_Meshlets(chunkListBuffer[i]->vertexBuffer_per_chunk, chunkListBuffer[i]->meshlets);
 		}
-		// Static data like vertex and index buffer should be stored on the device memory for optimal (and fastest) access by the GPU
-		//
-		// To achieve this we use so-called "staging buffers" :
-		// - Create a buffer that's visible to the host (and can be mapped)
-		// - Copy the data to this buffer
-		// - Create another buffer that's local on the device (VRAM) with the same size
-		// - Copy the data from the host to the device using a command buffer
-		// - Delete the host visible (staging) buffer
-		// - Use the device local buffers for rendering
-		//
-		// Note: On unified memory architectures where host (CPU) and GPU share the same memory, staging is not necessary
-		// To keep this sample easy to follow, there is no check for that in place
-		for (int i = Lower_Chunk_Index; i < Upper_Chunk_Index; i++) {
-			chunkListBuffer[i]->vertices_per_chunk.count = static_cast<uint32_t>(chunkListBuffer[i]->vertexBuffer_per_chunk.size());
-			uint32_t vertexBufferSize = chunkListBuffer[i]->vertices_per_chunk.count * sizeof(Vertex);
-
-			//voxels.count = static_cast<uint32_t>(voxelBuffer.size());
-			//uint32_t voxelBufferSize = voxels.count * sizeof(glm::vec3);
-			struct StagingBuffer {
-				VkBuffer buffer;
-				VkDeviceMemory memory;
-			} vertexStaging, indexStaging, voxelStaging;
-
-			
-			if (vertexBufferSize) {
-				// Voxel buffer
-				//VK_CHECK_RESULT(vulkanDevice->createBuffer(
-				//	VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-				//	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-				//	voxelBufferSize,
-				//	&voxelStaging.buffer,
-				//	&voxelStaging.memory,
-				//	voxelBuffer.data()));
-		
-				// Create vulkanDevice local buffers
-				// // Voxel buffer
-				//VK_CHECK_RESULT(vulkanDevice->createBuffer(
-				//	VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-				//	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-				//	voxelBufferSize,
-				//	&voxels.buffer,
-				//	&voxels.memory,
-				//	nullptr));
-				
-				// Vertex buffer
-				VK_CHECK_RESULT(vulkanDevice->createBuffer(
-					VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-					vertexBufferSize,
-					&vertexStaging.buffer,
-					&vertexStaging.memory,
-					chunkListBuffer[i]->vertexBuffer_per_chunk.data()));
-				// Create vulkanDevice local buffers
-				VK_CHECK_RESULT(vulkanDevice->createBuffer(
-					VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-					vertexBufferSize,
-					&chunkListBuffer[i]->vertices_per_chunk.buffer,
-					&chunkListBuffer[i]->vertices_per_chunk.memory,
-					nullptr));
-
-				// Put buffer region copies into command buffer
-				VkBufferCopy copyRegion = {};
-				copyRegion.size = vertexBufferSize;
-
-				mutex_lock.lock(); // VkCommandPool cannot be access simultaneously
-				// Copy from staging buffers
-				VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-				
-				vkCmdCopyBuffer(copyCmd, vertexStaging.buffer, chunkListBuffer[i]->vertices_per_chunk.buffer, 1, &copyRegion);
-
-				//copyRegion.size = voxelBufferSize;
-				//vkCmdCopyBuffer(copyCmd, voxelStaging.buffer, voxels.buffer, 1, &copyRegion);
-
-				vulkanDevice->flushCommandBuffer(copyCmd, queue, true);
-
-				mutex_lock.unlock();
-
-				// Note: Staging buffer must not be deleted before the copies have been submitted and executed
-				vkDestroyBuffer(vulkanDevice->logicalDevice, vertexStaging.buffer, nullptr);
-				vkFreeMemory(vulkanDevice->logicalDevice, vertexStaging.memory, nullptr);
-				//vkDestroyBuffer(vulkanDevice->logicalDevice, voxelStaging.buffer, nullptr);
-				//vkFreeMemory(vulkanDevice->logicalDevice, voxelStaging.memory, nullptr);
+		// The vertices are uploaded once every thread is done, see uploadAllChunkVerticesMultiThread
+	}
+	// Writes and records the copies of the thread's chunks into its own staging region and command buffer
+	void uploadChunkVerticesMultiThread(unsigned int threadID, ParallelUpload* parallelUpload) {
+		int first, last;
+		startupChunkRange(threadID, first, last);
+		for (int i = first; i < last; i++) {
+			const Vertices& vertices = chunkListBuffer[i]->vertices_per_chunk;
+			if (vertices.count) {
+				parallelUpload->write(threadID, (VkDeviceSize)vertices.firstVertex * sizeof(Vertex), chunkListBuffer[i]->vertexBuffer_per_chunk.data(), vertices.count * sizeof(Vertex));
+			}
+		}
+		parallelUpload->finish(threadID);
+	}
+	// uploadAllChunkVertices for the startup threads: the ranges are handed out here (the allocator is not
+	// thread safe, and cheap next to the copies), then every thread copies its own chunks and all of their
+	// command buffers go out in one submit
+	void uploadAllChunkVerticesMultiThread() {
+		uint32_t totalVertexCount = 0;
+		for (int i = 0; i < CHUNK_COUNT; i++) {
+			totalVertexCount += static_cast<uint32_t>(chunkListBuffer[i]->vertexBuffer_per_chunk.size());
+		}
+		terrainHeap.create(&memoryStrategy, &uploadManager, &deletionQueue, totalVertexCount + totalVertexCount / 2);
+		std::vector<VkDeviceSize> threadBytes(numThreads, 0);
+		for (unsigned int threadID = 0; threadID < numThreads; threadID++) {
+			int first, last;
+			startupChunkRange(threadID, first, last);
+			for (int i = first; i < last; i++) {
+				Vertices& vertices = chunkListBuffer[i]->vertices_per_chunk;
+				vertices.count = static_cast<uint32_t>(chunkListBuffer[i]->vertexBuffer_per_chunk.size());
+				vertices.allocation = terrainHeap.allocate(vertices.count, vertices.firstVertex);
+				if (vertices.count && vertices.allocation == TlsfAllocator::INVALID) {
+					// Over budget, updateResidency brings in the chunks nearest to the camera first
+					setChunkEvicted(i, true);
+				}
+				threadBytes[threadID] += vertices.count * sizeof(Vertex);
+			}
+		}
+		ParallelUpload parallelUpload;
+		if (!parallelUpload.begin(vulkanDevice, &memoryStrategy, uploadManager, terrainHeap.vertexBuffer(), terrainHeap.mapped_vertices(), threadBytes)) {
+			// No room for a staging copy of the whole terrain, go through the staging ring instead
+			std::vector<TerrainUpload> uploads;
+			for (int i = 0; i < CHUNK_COUNT; i++) {
+				const Vertices& vertices = chunkListBuffer[i]->vertices_per_chunk;
+				if (vertices.count) {
+					uploads.push_back({ vertices.firstVertex, chunkListBuffer[i]->vertexBuffer_per_chunk.data(), static_cast<uint32_t>(vertices.count) });
+				}
 			}
+			terrainHeap.upload(uploads);
+			return;
+		}
+		std::vector<std::thread> threads;
+		for (unsigned int threadID = 0; threadID < numThreads; threadID++) {
+			threads.emplace_back(&VulkanExample::uploadChunkVerticesMultiThread, this, threadID, &parallelUpload);
+		}
+		for (auto& thread : threads) {
+			thread.join();
 		}
+		parallelUpload.submit();
 	}
 	void createVertexBuffer()
 	{
 		polygonizeVoxelsInit();
+		for (int i = 0; i < CHUNK_COUNT; i++) {
+			occupancy.Update_Coarse(i);
+		}
+		uploadAllChunkVertices();
 	}
 	void createVertexBufferMultiThread()
 	{
 		// Setup vertices
 		// multithread
 		std::vector<std::thread> threads;
+		std::vector<StartupStats> threadStats(numThreads);
+		meshCache.open(MESH_CACHE_FILE, MESHER_VERSION, CHUNK_COUNT, CHUNK_CELL_COUNT);
 		for (int threadID = 0; threadID < numThreads; threadID++) {
-			threads.emplace_back(&VulkanExample::polygonizeVoxelsInitMultiThread, this, threadID); /* Resource->Buffer */
+			threads.emplace_back(&VulkanExample::polygonizeVoxelsInitMultiThread, this, threadID, std::ref(threadStats[threadID])); /* Resource->Buffer */
 		}
 		// Wait for all threads to finish
 		for (auto& thread : threads) {
 			thread.join();
 		}
+		total_terrain_triangle_count = 0;
+		cachedStartupChunks = 0;
+		for (const StartupStats& stats : threadStats) {
+			total_terrain_triangle_count += stats.triangleCount;
+			cachedStartupChunks += stats.cachedChunks;
+		}
+		// Everything the mapping held has been copied out
+		meshCache.close();
+		if (cachedStartupChunks < CHUNK_COUNT) {
+			saveMeshCache();
+		}
+		for (int i = 0; i < CHUNK_COUNT; i++) {
+			occupancy.Update_Coarse(i);
+		}
+		uploadAllChunkVerticesMultiThread();
 	}
+	// One of each per frame slot, written every frame by updateUniformBuffer and updateUniformBufferComposition
 	void prepareUniformBuffers()
 	{
-		// Offscreen vertex shader / tessellation shader stages
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			&uniformBuffer,
-			sizeof(uniformData)));
-		// Particle shader
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			&uniformBuffers.fire,
-			sizeof(uboFire)));
-		// Deferred fragment shader
-		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			&uniformBuffers.composition,
-			sizeof(uboComposition)));
-
-		// Map persistent
-		VK_CHECK_RESULT(uniformBuffer.map());
-		VK_CHECK_RESULT(uniformBuffers.fire.map());
-		VK_CHECK_RESULT(uniformBuffers.composition.map());
-		updateUniformBuffer();
-		updateUniformBufferComposition();
+		for (uint32_t frameSlot = 0; frameSlot < FRAMES_IN_FLIGHT; frameSlot++) {
+			// Offscreen vertex shader / tessellation shader stages
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Uniforms,
+				&uniformBuffer[frameSlot],
+				sizeof(uniformData)));
+			// Particle shader
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Uniforms,
+				&uniformBuffers[frameSlot].fire,
+				sizeof(uboFire)));
+			// Deferred fragment shader
+			VK_CHECK_RESULT(memoryStrategy.createBuffer(
+				VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				MemoryUsage::Dynamic,
+				MemoryCategory::Uniforms,
+				&uniformBuffers[frameSlot].composition,
+				sizeof(uboComposition)));
+			// Deferred lights, grown when there are more of them
+			createLightBuffer(frameSlot, 256);
+
+			// Map persistent
+			VK_CHECK_RESULT(uniformBuffer[frameSlot].map());
+			VK_CHECK_RESULT(uniformBuffers[frameSlot].fire.map());
+			VK_CHECK_RESULT(uniformBuffers[frameSlot].composition.map());
+		}
 	}
 	void prepare()
 	{
 		// Order doesn't matter when placed on same line
 		VulkanExampleBase::prepare();
+		memoryStrategy.init(vulkanDevice, queue, deviceProperties.deviceType);
+		if (memoryBudgetSupported) {
+			memoryStrategy.enable_budget_query(instance, physicalDevice);
+		}
+		if (memoryStatsFile.is_open()) {
+			memoryStatsFile << "time_ms,frame";
+			memoryStrategy.write_stats_header(memoryStatsFile);
+			memoryStatsFile << ",terrain_vertices_used,terrain_vertices_capacity,terrain_largest_free,evicted_chunks,upload_bytes,upload_submits,upload_ring_waits\n";
+		}
 		loadAssets(); prepareOffscreenFramebuffer(); prepareParticles();
+		uploadManager.create(vulkanDevice, &memoryStrategy, UPLOAD_RING_SIZE, FRAMES_IN_FLIGHT);
+		VkFenceCreateInfo fenceCreateInfo = vks::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
+		for (VkFence& fence : frameFences) {
+			VK_CHECK_RESULT(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
+		}
 		createVertexBufferMultiThread();
 		prepareUniformBuffers();
 		setupDescriptorPool(); setupDescriptorSetLayout();
 
 		setupDescriptorSet(); // Buffer -> Descriptor
 		preparePipelines();
-		buildCommandBuffers();
-		buildDeferredCommandBuffer();
+		prepareDepthPyramid();
+		prepareLightCulling();
+		prepareLightVolumes();
+		prepareIndirectCulling();
+		prepareChunkCuller();
+		updateIndirectData();
+		prepareOffscreenCommandBuffers();
 		prepared = true;
 	}
-	void draw()
+	// The offscreen pass is submitted before the swap chain image is acquired, the composition into the
+	// image once the previous frame has finished with the UI overlay's buffers. Nothing waits for the queue
+	// to go idle, the frame slot's fence is waited on by beginFrame when the slot comes around again.
+	void draw(uint32_t frameSlot)
 	{
-		VulkanExampleBase::prepareFrame();
+		FrameCommands& frame = frameCommands[frameSlot];
 		// Offscreen rendering
-		// Wait for swap chain presentation to finish
-		submitInfo.pWaitSemaphores = &semaphores.presentComplete;
+		buildDeferredCommandBuffer(frameSlot);
+		// Wait for the vertex uploads of this frame
+		VkSemaphore uploadSemaphore = uploadManager.acquire_wait_semaphore();
+		VkPipelineStageFlags uploadWaitStage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+		submitInfo.waitSemaphoreCount = uploadSemaphore != VK_NULL_HANDLE ? 1 : 0;
+		submitInfo.pWaitSemaphores = &uploadSemaphore;
+		submitInfo.pWaitDstStageMask = &uploadWaitStage;
 		// Signal ready with offscreen semaphore
-		submitInfo.pSignalSemaphores = &offscreenSemaphore;
+		submitInfo.pSignalSemaphores = &frame.offscreenComplete;
 		// Submit work
 		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &offScreenCmdBuffer;
+		submitInfo.pCommandBuffers = &frame.commandBuffer;
 		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 
+		VulkanExampleBase::prepareFrame(frame.presentComplete);
+		// The overlay's vertex and index buffers are single, the previous frame's composition draws them
+		VkFence previousFence = frameFences[(frameSlot + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT];
+		VK_CHECK_RESULT(vkWaitForFences(device, 1, &previousFence, VK_TRUE, UINT64_MAX));
+		updateOverlay();
+
 		// Scene rendering
-		// Wait for offscreen semaphore
-		submitInfo.pWaitSemaphores = &offscreenSemaphore;
+		buildCompositionCommandBuffer(frameSlot);
+		// Wait for the offscreen pass and for swap chain presentation to finish
+		VkSemaphore compositionWaitSemaphores[2] = { frame.offscreenComplete, frame.presentComplete };
+		VkPipelineStageFlags compositionWaitStages[2] = { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, submitPipelineStages };
+		submitInfo.waitSemaphoreCount = 2;
+		submitInfo.pWaitSemaphores = compositionWaitSemaphores;
+		submitInfo.pWaitDstStageMask = compositionWaitStages;
 		// Signal ready with render complete semaphore
-		submitInfo.pSignalSemaphores = &semaphores.renderComplete;
+		submitInfo.pSignalSemaphores = &frame.renderComplete;
 		// Submit work
 		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
-		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+		submitInfo.pCommandBuffers = &frame.compositionCmdBuffer;
+		VkFence frameFence = frameFences[frameSlot];
+		VK_CHECK_RESULT(vkResetFences(device, 1, &frameFence));
+		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, frameFence));
 
-		VulkanExampleBase::submitFrame();
+		VulkanExampleBase::submitFrame(frame.renderComplete);
+		frameNumber++;
 	}
 
 	std::chrono::steady_clock::time_point lastTime_build_CMD_BUFFER;
@@ -1471,69 +3018,212 @@ public:
 	{
 		if (!prepared)
 			return;
-		draw();
+		beginFrame();
+		uint32_t frameSlot = frameNumber % FRAMES_IN_FLIGHT;
+		readCullStatistics();
+		readLightingTimestamps(frameSlot);
+		// Frame boundary: take in the shot and the meshes the workers finished since the last frame
+		publishFinishedShot();
+		publishFinishedMeshes();
+		updateResidency();
+		writeMemoryStats();
+		scriptCamera();
+		collideCamera();
+		// Every buffer the host writes is the frame slot's own, beginFrame has waited for its last frame
+		updateUniformBuffer(frameSlot);
 		if (!paused)
 		{
 			updateParticles();
-			updateUniformBufferComposition();
 		}
-		if (camera.updated)
-		{
-			updateUniformBuffer();
+		copyParticles(frameSlot);
+		updateHitLights();
+		updateUniformBufferComposition(frameSlot);
+		updateTerrainDraws();
+		draw(frameSlot);
+	}
+	// Lighting pass and composition of the frame slot's last frame, kept per mode to compare them
+	void readLightingTimestamps(uint32_t frameSlot)
+	{
+		int32_t mode = frameCommands[frameSlot].timestampLightingMode;
+		if (mode < 0) {
+			return;
 		}
-		// only happens every 1-2 second
-		std::chrono::steady_clock::time_point currentTime = std::chrono::steady_clock::now();
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - lastTime_build_CMD_BUFFER).count() >= 1000) {
-			buildDeferredCommandBuffer(); // Frustum culling
+		uint64_t timestamps[4];
+		if (vkGetQueryPoolResults(device, lightingQueryPool, frameSlot * 4, 4, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+			float period = deviceProperties.limits.timestampPeriod / 1000000.0f;
+			lightingMilliseconds[mode][0] = (timestamps[1] - timestamps[0]) * period;
+			lightingMilliseconds[mode][1] = (timestamps[3] - timestamps[2]) * period;
 		}
 	}
-	void update(float deltaTime) // for collision
+	// Counts the culling passes of the frame slot's last frame wrote, beginFrame has waited for that frame
+	void readCullStatistics()
 	{
-		camera.updated = false;
-		if (camera.moving())
-		{
-			glm::vec3 camFront;
-			camFront.x = -cos(glm::radians(camera.rotation.x)) * sin(glm::radians(camera.rotation.y));
-			camFront.y = sin(glm::radians(camera.rotation.x));
-			camFront.z = cos(glm::radians(camera.rotation.x)) * cos(glm::radians(camera.rotation.y));
-			camFront = glm::normalize(camFront);
-
-			float moveSpeed = deltaTime * camera.movementSpeed;
-
-			if (camera.keys.up)
-				camera.position += camFront * moveSpeed;
-			if (camera.keys.down)
-				camera.position -= camFront * moveSpeed;
-			if (camera.keys.left)
-				camera.position -= glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * moveSpeed;
-			if (camera.keys.right)
-				camera.position += glm::normalize(glm::cross(camFront, glm::vec3(0.0f, 1.0f, 0.0f))) * moveSpeed;
-		}
-		camera.updateViewMatrix();
-	};
+		const CullFrame& frame = cullFrames[frameNumber % FRAMES_IN_FLIGHT];
+		if (frame.frame == 0) {
+			return;
+		}
+		const uint32_t* regionDrawCounts = static_cast<const uint32_t*>(frame.indirectDrawCountBuffer.mapped);
+		indirectStats.earlyDrawCount = 0;
+		indirectStats.lateDrawCount = 0;
+		for (uint32_t region = 0; region < REGION_COUNT; region++) {
+			indirectStats.earlyDrawCount += regionDrawCounts[region];
+			indirectStats.lateDrawCount += regionDrawCounts[REGION_COUNT + region];
+		}
+		indirectStats.drawCount = indirectStats.earlyDrawCount + indirectStats.lateDrawCount;
+		indirectStats.frustumCount = regionDrawCounts[2 * REGION_COUNT];
+		indirectStats.chunkDrawCount = regionDrawCounts[2 * REGION_COUNT + 1];
+		indirectStats.meshletFrustumCulled = regionDrawCounts[2 * REGION_COUNT + 2];
+		indirectStats.meshletConeCulled = regionDrawCounts[2 * REGION_COUNT + 3];
+		if (cullStatsFile.is_open()) {
+			cullStatsFile << frame.frame << "," << indirectStats.frustumCount << "," << indirectStats.earlyDrawCount << "," << indirectStats.lateDrawCount << "," << indirectStats.frustumCount - indirectStats.chunkDrawCount;
+			cullStatsFile << "," << frame.cpuOccluded << "," << frame.cpuOcclusionMilliseconds;
+			cullStatsFile << "," << indirectStats.meshletFrustumCulled << "," << indirectStats.meshletConeCulled << "\n";
+		}
+	}
+	// With --cullstats the camera circles the planet at a fixed step per frame, looking at its center, so
+	// runs (e.g. --benchmark on any device) see the same views and the far side comes in and out of view
+	void scriptCamera()
+	{
+		if (!cullStatsFile.is_open()) {
+			return;
+		}
+		// In camera space, the negated world space of the chunks
+		glm::vec3 center = -glm::vec3((PLANET_DIMENSION / 2 - 0.5f) * CHUNK_DIMENSION);
+		float angle = glm::radians((float)(frameNumber % 360));
+		float distance = PLANET_DIMENSION * CHUNK_DIMENSION;
+		glm::vec3 position = center + glm::vec3(std::cos(angle) * distance, CHUNK_DIMENSION, std::sin(angle) * distance);
+		// Inverse of Camera::getCameraFront
+		glm::vec3 front = glm::normalize(center - position);
+		camera.setRotation(glm::vec3(glm::degrees(std::asin(front.y)), glm::degrees(std::atan2(-front.x, front.z)), 0.0f));
+		camera.setPosition(position);
+		// Moved along the path, not swept against the terrain
+		lastCameraPosition = position;
+	}
+	// Waits until the frame that used this frame's fence slot has finished on the GPU, whatever was
+	// replaced up to that frame is no longer referenced and can be released
+	void beginFrame()
+	{
+		VkFence frameFence = frameFences[frameNumber % FRAMES_IN_FLIGHT];
+		VK_CHECK_RESULT(vkWaitForFences(device, 1, &frameFence, VK_TRUE, UINT64_MAX));
+		deletionQueue.begin_frame(frameNumber, frameNumber > FRAMES_IN_FLIGHT ? frameNumber - FRAMES_IN_FLIGHT : DeletionQueue::NO_FRAME);
+	}
+	// The base class moves the camera after render(), so the move of the last frame is swept here,
+	// before the view matrix goes into the uniform buffer
+	void collideCamera()
+	{
+		if (cameraCollision && camera.position != lastCameraPosition) {
+			voxelNS::CollisionBody body;
+			body.center = lastCameraPosition;
+			body.halfExtents = glm::vec3(cameraHalfExtent);
+			body.motion = camera.position - lastCameraPosition;
+			voxelNS::Sweep_AABB(chunkListBuffer, occupancy, body);
+			if (body.blocked) {
+				camera.setPosition(lastCameraPosition + body.resolved);
+			}
+		}
+		lastCameraPosition = camera.position;
+	}
 	virtual void action()
 	{
 		std::chrono::steady_clock::time_point currentTime = std::chrono::steady_clock::now();
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - lastTime_build_CMD_BUFFER).count() >= 150) {
-			std::unordered_set<int> damagedChunkIndices;
-			glm::vec3 rayHitLocation;
-			if (voxelNS::RayCast(camera.position, camera.getCameraFront(), chunkListBuffer, emitter_positions, &rayHitLocation)) {
-				voxelNS::Remove_Voxel(rayHitLocation, chunkListBuffer, damagedChunkIndices);
-
-				if (lastHitPositionIndex <= max_emitters_count - 1) {
-					lastHitPositionIndex++;
-					emitter_positions[lastHitPositionIndex] = rayHitLocation;
-				}
-				else {
-					emitter_positions[0] = rayHitLocation;
-					lastHitPositionIndex = 0;
-				}
-				polygonizeVoxelsChunks(damagedChunkIndices);
-				buildDeferredCommandBuffer();
+		if (!shotInFlight && std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - lastTime_build_CMD_BUFFER).count() >= fireInterval) {
+			std::shared_ptr<ShotJob> job = std::make_shared<ShotJob>();
+			// The first pellet goes straight ahead, the others spiral out over the spread (golden angle apart)
+			glm::vec3 front = camera.getCameraFront();
+			glm::vec3 right = glm::normalize(glm::cross(front, std::abs(front.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f)));
+			glm::vec3 up = glm::cross(right, front);
+			job->origins.assign(shotPellets, camera.position);
+			job->directions.resize(shotPellets);
+			for (int32_t i = 0; i < shotPellets; i++) {
+				float radius = shotSpread * std::sqrt((float)i / (float)shotPellets);
+				float angle = (float)i * 2.39996323f;
+				job->directions[i] = glm::normalize(front + (right * std::cos(angle) + up * std::sin(angle)) * radius);
 			}
+			job->occupancy = occupancy;
+			shotInFlight = true;
+			workerPool->push([this, job]() {
+				fireShot(*job);
+				std::lock_guard<std::mutex> lock(finishedShotLock);
+				finishedShot = job;
+			});
 			lastTime_build_CMD_BUFFER = currentTime;
 		}
 	}
+	// Runs on a worker, see ShotJob
+	void fireShot(ShotJob& job) {
+		voxelNS::RayCastBatch(job.origins.data(), job.directions.data(), job.origins.size(), chunkListBuffer, job.occupancy, job.hits, std::numeric_limits<float>::infinity(), workerPool.get());
+		std::vector<voxelNS::Brush> brushes;
+		for (size_t i = 0; i < job.origins.size(); i++) {
+			if (job.hits.hit[i]) {
+				brushes.push_back(voxelNS::SphereBrush(job.origins[i] + job.directions[i] * job.hits.distance[i], 5.0f, voxelNS::BRUSH_SUBTRACT));
+			}
+		}
+		if (brushes.empty()) {
+			return;
+		}
+		// The light follows the hit closest to the middle of the spread
+		job.hit = true;
+		job.hitLocation = brushes[0].a;
+		std::copy(chunkListBuffer, chunkListBuffer + CHUNK_COUNT, job.target);
+		for (const voxelNS::Brush& brush : brushes) {
+			glm::ivec3 gridMin, gridMax;
+			if (!voxelNS::Brush_Grid_Bounds(brush, gridMin, gridMax)) {
+				continue;
+			}
+			glm::ivec3 chunkMin = gridMin / CHUNK_DIMENSION;
+			glm::ivec3 chunkMax = gridMax / CHUNK_DIMENSION;
+			for (int z = chunkMin.z; z <= chunkMax.z; z++) {
+				for (int y = chunkMin.y; y <= chunkMax.y; y++) {
+					for (int x = chunkMin.x; x <= chunkMax.x; x++) {
+						int chunkIndex = (z * PLANET_DIMENSION * PLANET_DIMENSION) + (y * PLANET_DIMENSION) + x;
+						if (job.target[chunkIndex] == chunkListBuffer[chunkIndex]) {
+							job.edited.push_back(std::make_unique<Chunk>());
+							memcpy(job.edited.back()->voxel, chunkListBuffer[chunkIndex]->voxel, sizeof(Chunk::voxel));
+							job.target[chunkIndex] = job.edited.back().get();
+						}
+					}
+				}
+			}
+		}
+		voxelNS::Apply_Brushes(brushes.data(), brushes.size(), job.target, job.dirtyRegions);
+		job.occupancy.Update(job.target, job.dirtyRegions);
+	}
+	// Called once per frame on the render thread, before publishFinishedMeshes: copies the edits of a
+	// finished shot into the live chunks and pyramid and hands the changed chunks to the mesher
+	void publishFinishedShot() {
+		std::shared_ptr<ShotJob> job;
+		{
+			std::lock_guard<std::mutex> lock(finishedShotLock);
+			job.swap(finishedShot);
+		}
+		if (!job) {
+			return;
+		}
+		shotInFlight = false;
+		if (!job->hit) {
+			return;
+		}
+		for (const voxelNS::DirtyRegion& region : job->dirtyRegions) {
+			memcpy(chunkListBuffer[region.chunkIndex]->voxel, job->target[region.chunkIndex]->voxel, sizeof(Chunk::voxel));
+		}
+		// Nothing but a shot writes the pyramid once the terrain is built
+		occupancy = job->occupancy;
+		if (hitLights.size() >= maxHitLights) {
+			hitLights.pop_front();
+		}
+		hitLights.push_back({ job->hitLocation, colors[hitLightColor], 0.0f });
+		hitLightColor = (hitLightColor + 1) % colors.size();
+		if (lastHitPositionIndex <= max_emitters_count - 1) {
+			lastHitPositionIndex++;
+			emitter_positions[lastHitPositionIndex] = job->hitLocation;
+		}
+		else {
+			emitter_positions[0] = job->hitLocation;
+			lastHitPositionIndex = 0;
+		}
+		dirtyChunks.mark(job->dirtyRegions);
+		dispatchDirtyChunks();
+	}
 	virtual void no_action() {
 		// Particle & Light location
 		for (int i = 0; i < lastHit_particle_count; i++) {
@@ -1542,16 +3232,38 @@ public:
 	}
 	virtual void OnUpdateUIOverlay(vks::UIOverlay *overlay)
 	{
-		if (!vulkanDevice->features.multiDrawIndirect) {
+		if (!drawIndirectCountSupported && !vulkanDevice->features.multiDrawIndirect) {
 			if (overlay->header("Info")) {
 				overlay->text("multiDrawIndirect not supported");
 			}
 		}
 		if (overlay->header("Settings")) {
 			overlay->checkBox("Freeze frustum", &fixedFrustum);
+			overlay->checkBox("Camera collision", &cameraCollision);
+			overlay->sliderInt("Shot pellets", &shotPellets, 1, 64);
+			overlay->sliderFloat("Shot spread", &shotSpread, 0.0f, 0.3f);
+			overlay->checkBox("Occlusion culling", &occlusionCulling);
+			overlay->checkBox("CPU occlusion culling", &cpuOcclusionCulling);
+			overlay->checkBox("Meshlet culling", &meshletCulling);
+			// Read by the next frame's command buffer and composition update
+			overlay->comboBox("Lighting", &lightingMode, { "Tiled", "Light volumes" });
 		}
 		if (overlay->header("Statistics")) {
-			//overlay->text("Visible objects: %d", indirectStats.drawCount);
+			overlay->text("Visible chunks: %u / %d, %u meshlets drawn (%s)", indirectStats.chunkDrawCount, CHUNK_COUNT, indirectStats.drawCount, drawIndirectCountSupported ? "vkCmdDrawIndirectCount" : "vkCmdDrawIndirect");
+			overlay->text("Occluded chunks: %u of %u in the frustum, %u meshlets disoccluded", indirectStats.frustumCount - indirectStats.chunkDrawCount, indirectStats.frustumCount, indirectStats.lateDrawCount);
+			overlay->text("Culled meshlets: %u outside the frustum, %u facing away", indirectStats.meshletFrustumCulled, indirectStats.meshletConeCulled);
+			overlay->text("Lights: %zu, binned into %ux%u tiles of at most %d", lights.size(), lightCulling.tileCountX, lightCulling.tileCountY, MAX_LIGHTS_PER_TILE);
+			if (lightingMode == LIGHTING_TILED) {
+				overlay->text("Tiles over %d lights: %u", MAX_LIGHTS_PER_TILE, lightCulling.overflowTiles);
+			}
+			if (lightingQueryPool != VK_NULL_HANDLE) {
+				overlay->text("Lighting GPU ms (pass + composition): tiled %.2f + %.2f, volumes %.2f + %.2f", lightingMilliseconds[LIGHTING_TILED][0], lightingMilliseconds[LIGHTING_TILED][1], lightingMilliseconds[LIGHTING_VOLUMES][0], lightingMilliseconds[LIGHTING_VOLUMES][1]);
+			}
+			else {
+				overlay->text("Lighting GPU ms: timestamps not supported");
+			}
+			overlay->text("Memory: %s, terrain heap %s", memoryStrategy.architecture_name(), terrainHeap.written_in_place() ? "written in place" : "staged");
+			overlay->text("Mesh cache: %u / %d chunks at startup", cachedStartupChunks, CHUNK_COUNT);
 			// in Vulkan, X -> -Z, Y -> X, Z -> -Y.
 			overlay->text("My Position: <X : %.1f, Y : %.1f, Z : %.1f>", camera.position.x, camera.position.y, camera.position.z);
 			overlay->text("RayHit: <X : %.1f, Y : %.1f, Z : %.1f>", emitter_positions[lastHitPositionIndex].x, emitter_positions[lastHitPositionIndex].y, emitter_positions[lastHitPositionIndex].z);
@@ -1568,10 +3280,7 @@ public:
 			//overlay->text("Movement Speed: %.1f", camera.movementSpeed);
 			//overlay->text("sizeof(chunkListBuffer): %d", debugDisplayTarget);
 		}
-		if (overlay->comboBox("Display", &debugDisplayTarget, { "Final composition", "Position", "Normals", "Albedo", "Specular" }))
-		{
-			updateUniformBufferComposition();
-		}
+		overlay->comboBox("Display", &debugDisplayTarget, { "Final composition", "Position", "Normals", "Albedo", "Specular" });
 		//if (overlay->header("Frustum")) {
 		//	//enum side { LEFT = 0, RIGHT = 1, TOP = 2, BOTTOM = 3, BACK = 4, FRONT = 5 };
 		//	overlay->text("LEFT: <X : %.1f, Y : %.1f, Z : %.1f, W : %.1f>", frustum.planes.data()[0].x, frustum.planes.data()[0].y, frustum.planes.data()[0].z, frustum.planes.data()[0].w);
@@ -1581,7 +3290,22 @@ public:
 		//	overlay->text("BACK/Near: <X : %.1f, Y : %.1f, Z : %.1f, W : %.1f>", frustum.planes.data()[4].x, frustum.planes.data()[4].y, frustum.planes.data()[4].z, frustum.planes.data()[4].w);
 		//	overlay->text("FRONT/Far: <X : %.1f, Y : %.1f, Z : %.1f, W : %.1f>", frustum.planes.data()[5].x, frustum.planes.data()[5].y, frustum.planes.data()[5].z, frustum.planes.data()[5].w);
 		//}
-		overlay->text("CommandBuffer build count: %d", cmdBufferBuildCount);
+		if (overlay->header("GPU memory")) {
+			for (int category = 0; category < static_cast<int>(MemoryCategory::Count); category++) {
+				overlay->text("%s: %.1f MB", MemoryStrategy::category_name(static_cast<MemoryCategory>(category)), memoryStrategy.category_used(static_cast<MemoryCategory>(category)) / (1024.0f * 1024.0f));
+			}
+			for (uint32_t heap = 0; heap < memoryStrategy.heap_count(); heap++) {
+				overlay->text("Heap %u: %.1f / %.1f MB", heap, memoryStrategy.heap_used(heap) / (1024.0f * 1024.0f), memoryStrategy.heap_budget(heap) / (1024.0f * 1024.0f));
+			}
+			overlay->text("Budget: %s", memoryStrategy.driver_budget() ? "VK_EXT_memory_budget" : "80% of each heap");
+			overlay->text("Terrain heap: %u / %u vertices, %u chunks evicted", terrainHeap.used(), terrainHeap.capacity(), evictedChunkCount);
+		}
+		overlay->text("Terrain regions: %u / %d visible, %u recorded in %.2f ms in %u lanes", visibleRegionCount, REGION_COUNT, regionRecorder.statistics().recorded, regionRecorder.statistics().milliseconds, regionRecorder.lane_count());
+		overlay->text("CPU frustum culling: %u chunks visible, %u boxes tested in %.3f ms", chunkCuller.statistics().visible, chunkCuller.statistics().nodesTested, chunkCuller.statistics().milliseconds);
+		if (cpuOcclusionCulling) {
+			const OcclusionRasterizer::Stats& occlusionStats = occlusionRasterizer.statistics();
+			overlay->text("CPU occlusion culling: %u / %u chunks occluded, %u occluder triangles in %.3f ms, tested in %.3f ms", occlusionStats.culled, occlusionStats.tested, occlusionStats.occluderTriangles, occlusionStats.rasterMilliseconds, occlusionStats.testMilliseconds);
+		}
 	}
 };
 